@@ -1,7 +1,9 @@
 #include <math.h>
+#include <sys/stat.h>
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 
 #include "ArgumentList.hh"
 #include "Codecs.hh"
@@ -14,6 +16,15 @@
 
 using namespace Utility;
 
+// FNV-1a, to key the logo cache
+static uint64_t fnv1a (const std::string& s)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (std::string::const_iterator it = s.begin(); it != s.end(); ++it)
+    h = (h ^ (uint8_t)*it) * 1099511628211ULL;
+  return h;
+}
+
 
 int main (int argc, char* argv[])
 {
@@ -48,7 +59,7 @@ int main (int argc, char* argv[])
   // matching options
 
   Argument<std::string> arg_logo ("L", "logo", "logo file",
-                                   1, 1);
+                                   0, 1);
 
   Argument<unsigned int> arg_features("F", "features", "maximum number of logo features",
 				      (unsigned int)10, 0, 1, false, false);
@@ -66,6 +77,10 @@ int main (int argc, char* argv[])
   Argument<unsigned int> arg_shift("R", "reduction", "coordinate bit reduction for pre-matching",
 				   (unsigned int)3, 0, 1, false, false);
 
+  Argument<std::string> arg_cache ("C", "cache",
+				   "binary logo cache file, created if missing or outdated",
+				   0, 1);
+
 
 
   
@@ -84,6 +99,7 @@ int main (int argc, char* argv[])
   arglist.Add (&arg_angle);
   arglist.Add (&arg_step);
   arglist.Add (&arg_shift);
+  arglist.Add (&arg_cache);
 
 
   // parse the specified argument list - and maybe output the Usage
@@ -103,9 +119,8 @@ int main (int argc, char* argv[])
     return 1;
   }
 
-  Image l_image;
-  if (!ImageCodec::Read (arg_logo.Get(), l_image)) {
-    std::cerr << "Error reading logo file." << std::endl;
+  if (!arg_logo.Size() && !arg_cache.Size()) {
+    std::cerr << "Either a logo or a logo cache file must be specified." << std::endl;
     return 1;
   }
 
@@ -146,17 +161,14 @@ int main (int argc, char* argv[])
   }
   
   optimize2bw (image, low, high, threshold, sloppy_threshold, radius, sd);
-  optimize2bw (l_image, low, high, threshold, sloppy_threshold, radius, sd);
 
   if (arg_threshold.Get() == 0)
     threshold = 200;
 
   FGMatrix mi(image, threshold);
-  FGMatrix ml(l_image, threshold);
 
   std::cout << "Contouring" << std::endl;
   Contours conti(mi);
-  Contours contl(ml);
   std::cout << "done." << std::endl;
 
 
@@ -199,7 +211,46 @@ int main (int argc, char* argv[])
   double max_angle=arg_angle.Get();
   double angle_step=arg_step.Get();
 
-  LogoRepresentation lrep(&contl, features, tolerance, shift, max_angle, angle_step);
+  // the logo file, as it is now, and how its contours are extracted
+  uint64_t origin = 0;
+  if (arg_logo.Size()) {
+    std::ostringstream key;
+    struct stat st;
+    key << arg_logo.Get() << '\n';
+    if (stat (arg_logo.Get().c_str(), &st) == 0)
+      key << st.st_size << ' ' << st.st_mtime << '\n';
+    key << low << ' ' << high << ' ' << threshold << ' '
+	<< sloppy_threshold << ' ' << radius << ' ' << sd;
+    origin = fnv1a (key.str());
+  }
+
+  // the preprocessed logo is cached, only extract it when there is no
+  // usable cache (or the logo or any of the parameters changed)
+  LogoRepresentation* cached = 0;
+  if (arg_cache.Size())
+    cached = LogoRepresentation::Load(arg_cache.Get());
+  if (cached && (!cached->Matches(features, tolerance, shift, max_angle, angle_step) ||
+		 (arg_logo.Size() && cached->origin != origin))) {
+    delete cached;
+    cached = 0;
+  }
+
+  Contours* contl = 0;
+  if (!cached) {
+    Image l_image;
+    if (!arg_logo.Size() || !ImageCodec::Read (arg_logo.Get(), l_image)) {
+      std::cerr << "Error reading logo file." << std::endl;
+      return 1;
+    }
+    optimize2bw (l_image, low, high, threshold, sloppy_threshold, radius, sd);
+    FGMatrix ml(l_image, threshold);
+    contl = new Contours(ml);
+    cached = new LogoRepresentation(contl, features, tolerance, shift, max_angle, angle_step);
+    cached->origin = origin;
+    if (arg_cache.Size() && !cached->Save(arg_cache.Get()))
+      std::cerr << "Error writing logo cache file." << std::endl;
+  }
+  LogoRepresentation& lrep = *cached;
   std::cout << "score: " << lrep.Score(&conti) << std::endl;
   int tx=lrep.logo_translation.first;
   int ty=lrep.logo_translation.second;
@@ -218,6 +269,9 @@ int main (int argc, char* argv[])
   }
 
 
+  delete cached;
+  delete contl;
+
   if (!ImageCodec::Write(arg_output.Get(), o_image)) {
     std::cerr << "Error writing output file." << std::endl;
     return 1;
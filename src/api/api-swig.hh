@@ -15,12 +15,18 @@
  * 
  */
 
-%module ExactImage
+// threads: only the batch functions release the interpreter lock (Python)
+%module(threads="1") ExactImage
+%nothread;
+%thread convertImages;
 
 %include "typemaps.i"
 
 %include "cstring.i"
 %include "std_string.i"
+%include "std_vector.i"
+
+%template(StringVector) std::vector<std::string>;
 
 # manually include it, otherwise SWIG will not source it
 %include "config.h"
@@ -29,5 +35,58 @@
 #include "api.hh"
 %}
 
+#ifdef SWIGPYTHON
+// the buffer functions use the memory of any buffer protocol object in
+// place, it is released when the wrapper returns
+%{
+#include <limits.h>
+
+struct PyBufferRef {
+  Py_buffer view;
+  bool held;
+  PyBufferRef () : held (false) {}
+  ~PyBufferRef () { if (held) PyBuffer_Release (&view); }
+};
+%}
+
+%typemap(in) (const char* buffer, int size) (PyBufferRef ref) {
+  if (PyObject_GetBuffer ($input, &ref.view, PyBUF_SIMPLE) != 0)
+    SWIG_fail;
+  ref.held = true;
+  if (ref.view.len > INT_MAX) {
+    PyErr_SetString (PyExc_OverflowError, "buffer larger than 2 GiB");
+    SWIG_fail;
+  }
+  $1 = (char*) ref.view.buf;
+  $2 = (int) ref.view.len;
+}
+
+%typemap(in) (char* buffer, int size) (PyBufferRef ref) {
+  if (PyObject_GetBuffer ($input, &ref.view, PyBUF_WRITABLE) != 0)
+    SWIG_fail;
+  ref.held = true;
+  if (ref.view.len > INT_MAX) {
+    PyErr_SetString (PyExc_OverflowError, "buffer larger than 2 GiB");
+    SWIG_fail;
+  }
+  $1 = (char*) ref.view.buf;
+  $2 = (int) ref.view.len;
+}
+
+// writable view of imagePixelData, without a copy
+%inline %{
+PyObject* imagePixelView (Image* image)
+{
+  char* data = (char*) imagePixelData (image);
+  const Py_ssize_t size = (Py_ssize_t) imageStride (image) * imageHeight (image);
+#if PY_VERSION_HEX >= 0x03030000
+  return PyMemoryView_FromMemory (data, size, PyBUF_WRITE);
+#else
+  return PyBuffer_FromReadWriteMemory (data, size);
+#endif
+}
+%}
+#endif
+
 /* Parse the header file to generate wrappers */
 %include "api.hh"
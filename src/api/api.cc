@@ -18,6 +18,9 @@
  */
 
 #include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <string>
 #include <vector>
@@ -27,6 +30,7 @@
 
 #include <Image.hh>
 #include <Codecs.hh>
+#include <BufferPool.hh>
 
 #include <rotate.hh>
 #include <scale.hh>
@@ -38,29 +42,49 @@
 #include <empty-page.hh>
 #include <ContourMatching.hh>
 
+#include "memstream.hh"
+
 #include "Tokenizer.hh"	// barcode decoding
 #include "Scanner.hh"
+#include "Decoder.hh"
 
 #include <vectorial.hh>
 
 #include "api.hh"
 
 
-// initializer
-
-static Image::iterator background_color;
-static Image::iterator foreground_color;
+// the drawing state, the functions without context use the default one
 
-struct it_color_init
+class ApiContext
 {
-  it_color_init (Image::iterator& it, double r, double g, double b, double a)
+public:
+  ApiContext ()
+    : width (1)
   {
-     it.type = Image::RGB8A;
-     it.setRGBA(r, g, b, a);
+    background.type = Image::RGB8A;
+    background.setRGBA (0., 0., 0., 1.);
+    foreground.type = Image::RGB8A;
+    foreground.setRGBA (1., 1., 1., 1.);
   }
+  
+  Image::iterator background;
+  Image::iterator foreground;
+  
+  double width;
+  std::vector <double> dash;
 };
-static it_color_init bg_color_init (background_color, 0, 0, 0, 1);
-static it_color_init fg_color_init (foreground_color, 1, 1, 1, 1);
+
+static ApiContext default_context;
+
+ApiContext* newContext ()
+{
+  return new ApiContext;
+}
+
+void deleteContext (ApiContext* context)
+{
+  delete context;
+}
 
 
 Image* newImage ()
@@ -69,6 +93,14 @@ Image* newImage ()
 }
 Image* newImageWithTypeAndSize (unsigned int samplesPerPixel, unsigned int bitsPerSample,
 				unsigned int width, unsigned int height, int fill)
+{
+  return contextNewImageWithTypeAndSize (&default_context, samplesPerPixel,
+					 bitsPerSample, width, height, fill);
+}
+
+Image* contextNewImageWithTypeAndSize (ApiContext* context,
+				       unsigned int samplesPerPixel, unsigned int bitsPerSample,
+				       unsigned int width, unsigned int height, int fill)
 {
   Image* image = newImage();
   image->spp = samplesPerPixel;
@@ -81,7 +113,7 @@ Image* newImageWithTypeAndSize (unsigned int samplesPerPixel, unsigned int bitsP
     memset(image->getRawData(), 0, image->stride() * image->h);
   else {
     double r = 0, g = 0, b = 0, a = 0;
-    background_color.getRGBA(r, g, b, a);
+    context->background.getRGBA(r, g, b, a);
     
     Image::iterator it = image->begin();
     // optimization: only set FP based values once, copy the rest
@@ -105,40 +137,91 @@ Image* copyImage (Image* other)
   return image;
 }
 
-bool decodeImage (Image* image, const std::string& data)
+CodecSession* newCodecSession ()
 {
-  std::istringstream stream (data);
+  return new CodecSession;
+}
 
-  return ImageCodec::Read (&stream, *image);
+void deleteCodecSession (CodecSession* session)
+{
+  delete session;
 }
 
-bool decodeImage (Image* image, char* data, int n)
+bool decodeImage (Image* image, const std::string& data, const char* decompress)
 {
-  const std::string str (data, n); 
+  Utility::memistream stream (data.data(), data.size());
+
+  return ImageCodec::Read (&stream, *image, "", decompress);
+}
+
+bool decodeImage (Image* image, char* data, int n, const char* decompress)
+{
+  Utility::memistream stream (data, n);
+  
+  return ImageCodec::Read (&stream, *image, "", decompress);
+}
+
+bool decodeImageBuffer (Image* image, const char* buffer, int size,
+			const char* decompress)
+{
+  Utility::memistream stream (buffer, size);
   
-  return decodeImage (image, str);
+  return ImageCodec::Read (&stream, *image, "", decompress);
 }
 
-bool decodeImageFile (Image* image, const char* filename)
+bool decodeImageFile (Image* image, const char* filename, const char* decompress)
 {
-  return ImageCodec::Read (filename, *image);
+  return ImageCodec::Read (filename, *image, decompress);
+}
+
+int probeImage (Image* image, const std::string& data)
+{
+  Utility::memistream stream (data.data(), data.size());
+
+  return ImageCodec::Probe (&stream, *image);
+}
+
+int probeImage (Image* image, char* data, int n)
+{
+  Utility::memistream stream (data, n);
+
+  return ImageCodec::Probe (&stream, *image);
+}
+
+int probeImageFile (Image* image, const char* filename)
+{
+  return ImageCodec::Probe (filename, *image);
 }
 
 void encodeImage (char **s, int *slen,
 		  Image* image, const char* codec, int quality,
 		  const char* compression)
 {
-  std::ostringstream stream (""); // empty string to start with
+  // encoded right into the returned, malloc()ed buffer
+  Utility::memostream stream;
   
-  ImageCodec::Write (&stream, *image, codec, "", quality, compression);
+  if (!ImageCodec::Write (&stream, *image, codec, "", quality, compression)) {
+    *s = 0;
+    *slen = 0;
+    return;
+  }
   stream.flush();
   
-  char* payload = (char*) malloc (stream.str().size());
+  *slen = stream.rdbuf()->size();
+  *s = stream.rdbuf()->release();
+}
+
+int encodeImageBuffer (Image* image, char* buffer, int size,
+		       const char* codec, int quality,
+		       const char* compression)
+{
+  Utility::memostream stream (buffer, size);
   
-  memcpy (payload, stream.str().c_str(), stream.str().size());
+  if (!ImageCodec::Write (&stream, *image, codec, "", quality, compression))
+    return 0;
+  stream.flush();
   
-  *s = payload;
-  *slen = stream.str().size();
+  return stream.rdbuf()->size();
 }
 
 const std::string encodeImage (Image* image, const char* codec, int quality,
@@ -158,6 +241,120 @@ bool encodeImageFile (Image* image, const char* filename,
   return ImageCodec::Write (filename, *image, quality, compression);
 }
 
+// batch processing
+
+typedef std::vector<std::pair<std::string, std::string> > operations_t;
+
+// "name[=value],..." into names and values
+static operations_t parseOperations (const std::string& operations)
+{
+  operations_t ops;
+  for (std::string::size_type pos = 0; pos < operations.size();) {
+    std::string::size_type end = operations.find (',', pos);
+    if (end == std::string::npos)
+      end = operations.size();
+    const std::string op = operations.substr (pos, end - pos);
+    pos = end + 1;
+    if (op.empty())
+      continue;
+    
+    const std::string::size_type eq = op.find ('=');
+    ops.push_back (std::make_pair (op.substr (0, eq),
+				   eq == std::string::npos ? "" : op.substr (eq + 1)));
+  }
+  return ops;
+}
+
+static bool applyOperation (ApiContext* context, Image& image,
+			    const std::string& name, const std::string& value)
+{
+  // numeric arguments, : separated
+  std::vector<double> v;
+  for (std::string::size_type pos = 0; pos < value.size();) {
+    std::string::size_type end = value.find (':', pos);
+    if (end == std::string::npos)
+      end = value.size();
+    v.push_back (atof (value.substr (pos, end - pos).c_str()));
+    pos = end + 1;
+  }
+  
+  if (name == "colorspace")
+    return colorspace_by_name (image, value);
+  else if (name == "scale" && (v.size() == 1 || v.size() == 2))
+    scale (image, v[0], v.back());
+  else if (name == "fit" && v.size() == 2) {
+    // down to fit into w:h, keeping the aspect ratio
+    if (image.w <= 0 || image.h <= 0)
+      return false;
+    const double factor = std::min (v[0] / image.w, v[1] / image.h);
+    if (factor < 1)
+      scale (image, factor, factor);
+  }
+  else if (name == "rotate" && v.size() == 1)
+    rotate (image, v[0], context->background);
+  else if (name == "flipx")
+    flipX (image);
+  else if (name == "flipy")
+    flipY (image);
+  else if (name == "crop" && v.size() == 4)
+    crop (image, (int)v[0], (int)v[1], (unsigned int)v[2], (unsigned int)v[3]);
+  else if (name == "autocrop")
+    fastAutoCrop (image);
+  else if (name == "normalize")
+    normalize (image);
+  else if (name == "invert")
+    invert (image);
+  else
+    return false;
+  
+  return true;
+}
+
+std::vector<std::string> convertImages (const std::vector<std::string>& images,
+					const char* operations, const char* codec,
+					int quality, const char* compression,
+					ApiContext* context)
+{
+  if (!context)
+    context = &default_context;
+  
+  const operations_t ops = parseOperations (operations ? operations : "");
+  // a leading colorspace can already be reduced to while decoding
+  const std::string decompress =
+    !ops.empty() && ops[0].first == "colorspace" ? ops[0].second : "";
+  
+  const int n = images.size();
+  std::vector<std::string> results (n);
+  
+  // an image per worker thread, serially without OpenMP; the codecs'
+  // own parallel loops are not nested into it
+  #pragma omp parallel
+  {
+    // the codec contexts of each worker are reused for all its images
+    CodecSession session;
+    
+    #pragma omp for schedule (dynamic, 1)
+    for (int i = 0; i < n; ++i)
+      {
+	Image image;
+	Utility::memistream stream (images[i].data(), images[i].size());
+	if (!ImageCodec::Read (&stream, image, "", decompress))
+	  continue;
+	
+	bool ok = true;
+	for (unsigned int j = 0; ok && j < ops.size(); ++j)
+	  ok = applyOperation (context, image, ops[j].first, ops[j].second);
+	
+	std::ostringstream out;
+	if (ok && ImageCodec::Write (&out, image, codec, "", quality,
+				     compression ? compression : ""))
+	  results[i] = out.str();
+      }
+  }
+  
+  return results;
+}
+
 
 // image properties
 int imageChannels (Image* image)
@@ -180,6 +377,20 @@ int imageHeight (Image* image)
   return image->h;
 }
 
+int imageStride (Image* image)
+{
+  // the stride of the data imagePixelData() returns, which packs views
+  return image->packedStride ();
+}
+
+unsigned char* imagePixelData (Image* image)
+{
+  // unshared and decoded, marked modified for the writes
+  uint8_t* data = image->getRawData ();
+  image->setRawData ();
+  return data;
+}
+
 int imageXres (Image* image)
 {
   return image->resolutionX();
@@ -243,13 +454,24 @@ void imageResize (Image* image, int x, int y)
 
 void imageRotate (Image* image, double angle)
 {
-  rotate (*image, angle, background_color);
+  contextImageRotate (&default_context, image, angle);
+}
+
+void contextImageRotate (ApiContext* context, Image* image, double angle)
+{
+  rotate (*image, angle, context->background);
 }
 
 Image* copyImageCropRotate (Image* image, int x, int y,
 			   unsigned int w, unsigned int h, double angle)
 {
-  return copy_crop_rotate (*image, x, y, w, h, angle, background_color);
+  return contextCopyImageCropRotate (&default_context, image, x, y, w, h, angle);
+}
+
+Image* contextCopyImageCropRotate (ApiContext* context, Image* image, int x, int y,
+				   unsigned int w, unsigned int h, double angle)
+{
+  return copy_crop_rotate (*image, x, y, w, h, angle, context->background);
 }
 
 void imageFlipX (Image* image)
@@ -301,71 +523,93 @@ void imageFastAutoCrop (Image* image)
 
 void setForegroundColor (double r, double g, double b, double a)
 {
-  foreground_color.setRGBA(r, g, b, a);
+  contextSetForegroundColor (&default_context, r, g, b, a);
 }
 
 void setBackgroundColor (double r, double g, double b, double a)
 {
-  background_color.setRGBA(r, g, b, a);
+  contextSetBackgroundColor (&default_context, r, g, b, a);
 }
 
-// vector elements
+void contextSetForegroundColor (ApiContext* context, double r, double g, double b, double a)
+{
+  context->foreground.setRGBA(r, g, b, a);
+}
 
-class drawStyle
+void contextSetBackgroundColor (ApiContext* context, double r, double g, double b, double a)
 {
-public:
-  drawStyle ()
-    : width (1) {
-  }
-  
-  double width;
-  std::vector <double> dash;
-} style;
+  context->background.setRGBA(r, g, b, a);
+}
+
+// vector elements
 
 void setLineWidth (double width)
 {
-  style.width = width;
+  contextSetLineWidth (&default_context, width);
 }
 
-void color_to_path (Path& p)
+void contextSetLineWidth (ApiContext* context, double width)
+{
+  context->width = width;
+}
+
+static void color_to_path (ApiContext* context, Path& p)
 {
   double r = 0, g = 0, b = 0, a = 0;
-  foreground_color.getRGBA (r, g, b, a);
+  context->foreground.getRGBA (r, g, b, a);
   p.setFillColor (r, g, b, a);
 }
 
 void imageDrawLine (Image* image, double x, double y, double x2, double y2)
+{
+  contextImageDrawLine (&default_context, image, x, y, x2, y2);
+}
+
+void contextImageDrawLine (ApiContext* context, Image* image,
+			   double x, double y, double x2, double y2)
 {
   Path path;
   path.moveTo (x, y);
   path.addLineTo (x2, y2);
 
-  path.setLineWidth (style.width);
-  path.setLineDash (0, style.dash);
+  path.setLineWidth (context->width);
+  path.setLineDash (0, context->dash);
   
-  color_to_path(path);
+  color_to_path(context, path);
   path.draw (*image);
 }
 
 void imageDrawRectangle (Image* image, double x, double y, double x2, double y2)
+{
+  contextImageDrawRectangle (&default_context, image, x, y, x2, y2);
+}
+
+void contextImageDrawRectangle (ApiContext* context, Image* image,
+				double x, double y, double x2, double y2)
 {
   Path path;
   path.addRect (x, y, x2, y2);
-  path.setLineWidth (style.width);
-  path.setLineDash (0, style.dash);
+  path.setLineWidth (context->width);
+  path.setLineDash (0, context->dash);
   path.setLineJoin (agg::miter_join);
   
-  color_to_path(path);
+  color_to_path(context, path);
   path.draw (*image);
 }
 
 #if WITHFREETYPE == 1
 void imageDrawText (Image* image, double x, double y, char* text,
                     double height, const char* fontfile)
+{
+  contextImageDrawText (&default_context, image, x, y, text, height, fontfile);
+}
+
+void contextImageDrawText (ApiContext* context, Image* image, double x, double y,
+			   char* text, double height, const char* fontfile)
 {
   Path path;
   
-  color_to_path(path);
+  color_to_path(context, path);
   path.moveTo (x, y);
   path.drawText (*image, text, height, fontfile);
 }
@@ -373,7 +617,13 @@ void imageDrawText (Image* image, double x, double y, char* text,
 void imageDrawTextOnPath (Image* image, Path* path, char* text,
 			  double height, const char* fontfile)
 {
-  color_to_path(*path);
+  contextImageDrawTextOnPath (&default_context, image, path, text, height, fontfile);
+}
+
+void contextImageDrawTextOnPath (ApiContext* context, Image* image, Path* path,
+				 char* text, double height, const char* fontfile)
+{
+  color_to_path(context, *path);
   path->drawTextOnPath (*image, text, height, fontfile);
 }
 #endif
@@ -419,14 +669,24 @@ void pathClose(Path* path)
 
 void pathStroke(Path* path, Image* image)
 {
-  color_to_path(*path);
-  path->setLineWidth (style.width);
-  path->draw(*image, Path::fill_none);
+  contextPathStroke(&default_context, path, image);
 }
 
 void pathFill(Path* path, Image* image)
 {
-  color_to_path(*path);
+  contextPathFill(&default_context, path, image);
+}
+
+void contextPathStroke(ApiContext* context, Path* path, Image* image)
+{
+  color_to_path(context, *path);
+  path->setLineWidth (context->width);
+  path->draw(*image, Path::fill_none);
+}
+
+void contextPathFill(ApiContext* context, Path* path, Image* image)
+{
+  color_to_path(context, *path);
   path->draw(*image, Path::fill_non_zero);
 }
 
@@ -498,6 +758,16 @@ void deleteRepresentation(LogoRepresentation* representation)
   delete representation;
 }
 
+LogoRepresentation* newRepresentationFromCache(const char* filename)
+{
+  return LogoRepresentation::Load(filename);
+}
+
+bool saveRepresentation(LogoRepresentation* representation, const char* filename)
+{
+  return representation->Save(filename);
+}
+
 double matchingScore(LogoRepresentation* representation, Contours* image_contours)
 {
   return representation->Score(image_contours);
@@ -605,7 +875,7 @@ char** imageDecodeBarcodesExt (Image* im, const char* c,
 
   // a copy we can mangle
   Image* image = new Image;
-  *image = *im; // deep copy
+  *image = *im; // copy on write
   
   int xres = 300;
   if (image->resolutionX() != 0)
@@ -643,9 +913,10 @@ char** imageDecodeBarcodesExt (Image* im, const char* c,
     int new_stride = (stride + stride_align - 1) / stride_align * stride_align;
     
     // realloc the data to the maximal working set of memory we
-    // might have to work with in the worst-case
+    // might have to work with in the worst-case, pooled buffers are
+    // already aligned, decoder allocated ones might not be
     image->setRawDataWithoutDelete ((uint8_t*)
-      realloc (image->getRawData(), new_stride * image->h + base_align));
+      BufferPool::Reallocate (image->getRawData(), new_stride * image->h + base_align));
     malloced_data = image->getRawData();
     uint8_t* new_data = (uint8_t*) (((long)image->getRawData() + base_align - 1) & ~(base_align-1));
     
@@ -766,10 +1037,10 @@ char** imageDecodeBarcodesExt (Image* im, const char* c,
   bbitmap.bmType = 1; // bitmap type version, fixed v1
   bbitmap.bmWidth = image->w;
   bbitmap.bmHeight = image->h;
+  bbitmap.bmBits = image->getRawData(); // our class' bitmap data
   bbitmap.bmWidthBytes = image->stride();
   bbitmap.bmPlanes = 1; // the library is documented to only take 1
   bbitmap.bmBitsPixel = image->bps * image->spp; // 1, 4 and 8 appeared to work
-  bbitmap.bmBits = image->getRawData(); // our class' bitmap data
   
   if (debug)
     std::cerr << "  @: " << (void*) image->getRawData()
@@ -838,53 +1109,57 @@ namespace {
         return result;
     }
 
+    // the | separated code list, e.g. CODE39|CODE128|EAN13 or ANY
+    codes_t parse_codes (const char* codestr)
+    {
+        codes_t codes = 0;
+        std::string c (codestr);
+        std::transform (c.begin(), c.end(), c.begin(), tolower);
+        std::string::size_type it = 0;
+        std::string::size_type it2;
+        do {
+            it2 = c.find ('|', it);
+            std::string code;
+            if (it2 != std::string::npos) {
+                code = c.substr (it, it2-it);
+                it = it2 + 1;
+            }
+            else
+                code = c.substr (it);
+
+            if (code.empty())
+                continue;
+            if (code == "code39")
+                codes |= code39;
+            else if (code == "code128")
+                codes |= code128 | gs1_128;
+            else if (code == "code25")
+                codes |= code25i;
+            else if (code == "ean13")
+                codes |= ean13;
+            else if (code == "ean8")
+                codes |= ean8;
+            else if (code == "upca")
+                codes |= upca;
+            else if (code == "upce")
+                codes |= upce;
+            else if (code == "any")
+                codes |= ean|code128|gs1_128|code39|code25i;
+            else
+                std::cerr << "Unrecognized barcode type: " << code << std::endl;
+        } while (it2 != std::string::npos);
+        return codes;
+    }
+
 }
 
 char** imageDecodeBarcodes (Image* image, const char* codestr,
 			    unsigned int min_length, unsigned int max_length,
                             int multiple, unsigned int line_skip, int dirs)
 {
-  codes_t codes = 0;
-  // parse the code list
-  std::string c (codestr);
-  std::transform (c.begin(), c.end(), c.begin(), tolower);
-  std::string::size_type it = 0;
-  std::string::size_type it2;
-  do
-    {
-      it2 = c.find ('|', it);
-      std::string code;
-      if (it2 !=std::string::npos) {
-	code = c.substr (it, it2-it);
-	it = it2 + 1;
-      }
-      else
-	code = c.substr (it);
-      
-      if (!code.empty())
-	{
-	  if (code == "code39")
-	    codes |= code39;
-	  else if (code == "code128")
-	    codes |= code128 | gs1_128;
-	  else if (code == "code25")
-	    codes |= code25i;
-	  else if (code == "ean13")
-	    codes |= ean13;
-	  else if (code == "ean8")
-	    codes |= ean8;
-	  else if (code == "upca")
-	    codes |= upca;
-	  else if (code == "upce")
-	    codes |= upce;
-          else if (code == "any") {
-	    codes |= ean|code128|gs1_128|code39|code25i;
-	  }
-	  else
-	    std::cerr << "Unrecognized barcode type: " << code << std::endl;
-	}
-    }
-  while (it2 != std::string::npos);
+  const codes_t codes = parse_codes (codestr);
+  // the scanner's const iterators only know direct colors
+  colorspace_de_palette (*image);
 
   const int threshold = 150;
   const directions_t directions = (directions_t)dirs;
@@ -936,3 +1211,55 @@ char** imageDecodeBarcodes (Image* image, const char* codestr,
   
   return (char**)cret;
 }
+
+char** imageDecodeBarcodesRegions (Image* image, const char* codestr,
+				   const char* regionstr, int max_codes,
+				   unsigned int min_length, unsigned int max_length,
+				   unsigned int line_skip, int dirs, int threads)
+{
+  // x, y, w, h of each region, none found in a malformed list
+  std::vector<int> regions;
+  for (const char* r = regionstr; r && *r;) {
+    int v[4];
+    int n = 0;
+    if (sscanf (r, "%d,%d,%d,%d%n", &v[0], &v[1], &v[2], &v[3], &n) != 4 || !n) {
+      char** cret = (char**)malloc (sizeof(char*));
+      cret[0] = 0;
+      return cret;
+    }
+    regions.insert (regions.end(), v, v + 4);
+    r = strchr (r + n, '|');
+    if (r)
+      ++r;
+  }
+
+  BarDecode::Decoder decoder (parse_codes (codestr), (directions_t)dirs,
+			      max_codes, min_length, max_length, line_skip);
+  if (regions.empty())
+    decoder.scan (*image, threads);
+
+  // each read in place through a view, the scanner takes the luminance
+  // of any colorspace
+  for (unsigned int i = 0; i < regions.size(); i += 4)
+    if (decoder.scan (*image, regions[i], regions[i+1], regions[i+2],
+		      regions[i+3], threads))
+      break;
+
+  const std::vector<scanner_result_t>& found = decoder.results();
+  char** cret = (char**)malloc (sizeof(char*) * (found.size() * 4 + 1));
+  int i = 0;
+  for (std::vector<scanner_result_t>::const_iterator it = found.begin();
+       it != found.end(); ++it) {
+    std::stringstream type, pos, dir;
+    type << it->type;
+    pos << it->x << "," << it->y;
+    dir << (int)it->direction;
+    cret[i++] = strdup (it->code.c_str());
+    cret[i++] = strdup (type.str().c_str());
+    cret[i++] = strdup (pos.str().c_str());
+    cret[i++] = strdup (dir.str().c_str());
+  }
+  cret[i] = 0;
+
+  return cret;
+}
@@ -32,11 +32,19 @@
  */
 
 #include <string>
+#include <vector>
 
 #include "config.h"
 
 class Image; // just forward, never ever care about the internal layout
 
+// The drawing state (fore- and background color, line width) is held
+// by a context. The functions without one use a process wide default
+// context, for concurrent use give each thread its own.
+class ApiContext; // just forward
+ApiContext* newContext ();
+void deleteContext (ApiContext* context);
+
 // instanciate new image class
 Image* newImage ();
 
@@ -47,6 +55,9 @@ Image* newImage ();
 Image* newImageWithTypeAndSize (unsigned int samplesPerPixel, // e.g. 3
 				unsigned int bitsPerSample, // e.g. 8
 				unsigned int width, unsigned int height, int fill = 0);
+Image* contextNewImageWithTypeAndSize (ApiContext* context,
+				       unsigned int samplesPerPixel, unsigned int bitsPerSample,
+				       unsigned int width, unsigned int height, int fill = 0);
 
 // destroy image instance
 void deleteImage (Image* image);
@@ -55,21 +66,53 @@ void deleteImage (Image* image);
 Image* copyImage (Image* image);
 Image* copyImageCropRotate (Image* image, int x, int y,
 			   unsigned int w, unsigned int h, double angle);
+Image* contextCopyImageCropRotate (ApiContext* context, Image* image, int x, int y,
+				   unsigned int w, unsigned int h, double angle);
+
+class CodecSession; // just forward
+
+// keep the codec contexts (libjpeg, zlib, ...) of the calling thread
+// for the following de- and encodes, until the session is deleted -
+// worthwhile for many small images, delete it in the same thread
+CodecSession* newCodecSession ();
+void deleteCodecSession (CodecSession* session);
 
 // decode image from memory data of size n
 #if defined(SWIG) && !defined(SWIG_CSTRING_UNIMPL)
 %apply (char *STRING, int LENGTH) { (char *data, int n) };
 #endif
 #if !defined(SWIG) || (defined(SWIG) && !defined(SWIG_CSTRING_UNIMPL))
-bool decodeImage (Image* image, char* data, int n);
+bool decodeImage (Image* image, char* data, int n, const char* decompress = "");
 #endif
 
 #if !defined(SWIG) || (defined(SWIG) && defined(SWIG_CSTRING_UNIMPL))
-bool decodeImage (Image* image, const std::string& data);
+bool decodeImage (Image* image, const std::string& data, const char* decompress = "");
+#endif
+
+// decode image in place from a caller provided buffer, in Python from
+// any object supporting the buffer protocol (bytes, bytearray,
+// memoryview, mmap, NumPy arrays, ...) without copying it
+#if !defined(SWIG) || defined(SWIGPYTHON)
+bool decodeImageBuffer (Image* image, const char* buffer, int size,
+			const char* decompress = "");
 #endif
 
 // decode image from given filename
-bool decodeImageFile (Image* image, const char* filename);
+// the optional decompress option may limit the decoded colorspace,
+// e.g. "gray8" if only the luminance is of interest
+bool decodeImageFile (Image* image, const char* filename, const char* decompress = "");
+
+// only read the meta data (imageWidth, imageHeight, imageXres, ...) but
+// no pixel data, returns the number of images (pages) in the file
+#if !defined(SWIG) || (defined(SWIG) && !defined(SWIG_CSTRING_UNIMPL))
+int probeImage (Image* image, char* data, int n);
+#endif
+
+#if !defined(SWIG) || (defined(SWIG) && defined(SWIG_CSTRING_UNIMPL))
+int probeImage (Image* image, const std::string& data);
+#endif
+
+int probeImageFile (Image* image, const char* filename);
 
 
 // encode image to memory, the data is newly allocated and returned
@@ -88,10 +131,34 @@ const std::string encodeImage (Image* image, const char* codec, int quality = 75
                                const char* compression = "");
 #endif
 
+// encode image into a caller provided buffer, in Python any writable
+// buffer object, returns the size of the encoded image - if larger than
+// the buffer only its start was stored and the call can be repeated
+// with at least that size - and 0 if the image could not be encoded
+#if !defined(SWIG) || defined(SWIGPYTHON)
+int encodeImageBuffer (Image* image, char* buffer, int size,
+		       const char* codec, int quality = 75,
+		       const char* compression = "");
+#endif
+
 // encode image into specified filename
 bool encodeImageFile (Image* image, const char* filename,
 		      int quality = 75, const char* compression = "");
 
+// Batch: decodes each of the encoded images, applies the operations
+// and encodes the result with codec, in parallel on all cores and
+// without holding the interpreter lock of the script bindings. The
+// operations are a comma separated list of:
+//   colorspace=<name>, scale=<f>[:<fy>], fit=<w>:<h> (only down),
+//   rotate=<angle>, flipx, flipy, crop=<x>:<y>:<w>:<h>, autocrop,
+//   normalize, invert
+// e.g. "colorspace=gray,fit=160:160". Images that failed are returned
+// as empty string. The context's background is used for rotation.
+std::vector<std::string> convertImages (const std::vector<std::string>& images,
+					const char* operations, const char* codec,
+					int quality = 75, const char* compression = "",
+					ApiContext* context = 0);
+
 
 // image properties
 int imageChannels (Image* image);
@@ -100,6 +167,17 @@ int imageChannelDepth (Image* image);
 int imageWidth (Image* image);
 int imageHeight (Image* image);
 
+// bytes per row of the pixel data
+int imageStride (Image* image);
+
+// the pixel data, imageHeight rows of imageStride bytes, for direct read
+// and write access - valid until the image is modified or deleted by
+// other functions; in Python imagePixelView returns a memoryview of it,
+// e.g. numpy.frombuffer (view, numpy.uint8).reshape (height, stride)
+#ifndef SWIG
+unsigned char* imagePixelData (Image* image);
+#endif
+
 // returns the name of the image colorspace such as gray, gray2, gray4, rgb8, rgb16, cymk8, cymk16 ...
 const char* imageColorspace (Image* image);
 
@@ -128,6 +206,7 @@ bool imageConvertColorspace (Image* image, const char* target_colorspace, int th
 
 void imageResize (Image* image, int x, int y);
 void imageRotate (Image* image, double angle);
+void contextImageRotate (ApiContext* context, Image* image, double angle);
 
 void imageFlipX (Image* image);
 void imageFlipY (Image* image);
@@ -152,6 +231,8 @@ void imageFastAutoCrop (Image* image);
 
 void setForegroundColor (double r, double g, double b, double a = 1.0);
 void setBackgroundColor (double r, double g, double b, double a = 1.0);
+void contextSetForegroundColor (ApiContext* context, double r, double g, double b, double a = 1.0);
+void contextSetBackgroundColor (ApiContext* context, double r, double g, double b, double a = 1.0);
 
 void imageNormalize (Image* image);
 
@@ -163,6 +244,11 @@ void imageHueSaturationLightness (Image* image, double hue, double saturation, d
 void setLineWidth (double width);
 void imageDrawLine (Image* image, double x, double y, double x2, double y2);
 void imageDrawRectangle (Image* image, double x, double y, double x2, double y2);
+void contextSetLineWidth (ApiContext* context, double width);
+void contextImageDrawLine (ApiContext* context, Image* image,
+			   double x, double y, double x2, double y2);
+void contextImageDrawRectangle (ApiContext* context, Image* image,
+				double x, double y, double x2, double y2);
 
 class Path; // external path
 Path* newPath();
@@ -178,12 +264,18 @@ void pathClose(Path* path);
 
 void pathStroke(Path* path, Image* image);
 void pathFill(Path* path, Image* image);
+void contextPathStroke(ApiContext* context, Path* path, Image* image);
+void contextPathFill(ApiContext* context, Path* path, Image* image);
 
 #if WITHFREETYPE == 1
 void imageDrawText(Image* image, double x, double y, char* text,
 		   double height, const char* fontfile = NULL);
 void imageDrawTextOnPath(Image* image, Path* path, char* text,
 			 double height, const char* fontfile = NULL);
+void contextImageDrawText(ApiContext* context, Image* image, double x, double y,
+			  char* text, double height, const char* fontfile = NULL);
+void contextImageDrawTextOnPath(ApiContext* context, Image* image, Path* path,
+				char* text, double height, const char* fontfile = NULL);
 #endif
 
 
@@ -293,6 +385,23 @@ char** imageDecodeBarcodes (Image* image, const char* codes,
                             unsigned int max_length = 0,
                             int multiple = 0, unsigned int line_skip = 8, int directions = 0xf);
 
+/* streaming recognition, e.g. to route by the first Code128 of a cover
+   sheet: only scans the regions, "x,y,w,h" separated by | (all of the
+   image if empty), through a view of the pixel data without converting
+   it, and stops as soon as max_codes distinct codes are confirmed (0
+   for all) - codes with a checksum (EAN, UPC, Code128) by one read,
+   the others by two. Returned are groups of four strings in the order
+   found: the code, its type, the position "x,y" in the image and the
+   direction (bitfield value as above) it was read in. The regions are
+   scanned in bands by as many threads, with the same results. Nothing
+   is scanned, and none returned, for a malformed region list. */
+char** imageDecodeBarcodesRegions (Image* image, const char* codes,
+				   const char* regions = "", int max_codes = 0,
+				   unsigned int min_length = 0,
+				   unsigned int max_length = 0,
+				   unsigned int line_skip = 8, int directions = 0xf,
+				   int threads = 1);
+
 /* contour matching functions
  * attention:
  * this part of the api is in an evaluation phase and not yet written in stone !!
@@ -317,6 +426,11 @@ LogoRepresentation* newRepresentation(Contours* logo_contours,
 
 void deleteRepresentation(LogoRepresentation* representation);
 
+// binary cache of the preprocessed logo, to avoid re-extracting the
+// logo contours on every run - returns 0 if the cache is not usable
+LogoRepresentation* newRepresentationFromCache(const char* filename);
+bool saveRepresentation(LogoRepresentation* representation, const char* filename);
+
 double matchingScore(LogoRepresentation* representation, Contours* image_contours);
 
 // theese are valid after call to MatchingScore()
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+#include <pthread.h>
+#include <ctype.h>
+
+#include <algorithm>
+
+#include "Decoder.hh"
+#include "Colorspace.hh"
+
+namespace BarDecode
+{
+
+    namespace
+    {
+        // scan lines per band, as multiple of the line_skip the lines
+        // are at the same positions as in one scan of the whole region
+        const int band_lines = 8;
+
+        const int concurrent_lines = 4;
+
+        std::string filter_non_printable(const std::string& s)
+        {
+            std::string result;
+            for (size_t i = 0; i < s.size(); ++i) {
+                if ( isprint((unsigned char)s[i]) ) result.push_back(s[i]);
+            }
+            return result;
+        }
+    };
+
+    struct Decoder::job
+    {
+        const Decoder* decoder;
+        const Image* image;
+        pos_t x, y;
+        int w, h;
+        int size; // pixels per band
+        int rows, columns; // horizontal and vertical bands
+        // shared by the workers, only accessed atomically
+        int next; // band to scan next
+        int stop; // a band alone confirmed enough codes
+        std::vector<std::vector<scanner_result_t> > found; // per band
+
+        // band to scan next, -1 when done
+        int take()
+        {
+            if (__sync_fetch_and_add(&stop, 0)) return -1;
+            const int band = __sync_fetch_and_add(&next, 1);
+            return band < rows + columns ? band : -1;
+        }
+    };
+
+    namespace
+    {
+        // reads of the view at x, y into found, or decoder if there
+        // is no band list, until the decoder is done
+        template<bool vertical>
+        void scan_view(const Image& view, pos_t x, pos_t y,
+                       threshold_t threshold, codes_t codes, directions_t directions,
+                       int line_skip, Decoder& decoder,
+                       std::vector<scanner_result_t>* found)
+        {
+            BarcodeIterator<vertical> it(&view, threshold, codes, directions,
+                                         concurrent_lines, line_skip);
+            for (; ! it.end(); ++it) {
+                scanner_result_t r = *it;
+                if (! r) continue;
+                r.x += x;
+                r.y += y;
+                if (found) found->push_back(r);
+                if (decoder.add(r)) return;
+            }
+        }
+    };
+
+    Decoder::Decoder(codes_t codes, directions_t directions, int max_codes,
+                     unsigned int min_length, unsigned int max_length,
+                     int line_skip, threshold_t threshold) :
+        codes(codes),
+        directions(directions),
+        max_codes(max_codes),
+        min_length(min_length),
+        max_length(max_length),
+        line_skip(line_skip),
+        threshold(threshold)
+    {}
+
+    bool Decoder::add(scanner_result_t r)
+    {
+        if (! r || done()) return done();
+        r.code = filter_non_printable(r.code);
+        if (min_length && r.code.size() < min_length) return false;
+        if (max_length && r.code.size() > max_length) return false;
+
+        std::map<scanner_result_t,int,less>::iterator it =
+            reads.insert(std::make_pair(r, 0)).first;
+        const int needed = (r.type&(ean|code128|gs1_128)) ? 1 : 2;
+        if (++it->second == needed)
+            confirmed.push_back(it->first);
+        return done();
+    }
+
+    void Decoder::scan_band(job& j, int band, Decoder& decoder,
+                            std::vector<scanner_result_t>* found) const
+    {
+        Image view;
+        if (band < j.rows) {
+            const pos_t y = j.y + band * j.size;
+            view.subImage(*j.image, j.x, y, j.w, std::min(j.size, j.y + j.h - y));
+            scan_view<false>(view, j.x, y, threshold, codes, directions,
+                             line_skip, decoder, found);
+        } else {
+            const pos_t x = j.x + (band - j.rows) * j.size;
+            view.subImage(*j.image, x, j.y, std::min(j.size, j.x + j.w - x), j.h);
+            scan_view<true>(view, x, j.y, threshold, codes,
+                            (directions_t) ((directions&(top_down|down_top))>>1),
+                            line_skip, decoder, found);
+        }
+    }
+
+    void* Decoder::worker(void* arg)
+    {
+        job& j = *(job*)arg;
+        const Decoder& d = *j.decoder;
+        for (int band; (band = j.take()) >= 0;) {
+            // confirmations of the band alone, for the early stop
+            Decoder local(d.codes, d.directions, d.max_codes,
+                          d.min_length, d.max_length, d.line_skip, d.threshold);
+            d.scan_band(j, band, local, &j.found[band]);
+            if (local.done())
+                __sync_bool_compare_and_swap(&j.stop, 0, 1);
+        }
+        return 0;
+    }
+
+    bool Decoder::scan(const Image& image, int threads)
+    {
+        return scan(image, 0, 0, image.w, image.h, threads);
+    }
+
+    bool Decoder::scan(const Image& image, pos_t x, pos_t y, int w, int h, int threads)
+    {
+        // limit to the image
+        if (x < 0) { w += x; x = 0; }
+        if (y < 0) { h += y; y = 0; }
+        w = std::min(w, image.w - x);
+        h = std::min(h, image.h - y);
+        if (w <= 0 || h <= 0 || done())
+            return done();
+
+        // the workers take views of a copy of our own: the lazily created
+        // shared pixel data and the palette expansion are done here, once
+        Image base;
+        base = image;
+        if (base.isIndexed())
+            colorspace_de_palette(base);
+
+        job j;
+        j.decoder = this;
+        j.image = &base;
+        j.x = x; j.y = y; j.w = w; j.h = h;
+        j.size = band_lines * std::max(line_skip, 1);
+        j.rows = directions&(left_right|right_left) ? (h + j.size - 1) / j.size : 0;
+        j.columns = directions&(top_down|down_top) ? (w + j.size - 1) / j.size : 0;
+        j.next = 0; // before the workers are started
+        j.stop = 0;
+
+        if (threads <= 1 || j.rows + j.columns <= 1) {
+            for (int band; ! done() && (band = j.take()) >= 0;)
+                scan_band(j, band, *this, 0);
+            return done();
+        }
+
+        // the calling thread is one of the workers
+        j.found.resize(j.rows + j.columns);
+        std::vector<pthread_t> workers(std::min(threads, j.rows + j.columns) - 1);
+        unsigned int started = 0;
+        for (; started < workers.size(); ++started)
+            if (pthread_create(&workers[started], 0, worker, &j) != 0)
+                break;
+        worker(&j);
+        for (unsigned int i = 0; i < started; ++i)
+            pthread_join(workers[i], 0);
+
+        // in band order, as scanned in one thread
+        for (unsigned int band = 0; band < j.found.size(); ++band)
+            for (unsigned int i = 0; i < j.found[band].size(); ++i)
+                if (add(j.found[band][i])) return true;
+        return done();
+    }
+
+}; // namespace BarDecode
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* The Decoder collects the reads of the BarcodeIterator into distinct,
+ * confirmed codes: codes with a checksum (EAN, UPC, Code128) by one
+ * read, the others by two. It scans regions of an image through
+ * sub-image views, in bands of lines that can be scanned by several
+ * threads, and stops as soon as max_codes are confirmed. The results
+ * are the same (and in the same order) with any number of threads.
+ */
+
+#ifndef _DECODER_HH_
+#define _DECODER_HH_
+
+#include <map>
+#include <vector>
+#include <string>
+
+#include "Scanner.hh"
+
+namespace BarDecode
+{
+
+    class Decoder
+    {
+    public:
+        Decoder(codes_t codes = any_code,
+                directions_t directions = any_direction,
+                int max_codes = 0, // 0 for all
+                unsigned int min_length = 0,
+                unsigned int max_length = 0,
+                int line_skip = 8,
+                threshold_t threshold = 150);
+
+        // scans the image, or a region of it, in as many threads, true
+        // once max_codes are confirmed
+        bool scan(const Image& image, int threads = 1);
+        bool scan(const Image& image, pos_t x, pos_t y, int w, int h, int threads = 1);
+
+        // adds a read, true once max_codes are confirmed
+        bool add(scanner_result_t r);
+
+        bool done() const { return max_codes && (int)confirmed.size() >= max_codes; }
+
+        // in the order they got confirmed, positions in image coordinates
+        const std::vector<scanner_result_t>& results() const { return confirmed; }
+
+    private:
+        struct less
+        {
+            bool operator() (const scanner_result_t& a, const scanner_result_t& b) const
+            {
+                if (a.type != b.type) return a.type < b.type;
+                return a.code < b.code;
+            }
+        };
+
+        struct job;
+
+        static void* worker(void* arg);
+        // into decoder and, if given, found
+        void scan_band(job& j, int band, Decoder& decoder,
+                       std::vector<scanner_result_t>* found) const;
+
+        codes_t codes;
+        directions_t directions;
+        int max_codes;
+        unsigned int min_length, max_length;
+        int line_skip;
+        threshold_t threshold;
+
+        // the key keeps the first read
+        std::map<scanner_result_t,int,less> reads;
+        std::vector<scanner_result_t> confirmed;
+    };
+
+}; // namespace BarDecode
+
+#endif // _DECODER_HH_
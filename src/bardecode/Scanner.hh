@@ -82,15 +82,18 @@ namespace BarDecode
             type(),
             code(""),
             x(0),
-            y(0)
+            y(0),
+            direction(left_right)
         {}
         
-        scanner_result_t(code_t type, const std::string& code, pos_t x, pos_t y) :
+        scanner_result_t(code_t type, const std::string& code, pos_t x, pos_t y,
+                         directions_t direction = left_right) :
             valid(true),
             type(type),
             code(code),
             x(x),
-            y(y)
+            y(y),
+            direction(direction)
         {}
 
         bool valid;
@@ -98,6 +101,7 @@ namespace BarDecode
         std::string code;
         pos_t x;
         pos_t y;
+        directions_t direction; // the code was read in
 
         operator bool() const
         {
@@ -140,7 +144,11 @@ namespace BarDecode
 
         value_type operator*() const
         {
-            return cur_barcode;
+            if (! vertical) return cur_barcode;
+            // scanned along the columns: left_right is top_down, ...
+            value_type r = cur_barcode;
+            r.direction = (directions_t) (r.direction << 1);
+            return r;
         }
 
         // Try to find next modulizer
@@ -89,9 +89,12 @@ namespace BarDecode
 
             token_line_t::const_iterator backup_i = ti;
             scanner_result_t result;
+            // the position of the first bar, past the quiet zone
+            const pos_t bx = v ? x : x + ti->second;
+            const pos_t by = v ? y + ti->second : y;
             // try scanning for all requested barcode types
             if (directions&left_right && requested(code39)) {
-                if ((result = code39_impl.scan(ti,te,x+ti->second,y,quiet_psize))) {
+                if ((result = code39_impl.scan(ti,te,bx,by,quiet_psize))) {
                     cur_barcode = result;
                     vx += pixel_diff(backup_i,ti);
                     return;
@@ -99,15 +102,16 @@ namespace BarDecode
             }
             if ( directions&right_left && requested(code39)) {
                 ti =  backup_i;
-                if ((result = code39_impl.reverse_scan(ti,te,x+ti->second,y,quiet_psize))) {
+                if ((result = code39_impl.reverse_scan(ti,te,bx,by,quiet_psize))) {
                     cur_barcode = result;
+                    cur_barcode.direction = right_left;
                     vx += pixel_diff(backup_i,ti);
                     return;
                 }
             }
             if ( directions&left_right && requested(code25i)) {
                 ti =  backup_i;
-                if ((result = code25i_impl.scan(ti,te,x+ti->second,y,quiet_psize))) {
+                if ((result = code25i_impl.scan(ti,te,bx,by,quiet_psize))) {
                     cur_barcode = result;
                     vx += pixel_diff(backup_i,ti);
                     return;
@@ -115,15 +119,16 @@ namespace BarDecode
             }
             if ( directions&right_left && requested(code25i)) {
                 ti =  backup_i;
-                if ((result = code25i_impl.reverse_scan(ti,te,x+ti->second,y,quiet_psize))) {
+                if ((result = code25i_impl.reverse_scan(ti,te,bx,by,quiet_psize))) {
                     cur_barcode = result;
+                    cur_barcode.direction = right_left;
                     vx += pixel_diff(backup_i,ti);
                     return;
                 }
             }
             if ( directions&left_right && requested(code128)) {
                 ti =  backup_i;
-                if (result = code128_impl.scan(ti,te,x+ti->second,y,quiet_psize)) {
+                if (result = code128_impl.scan(ti,te,bx,by,quiet_psize)) {
                     cur_barcode = result;
                     vx += pixel_diff(backup_i,ti);
                     return;
@@ -131,15 +136,16 @@ namespace BarDecode
             } 
             if ( directions&right_left && requested(code128)) {
                 ti =  backup_i;
-                if (result = code128_impl.reverse_scan(ti,te,x+ti->second,y,quiet_psize)) {
+                if (result = code128_impl.reverse_scan(ti,te,bx,by,quiet_psize)) {
                     cur_barcode = result;
+                    cur_barcode.direction = right_left;
                     vx += pixel_diff(backup_i,ti);
                     return;
                 }
             } 
             if ( directions&(left_right|right_left) && requested(ean) ) {
                 ti =  backup_i;
-                if ((result = ean_impl.scan(ti,te,x+ti->second,y,quiet_psize,directions)) ) {
+                if ((result = ean_impl.scan(ti,te,bx,by,quiet_psize,directions)) ) {
                     cur_barcode = result;
                     vx += pixel_diff(backup_i,ti);
                     return;
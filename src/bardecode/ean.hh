@@ -265,7 +265,7 @@ namespace BarDecode
         if (10-(sum % 10) != check) return scanner_result_t();
 
         // scan modules according to code_type
-        return scanner_result_t(type,code,x,y);
+        return scanner_result_t(type,code,x,y,reverted ? right_left : left_right);
 
     }
 
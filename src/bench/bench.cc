@@ -0,0 +1,521 @@
+/*
+ * Micro benchmarks of the image kernels and codecs.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Short Description:
+ *   Runs each kernel on a synthetic, always identical page (text-like
+ *   blocks, a logo, an EAN-13 barcode and noise) until the minimal time
+ *   is reached and reports the best iteration as MPixel/s and MB/s of
+ *   the input. The results can be saved as JSON and a later run
+ *   compared against them, e.g. between two commits.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <map>
+
+#include "ArgumentList.hh"
+#include "Timer.hh"
+#include "memstream.hh"
+
+#include "Image.hh"
+#include "Codecs.hh"
+#include "Colorspace.hh"
+
+#include "scale.hh"
+#include "rotate.hh"
+#include "crop.hh"
+#include "Matrix.hh"
+#include "GaussianBlur.hh"
+#include "optimize2bw.hh"
+#include "floyd-steinberg.h"
+#include "riemersma.h"
+
+#include "Contours.hh"
+#include "ContourMatching.hh"
+
+#include "Tokenizer.hh"
+#include "Scanner.hh"
+
+using namespace Utility;
+
+// --- synthetic input
+
+enum Input { RGB8, GRAY8, GRAY1 };
+static Image inputs[3];
+static Image logo; // the logo on the page, for the contour matching
+
+// fixed seed, so every run benchmarks the same data
+static uint32_t seed = 1;
+static uint32_t random32 ()
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static void fill (Image& image, int x, int y, int w, int h, uint8_t v)
+{
+  x = std::max (x, 0); y = std::max (y, 0);
+  w = std::min (w, image.w - x); h = std::min (h, image.h - y);
+  for (int j = 0; j < h; ++j)
+    memset (image.getRawData() + (y + j) * image.stride() + x, v, std::max (w, 0));
+}
+
+// EAN-13 "4006381333931", module width m
+static void drawEAN13 (Image& image, int x, int y, int m, int h)
+{
+  static const char* L[] = { "0001101", "0011001", "0010011", "0111101", "0100011",
+			     "0110001", "0101111", "0111011", "0110111", "0001011" };
+  static const char* parity[] = { "LLLLLL", "LLGLGG", "LLGGLG", "LLGGGL", "LGLLGG",
+				  "LGGLLG", "LGGGLL", "LGLGLG", "LGLGGL", "LGGLGL" };
+  const char* code = "4006381333931";
+
+  std::string bits = "101";
+  for (int i = 1; i <= 12; ++i) {
+    std::string l = L[code[i] - '0'], r = l;
+    for (int b = 0; b < 7; ++b)
+      r[b] = l[b] == '0' ? '1' : '0';
+    if (i <= 6)
+      bits += parity[code[0] - '0'][i - 1] == 'L' ? l : std::string (r.rbegin(), r.rend());
+    else
+      bits += r;
+    if (i == 6)
+      bits += "01010";
+  }
+  bits += "101";
+
+  fill (image, x - 10 * m, y - 2 * m, (bits.size() + 20) * m, h + 4 * m, 0xff);
+  for (unsigned i = 0; i < bits.size(); ++i)
+    if (bits[i] == '1')
+      fill (image, x + i * m, y, m, h, 0);
+}
+
+static void createInputs (int w, int h)
+{
+  Image& gray = inputs[GRAY8];
+  gray.spp = 1; gray.bps = 8;
+  gray.resize (w, h);
+
+  // paper with a little noise
+  uint8_t* data = gray.getRawData ();
+  for (int i = 0; i < gray.stride() * h; ++i)
+    data[i] = 235 + random32() % 20;
+
+  // text-like lines of words
+  const int line = std::max (h / 60, 8);
+  for (int y = 4 * line; y < h - 4 * line; y += 2 * line)
+    for (int x = w / 10; x < w - w / 10;) {
+      const int word = line * (2 + random32() % 6);
+      fill (gray, x, y, std::min (word, w - w / 10 - x), line, 20 + random32() % 40);
+      x += word + line;
+    }
+
+  // a logo: a ring with a bar thru it
+  const int r = std::max (std::min (w, h) / 16, 8);
+  const int cx = w - 2 * r, cy = 2 * r;
+  fill (gray, cx - 2 * r, cy - 2 * r, 4 * r, 4 * r, 0xff);
+  for (int y = -r; y <= r; ++y)
+    for (int x = -r; x <= r; ++x) {
+      const int d = x * x + y * y;
+      if (d <= r * r && d >= r * r / 4)
+	data[(cy + y) * gray.stride() + cx + x] = 0;
+    }
+  fill (gray, cx - r, cy - r / 8, 2 * r, r / 4, 0);
+  logo = gray;
+  crop (logo, cx - 2 * r, cy - 2 * r, 4 * r, 4 * r);
+
+  drawEAN13 (gray, w / 10, h - 3 * line - std::max (h / 10, 16),
+	     std::max (w / 500, 1), std::max (h / 10, 16));
+
+  // a bit of color for the RGB variant
+  Image& rgb = inputs[RGB8];
+  rgb = gray;
+  colorspace_gray8_to_rgb8 (rgb);
+  uint8_t* p = rgb.getRawData ();
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x, p += 3) {
+      p[0] = p[0] * (192 + 64 * x / w) >> 8;
+      p[2] = p[2] * (192 + 64 * y / h) >> 8;
+    }
+
+  inputs[GRAY1] = gray;
+  colorspace_gray8_to_gray1 (inputs[GRAY1]);
+}
+
+// --- the kernels
+
+static void run_scale (Image& image, const char* algorithm)
+{
+  const std::string a = algorithm;
+  if (a == "default") scale (image, .5, .5);
+  else if (a == "nearest") nearest_scale (image, .5, .5);
+  else if (a == "box") box_scale (image, .5, .5);
+  else if (a == "bilinear") bilinear_scale (image, .5, .5);
+  else if (a == "bicubic") bicubic_scale (image, .5, .5);
+  else if (a == "ddt") ddt_scale (image, .5, .5);
+  else if (a == "thumbnail") thumbnail_scale (image, .25, .25);
+  else if (a == "bilinear up") bilinear_scale (image, 1.5, 1.5);
+}
+
+static void run_rotate (Image& image, const char* angle)
+{
+  const double a = atof (angle);
+  if (a == 90 || a == 180 || a == 270)
+    rotate (image, a, image.begin());
+  else {
+    Image::iterator background = image.begin();
+    background.setL (255);
+    rotate (image, a, background);
+  }
+}
+
+static void run_flip (Image& image, const char* direction)
+{
+  if (*direction == 'x') flipX (image);
+  else flipY (image);
+}
+
+static void run_convolution (Image& image, const char* kind)
+{
+  const std::string k = kind;
+  if (k == "3x3") {
+    matrix_type sharpen[] = { -1, -1, -1,
+			      -1, 12, -1,
+			      -1, -1, -1 };
+    convolution_matrix (image, sharpen, 3, 3, 4);
+  }
+  else
+    GaussianBlur (image, 2.0, 5);
+}
+
+static void run_colorspace (Image& image, const char* target)
+{
+  colorspace_by_name (image, target);
+}
+
+static void run_optimize2bw (Image& image, const char*)
+{
+  optimize2bw (image, 0, 0, 0, 0, 0, 2.3);
+}
+
+static void run_dither (Image& image, const char* algorithm)
+{
+  if (*algorithm == 'f')
+    FloydSteinberg (image.getRawData(), image.w, image.h, 2, image.spp);
+  else
+    Riemersma (image.getRawData(), image.w, image.h, 2, image.spp);
+}
+
+static void run_barcode (Image& image, const char*)
+{
+  using namespace BarDecode;
+  int found = 0;
+  {
+    BarcodeIterator<> it (&image, 150, ean|code128|gs1_128|code39|code25i,
+			  (directions_t)(left_right|right_left), 4, 8);
+    for (; !it.end(); ++it)
+      ++found;
+  }
+  {
+    BarcodeIterator<true> it (&image, 150, ean|code128|gs1_128|code39|code25i,
+			      (directions_t)(left_right|right_left), 4, 8);
+    for (; !it.end(); ++it)
+      ++found;
+  }
+}
+
+static void run_contours (Image& image, const char*)
+{
+  static LogoRepresentation* representation = 0;
+  static Contours* logo_contours = 0;
+  if (!representation) {
+    FGMatrix m (logo, 200);
+    logo_contours = new Contours (m);
+    representation = new LogoRepresentation (logo_contours, 10, 20, 3, 0, 0);
+  }
+
+  FGMatrix m (image, 200);
+  Contours contours (m);
+  representation->Score (&contours);
+}
+
+static std::string encoded;
+
+static void run_write (Image& image, const char* codec)
+{
+  std::ostringstream stream;
+  ImageCodec::Write (&stream, image, codec, "", 75, "");
+  encoded = stream.str ();
+}
+
+static void run_read (Image& image, const char* codec)
+{
+  memistream stream (encoded.data(), encoded.size());
+  ImageCodec::Read (&stream, image, codec);
+  image.getRawData (); // some codecs decode on demand
+}
+
+// --- the runner
+
+struct Case
+{
+  std::string name;
+  Input input;
+  void (*run) (Image&, const char*);
+  const char* arg;
+};
+
+struct Result
+{
+  std::string name;
+  int iterations;
+  double seconds; // best iteration
+  uint64_t pixels, bytes;
+};
+
+static Result benchmark (const std::string& name, const Image& input,
+			 void (*run) (Image&, const char*), const char* arg,
+			 double min_time)
+{
+  Result r;
+  r.name = name;
+  r.iterations = 0;
+  r.seconds = 0;
+  r.pixels = (uint64_t)input.w * input.h;
+  r.bytes = (uint64_t)input.stride() * input.h;
+
+  Timer total;
+  Image work;
+  do {
+    work = input;
+    work.getRawData (); // not the copy on write
+
+    Timer t;
+    run (work, arg);
+    const double s = (double)t.Delta () / t.PerSecond ();
+    if (r.iterations++ == 0 || s < r.seconds)
+      r.seconds = s;
+  } while (r.iterations < 3 ||
+	   (double)total.Delta () / total.PerSecond () < min_time);
+
+  return r;
+}
+
+// millions per second, 0 for runs below the timer resolution
+static double perSecond (uint64_t n, double seconds)
+{
+  return seconds > 0 ? n / seconds / 1e6 : 0;
+}
+
+// the "seconds" of each benchmark line of a previous JSON output
+static std::map<std::string, double> readJSON (const std::string& filename)
+{
+  std::map<std::string, double> results;
+  std::ifstream in (filename.c_str());
+  std::string line;
+  while (std::getline (in, line)) {
+    std::string::size_type n = line.find ("\"name\": \"");
+    std::string::size_type s = line.find ("\"seconds\": ");
+    if (n == std::string::npos || s == std::string::npos)
+      continue;
+    n += 9;
+    results[line.substr (n, line.find ('"', n) - n)] = atof (line.c_str() + s + 11);
+  }
+  return results;
+}
+
+int main (int argc, char* argv[])
+{
+  ArgumentList arglist;
+
+  Argument<bool> arg_help ("h", "help",
+			   "display this help text and exit");
+  Argument<int> arg_width ("", "width", "width of the synthetic page", 1700, 0, 1);
+  Argument<int> arg_height ("", "height", "height of the synthetic page", 2200, 0, 1);
+  Argument<double> arg_time ("t", "time",
+			     "minimal time to run each benchmark, in seconds", 0.5, 0, 1);
+  Argument<std::string> arg_filter ("f", "filter",
+				    "only run the benchmarks with names containing this", 0, 1);
+  Argument<std::string> arg_json ("j", "json", "write the results as JSON to this file", 0, 1);
+  Argument<std::string> arg_compare ("c", "compare",
+				     "compare with the results of a previous JSON file", 0, 1);
+
+  arglist.Add (&arg_help);
+  arglist.Add (&arg_width);
+  arglist.Add (&arg_height);
+  arglist.Add (&arg_time);
+  arglist.Add (&arg_filter);
+  arglist.Add (&arg_json);
+  arglist.Add (&arg_compare);
+
+  if (!arglist.Read (argc, argv) || arg_help.Get() == true)
+    {
+      std::cerr << "ExactImage kernel and codec benchmarks" << std::endl
+		<< "Usage:" << std::endl;
+      arglist.Usage (std::cerr);
+      return 1;
+    }
+
+  createInputs (std::max (arg_width.Get(), 64), std::max (arg_height.Get(), 64));
+
+  static const Case cases[] = {
+    { "scale default rgb8", RGB8, run_scale, "default" },
+    { "scale nearest rgb8", RGB8, run_scale, "nearest" },
+    { "scale box rgb8", RGB8, run_scale, "box" },
+    { "scale bilinear rgb8", RGB8, run_scale, "bilinear" },
+    { "scale bilinear up rgb8", RGB8, run_scale, "bilinear up" },
+    { "scale bicubic rgb8", RGB8, run_scale, "bicubic" },
+    { "scale ddt gray8", GRAY8, run_scale, "ddt" },
+    { "scale thumbnail rgb8", RGB8, run_scale, "thumbnail" },
+    { "scale box gray1 to gray8", GRAY1, run_scale, "box" },
+    { "scale nearest gray1", GRAY1, run_scale, "nearest" },
+
+    { "rotate 90 rgb8", RGB8, run_rotate, "90" },
+    { "rotate 90 gray1", GRAY1, run_rotate, "90" },
+    { "rotate 180 gray8", GRAY8, run_rotate, "180" },
+    { "rotate 7.5 rgb8", RGB8, run_rotate, "7.5" },
+    { "flip x rgb8", RGB8, run_flip, "x" },
+    { "flip y rgb8", RGB8, run_flip, "y" },
+
+    { "convolution 3x3 gray8", GRAY8, run_convolution, "3x3" },
+    { "convolution 3x3 rgb8", RGB8, run_convolution, "3x3" },
+    { "gaussian blur gray8", GRAY8, run_convolution, "gaussian" },
+
+    { "colorspace rgb8 to gray8", RGB8, run_colorspace, "gray" },
+    { "colorspace gray8 to gray1", GRAY8, run_colorspace, "gray1" },
+    { "colorspace gray8 to gray4", GRAY8, run_colorspace, "gray4" },
+    { "colorspace gray8 to rgb8", GRAY8, run_colorspace, "rgb" },
+    { "colorspace gray1 to gray8", GRAY1, run_colorspace, "gray" },
+    { "colorspace rgb8 to gray1", RGB8, run_colorspace, "bw" },
+
+    { "optimize2bw rgb8", RGB8, run_optimize2bw, "" },
+    { "dither floyd-steinberg gray8", GRAY8, run_dither, "f" },
+    { "dither riemersma gray8", GRAY8, run_dither, "r" },
+
+    { "barcode scan gray8", GRAY8, run_barcode, "" },
+    { "contour matching gray8", GRAY8, run_contours, "" },
+  };
+
+  // the writers take what they support, gray for GIF, PCX, e.g.
+  static const Case codecs[] = {
+    { "jpeg", RGB8, 0, "jpeg" },
+    { "png", RGB8, 0, "png" },
+    { "tiff", RGB8, 0, "tiff" },
+    { "tiff gray1", GRAY1, 0, "tiff" },
+    { "bmp", RGB8, 0, "bmp" },
+    { "pnm", RGB8, 0, "pnm" },
+    { "pam", RGB8, 0, "pam" },
+    { "gif", GRAY8, 0, "gif" },
+    { "pcx", RGB8, 0, "pcx" },
+    { "tga", RGB8, 0, "tga" },
+    { "jpeg2000", RGB8, 0, "jp2" },
+    { "openexr", RGB8, 0, "exr" },
+    { "pdf", RGB8, 0, "pdf" },
+  };
+
+  const std::string filter = arg_filter.Size() ? arg_filter.Get() : "";
+  std::vector<Result> results;
+
+  std::cout << std::left << std::setw (32) << "benchmark" << std::right
+	    << std::setw (8) << "iter" << std::setw (12) << "best ms"
+	    << std::setw (12) << "MPixel/s" << std::setw (12) << "MB/s"
+	    << std::endl;
+
+  std::vector<Case> all (cases, cases + sizeof(cases) / sizeof(*cases));
+  for (unsigned i = 0; i < sizeof(codecs) / sizeof(*codecs); ++i) {
+    // only the codecs compiled in
+    std::ostringstream stream;
+    if (!ImageCodec::Write (&stream, inputs[codecs[i].input], codecs[i].arg, "", 75, ""))
+      continue;
+
+    Case c = codecs[i];
+    c.name = "write " + codecs[i].name;
+    c.run = run_write;
+    all.push_back (c);
+
+    c.name = "read " + codecs[i].name;
+    c.run = run_read;
+    all.push_back (c);
+  }
+
+  for (unsigned i = 0; i < all.size(); ++i) {
+    const Case& c = all[i];
+    if (!filter.empty() && c.name.find (filter) == std::string::npos)
+      continue;
+
+    // the reader benchmarks decode what the writer before produced
+    if (c.run == run_read) {
+      Image image = inputs[c.input];
+      run_write (image, c.arg);
+    }
+
+    Result r = benchmark (c.name, inputs[c.input], c.run, c.arg, arg_time.Get());
+    results.push_back (r);
+
+    std::cout << std::left << std::setw (32) << r.name << std::right
+	      << std::setw (8) << r.iterations
+	      << std::fixed << std::setprecision (2)
+	      << std::setw (12) << r.seconds * 1000
+	      << std::setw (12) << perSecond (r.pixels, r.seconds)
+	      << std::setw (12) << perSecond (r.bytes, r.seconds) << std::endl;
+  }
+
+  if (arg_compare.Size()) {
+    std::map<std::string, double> old = readJSON (arg_compare.Get());
+    std::cout << std::endl << "compared to " << arg_compare.Get()
+	      << " (time, negative is faster):" << std::endl;
+    for (unsigned i = 0; i < results.size(); ++i) {
+      std::map<std::string, double>::const_iterator it = old.find (results[i].name);
+      if (it == old.end() || it->second <= 0)
+	continue;
+      std::cout << std::left << std::setw (32) << results[i].name << std::right
+		<< std::setw (10) << std::showpos << std::setprecision (1)
+		<< 100 * (results[i].seconds / it->second - 1) << "%"
+		<< std::noshowpos << std::endl;
+    }
+  }
+
+  if (arg_json.Size()) {
+    // one benchmark per line, as read back by --compare
+    std::ofstream json (arg_json.Get().c_str());
+    json << "{\"width\": " << inputs[RGB8].w << ", \"height\": " << inputs[RGB8].h
+	 << ", \"benchmarks\": [" << std::endl;
+    for (unsigned i = 0; i < results.size(); ++i) {
+      const Result& r = results[i];
+      json << std::setprecision (9)
+	   << "{\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+	   << ", \"seconds\": " << r.seconds
+	   << ", \"mpixel_per_s\": " << perSecond (r.pixels, r.seconds)
+	   << ", \"mb_per_s\": " << perSecond (r.bytes, r.seconds) << "}"
+	   << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    json << "]}" << std::endl;
+    if (!json) {
+      std::cerr << "Error writing " << arg_json.Get() << std::endl;
+      return 1;
+    }
+  }
+
+  return 0;
+}
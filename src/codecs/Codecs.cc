@@ -16,12 +16,18 @@
  */
 
 #include "Codecs.hh"
+#include "Colorspace.hh"
+#include "Profile.hh"
 
 #include <ctype.h> // tolower
+#include <pthread.h>
 
 #include <iostream>
 #include <fstream>
 
+#include "MappedFile.hh"
+#include "memstream.hh"
+
 std::list<ImageCodec::loader_ref>* ImageCodec::loader = 0;
 
 ImageCodec::ImageCodec ()
@@ -70,6 +76,81 @@ std::string ImageCodec::getCodec (std::string& filename)
     return "";
 } 
 
+bool ImageCodec::hasOption (const std::string& options, const std::string& option)
+{
+  std::string::size_type start = 0;
+  while (start <= options.size()) {
+    std::string::size_type end = options.find (',', start);
+    if (end == std::string::npos)
+      end = options.size();
+    
+    std::string o = options.substr (start, end - start);
+    std::transform (o.begin(), o.end(), o.begin(), tolower);
+    if (o == option)
+      return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+bool ImageCodec::decodeTarget (const std::string& decompress, int& spp, int& bps)
+{
+  std::string::size_type start = 0;
+  while (start < decompress.size()) {
+    std::string::size_type end = decompress.find (',', start);
+    if (end == std::string::npos)
+      end = decompress.size();
+    
+    if (colorspace_spec_by_name (decompress.substr (start, end - start), spp, bps))
+      return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+// reduce what the codec could not already reduce while decoding
+static int reduceDecoded (int res, Image& image, const std::string& decompress)
+{
+  int spp, bps;
+  const bool target = ImageCodec::decodeTarget (decompress, spp, bps);
+  
+  // indexed data is only returned on request, and if not reduced anyway
+  if (res > 0 && image.isIndexed ()) {
+    if (ImageCodec::hasOption (decompress, "indexed") && !target)
+      colorspace_reduce_palette (image);
+    else
+      colorspace_de_palette (image);
+  }
+  
+  if (res > 0 && target)
+    if (image.spp > spp || image.bps > bps)
+      colorspace_convert (image, std::min (image.spp, spp),
+			  std::min (image.bps, bps));
+  return res;
+}
+
+// nothing of a previously loaded image must remain
+static void resetImage (Image& image)
+{
+  if (ImageCodec* c = image.getCodec ()) {
+    image.setCodec (0);
+    delete c;
+  }
+  image.setRawData (0);
+  image.clearPalette ();
+}
+
+// the codec and decoded size for the profile
+static int profileDecoded (Profile::Scope& profile, int res, Image& image,
+			   const std::string& codec)
+{
+  if (res > 0) {
+    profile.Detail (codec);
+    profile.Bytes ((uint64_t)image.stride() * image.h);
+  }
+  return res;
+}
+
 // NEW API
 
 int ImageCodec::Read (std::istream* stream, Image& image,
@@ -77,6 +158,10 @@ int ImageCodec::Read (std::istream* stream, Image& image,
 		      int index)
 {
   std::transform (codec.begin(), codec.end(), codec.begin(), tolower);
+  Profile::Scope profile ("read");
+  
+  // only the codecs of indexed images set a palette
+  image.clearPalette ();
   
   std::list<loader_ref>::iterator it;
   if (loader)
@@ -90,7 +175,8 @@ int ImageCodec::Read (std::istream* stream, Image& image,
             if (res > 0)
 	    {
 	      image.setDecoderID (it->loader->getID ());
-	      return res;
+	      return profileDecoded (profile, reduceDecoded (res, image, decompress),
+				     image, it->loader->getID ());
 	    }
 	    // TODO: remove once the codecs are clean
 	    stream->clear ();
@@ -100,7 +186,10 @@ int ImageCodec::Read (std::istream* stream, Image& image,
       else // manual codec spec
 	{
 	  if (it->primary_entry && it->ext == codec) {
-	    return it->loader->readImage (stream, image, decompress, index);
+	    return profileDecoded (profile,
+				   reduceDecoded (it->loader->readImage (stream, image, decompress, index),
+						  image, decompress),
+				   image, it->loader->getID ());
 	  }
 	}
     }
@@ -109,6 +198,45 @@ int ImageCodec::Read (std::istream* stream, Image& image,
   return false;
 }
 
+int ImageCodec::Probe (std::istream* stream, Image& image,
+		       std::string codec, int index, int* orientation)
+{
+  std::transform (codec.begin(), codec.end(), codec.begin(), tolower);
+  
+  resetImage (image);
+  
+  int o = 0;
+  std::list<loader_ref>::iterator it;
+  if (loader)
+  for (it = loader->begin(); it != loader->end(); ++it)
+    {
+      if (!it->primary_entry)
+	continue;
+      
+      if (codec.empty() && !it->via_codec_only) // try via magic
+	{
+	  int res = it->loader->probeImage (stream, image, index, o);
+	  if (res > 0) {
+	    image.setDecoderID (it->loader->getID ());
+	    if (orientation)
+	      *orientation = o;
+	    return res;
+	  }
+	  stream->clear ();
+	  stream->seekg (0);
+	}
+      else if (it->ext == codec) // manual codec spec
+	{
+	  int res = it->loader->probeImage (stream, image, index, o);
+	  if (orientation)
+	    *orientation = o;
+	  return res;
+	}
+    }
+  
+  return 0;
+}
+
 bool ImageCodec::Write (std::ostream* stream, Image& image,
 			std::string codec, std::string ext,
 			int quality, const std::string& compress)
@@ -137,6 +265,17 @@ bool ImageCodec::Write (std::ostream* stream, Image& image,
   return false;
   
  do_write:
+  Profile::Scope profile ("write", (uint64_t)image.stride() * image.h);
+  profile.Detail (it->loader->getID ());
+  
+  // codecs without palette support get the expanded colors
+  if (image.isIndexed() && !it->loader->supportsIndexed()) {
+    Image expanded;
+    expanded = image; // shared until expanded
+    colorspace_de_palette (expanded);
+    return (it->loader->writeImage (stream, expanded, quality, compress));
+  }
+  
   // reuse attached codec (if any and the image is unmodified)
   if (image.getCodec() && !image.isModified() && image.getCodec()->getID() == it->loader->getID())
     return (image.getCodec()->writeImage (stream, image, quality, compress));
@@ -175,12 +314,75 @@ ImageCodec* ImageCodec::MultiWrite (std::ostream* stream,
   return it->loader->instanciateForWrite(stream);
 }
 
+ImageCodec* ImageCodec::MultiRead (std::istream* stream, std::string codec)
+{
+  std::transform (codec.begin(), codec.end(), codec.begin(), tolower);
+  
+  std::list<loader_ref>::iterator it;
+  if (loader)
+  for (it = loader->begin(); it != loader->end(); ++it)
+    {
+      if (!it->primary_entry)
+	continue;
+      
+      if ((codec.empty() && !it->via_codec_only) || // try via magic
+	  it->ext == codec) // manual codec spec
+	{
+	  ImageCodec* reader = it->loader->instanciateForRead (stream);
+	  if (reader)
+	    return reader;
+	  stream->clear ();
+	  stream->seekg (0);
+	  if (!codec.empty())
+	    break;
+	}
+    }
+  
+  return 0;
+}
+
+int ImageCodec::Read (Image& image, const std::string& decompress, int index)
+{
+  Profile::Scope profile ("read");
+  // drop the codec attached by the previous page (or file), it would
+  // otherwise be taken for the source of the new pixel data
+  if (image.getCodec () == this)
+    image.setCodec (0); // not ours to delete
+  resetImage (image);
+  int res = readPage (image, decompress, index);
+  if (res > 0)
+    image.setDecoderID (getID ());
+  return profileDecoded (profile, reduceDecoded (res, image, decompress),
+			 image, getID ());
+}
+
+int ImageCodec::Probe (Image& image, int index, int* orientation)
+{
+  resetImage (image);
+  
+  int o = 0;
+  int res = probePage (image, index, o);
+  if (res > 0) {
+    image.setDecoderID (getID ());
+    if (orientation)
+      *orientation = o;
+  }
+  return res;
+}
+
 // OLD API
 
 int ImageCodec::Read (std::string file, Image& image, const std::string& decompress, int index)
 {
   std::string codec = getCodec (file);
   
+  // mapped, the codecs can work on the file data directly
+  Utility::MappedFile mapped;
+  if (file != "-" && mapped.Open (file)) {
+    Utility::memistream s ((const char*) mapped.Data(), mapped.Size());
+    return Read (&s, image, codec, decompress, index);
+  }
+  
   std::istream* s;
   if (file != "-")
     s = new std::ifstream (file.c_str(), std::ios::in | std::ios::binary);
@@ -189,6 +391,8 @@ int ImageCodec::Read (std::string file, Image& image, const std::string& decompr
   
   if (!*s) {
     //std::cerr << "Can not open file " << file.c_str() << std::endl;
+    if (s != &std::cin)
+      delete s;
     return false;
   }
   
@@ -221,6 +425,30 @@ bool ImageCodec::Write (std::string file, Image& image,
   return res;
 }
 
+int ImageCodec::Probe (std::string file, Image& image, int index, int* orientation)
+{
+  std::string codec = getCodec (file);
+  
+  Utility::MappedFile mapped;
+  if (file != "-" && mapped.Open (file)) {
+    Utility::memistream s ((const char*) mapped.Data(), mapped.Size());
+    return Probe (&s, image, codec, index, orientation);
+  }
+  
+  std::istream* s;
+  if (file != "-")
+    s = new std::ifstream (file.c_str(), std::ios::in | std::ios::binary);
+  else
+    s = &std::cin;
+  
+  int res = 0;
+  if (*s)
+    res = Probe (s, image, codec, index, orientation);
+  if (s != &std::cin)
+    delete s;
+  return res;
+}
+
 void ImageCodec::registerCodec (const char* _ext, ImageCodec* _loader,
 				bool _via_codec_only, bool push_back)
 {
@@ -272,6 +500,21 @@ int ImageCodec::readImage (std::istream* stream, Image& image,
     return 0;
 }
 
+int ImageCodec::probeImage (std::istream* stream, Image& image, int index,
+			    int& orientation)
+{
+  // no header parser, so just decode the whole thing
+  int res = readImage (stream, image, "", index);
+  if (res > 0)
+    colorspace_de_palette (image); // as returned by Read()
+  return res;
+}
+
+bool ImageCodec::supportsIndexed ()
+{
+  return false;
+}
+
 ImageCodec* ImageCodec::instanciateForWrite (std::ostream* stream)
 {
   return 0;
@@ -283,6 +526,26 @@ bool ImageCodec::Write (Image& image,
   return false;
 }
 
+ImageCodec* ImageCodec::instanciateForRead (std::istream* stream)
+{
+  return 0;
+}
+
+int ImageCodec::pageCount ()
+{
+  return 0;
+}
+
+int ImageCodec::readPage (Image& image, const std::string& decompress, int index)
+{
+  return 0;
+}
+
+int ImageCodec::probePage (Image& image, int index, int& orientation)
+{
+  return 0;
+}
+
 /*bool*/ void ImageCodec::decodeNow (Image* image)
 {
   // intentionally left blank
@@ -318,3 +581,105 @@ bool ImageCodec::scale (Image& image, double xscale, double yscale)
 {
   return false;
 }
+
+/* *** codec sessions *** */
+
+namespace {
+
+  pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+  int sessions = 0; // alive, in all threads
+  
+  struct ThreadContexts
+  {
+    ThreadContexts () : sessions (0) {
+      std::fill (contexts, contexts + CodecSession::Kinds,
+		 (CodecSession::Context*) 0);
+    }
+    ~ThreadContexts () { clear (); }
+    
+    void clear () {
+      for (int i = 0; i < CodecSession::Kinds; ++i) {
+	delete contexts[i];
+	contexts[i] = 0;
+      }
+    }
+    
+    int sessions; // alive in this thread
+    CodecSession::Context* contexts[CodecSession::Kinds];
+  };
+  
+  pthread_key_t contexts_key;
+  pthread_once_t contexts_once = PTHREAD_ONCE_INIT;
+  
+  void delete_contexts (void* contexts)
+  {
+    delete (ThreadContexts*) contexts;
+  }
+  
+  void create_contexts_key ()
+  {
+    pthread_key_create (&contexts_key, delete_contexts);
+  }
+  
+  ThreadContexts* thread_contexts (bool create)
+  {
+    pthread_once (&contexts_once, create_contexts_key);
+    ThreadContexts* contexts = (ThreadContexts*) pthread_getspecific (contexts_key);
+    if (!contexts && create) {
+      contexts = new ThreadContexts;
+      pthread_setspecific (contexts_key, contexts);
+    }
+    return contexts;
+  }
+}
+
+CodecSession::CodecSession ()
+{
+  ++thread_contexts (true)->sessions;
+  pthread_mutex_lock (&session_mutex);
+  ++sessions;
+  pthread_mutex_unlock (&session_mutex);
+}
+
+CodecSession::~CodecSession ()
+{
+  pthread_mutex_lock (&session_mutex);
+  --sessions;
+  pthread_mutex_unlock (&session_mutex);
+  
+  // supposed to be the same thread that created it
+  ThreadContexts* contexts = thread_contexts (false);
+  if (contexts && --contexts->sessions == 0)
+    contexts->clear ();
+}
+
+bool CodecSession::Active ()
+{
+  pthread_mutex_lock (&session_mutex);
+  const bool active = sessions > 0;
+  pthread_mutex_unlock (&session_mutex);
+  return active;
+}
+
+CodecSession::Context* CodecSession::take (Kind kind)
+{
+  ThreadContexts* contexts = thread_contexts (false);
+  if (!contexts)
+    return 0;
+  
+  Context* context = contexts->contexts[kind];
+  contexts->contexts[kind] = 0;
+  return context;
+}
+
+void CodecSession::Give (Kind kind, Context* context)
+{
+  if (Active ()) {
+    ThreadContexts* contexts = thread_contexts (true);
+    if (!contexts->contexts[kind]) {
+      contexts->contexts[kind] = context;
+      return;
+    }
+  }
+  delete context;
+}
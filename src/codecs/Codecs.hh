@@ -65,9 +65,40 @@ public:
 		     std::string codec, std::string ext = "",
 		     int quality = 75, const std::string& compress = "");
 
+  // The decompress option is a comma separated list. Besides codec
+  // specific entries (e.g. "thumb", or "scale=<factor>" to render
+  // vector formats at another size) it may name the colorspace the
+  // caller is going to work in ("gray8", "gray1", "rgb8", ...). It is
+  // an upper bound, the data is only reduced, never expanded. Codecs
+  // that can reduce while decoding produce it directly, Read() converts
+  // whatever else is returned. Palette images are expanded, unless
+  // "indexed" is given (and no colorspace), see Image::isIndexed().
+  // Write() expands them for codecs that can not store a palette.
+  static bool hasOption (const std::string& options, const std::string& option);
+  static bool decodeTarget (const std::string& decompress, int& spp, int& bps);
+  
+  // Header only identification: sets up w, h, spp, bps and resolution
+  // as Read() would return them, without decoding any pixel data (for
+  // codecs that support it). Returns the number of images within the
+  // file, or 0 if it could not be identified. The orientation tag, if
+  // any (Exif, TIFF, 1 - 8), is optionally returned as well.
+  static int Probe (std::istream* stream, Image& image,
+		    std::string codec = "", int index = 0, int* orientation = 0);
+  
   static ImageCodec* MultiWrite (std::ostream* stream,
 				 std::string codec, std::string ext = "");
   
+  // Persistent reader for multi-page files: keeps the file open and the
+  // page directory indexed, so that any page is reached directly instead
+  // of re-opening and walking the file for each index. Returns 0 if the
+  // codec does not support it, Read() / Probe() with index work for all.
+  // The stream must stay valid while the reader is in use. A reader is
+  // not thread safe, for parallel decoding use one reader (and stream)
+  // per thread.
+  static ImageCodec* MultiRead (std::istream* stream, std::string codec = "");
+  int Read (Image& image, const std::string& decompress = "", int index = 0);
+  int Probe (Image& image, int index = 0, int* orientation = 0);
+  
   // OLD API, only left for compatibility.
   // Not const string& because the filename is parsed and the copy is changed intern.
   // 
@@ -75,6 +106,7 @@ public:
   static int Read (std::string file, Image& image, const std::string& decompress = "", int index = 0);
   static bool Write (std::string file, Image& image,
 		     int quality = 75, const std::string& compress = "");
+  static int Probe (std::string file, Image& image, int index = 0, int* orientation = 0);
   
   // Per codec methods, only one set needs to be implemented, the one with
   // index invoke the one without by default (compatibility, ease of implemntation
@@ -84,12 +116,22 @@ public:
   virtual int readImage (std::istream* stream, Image& image,
 			 const std::string& decompress, int index);
 
+  // header only, by default the whole image is read
+  virtual int probeImage (std::istream* stream, Image& image, int index,
+			  int& orientation);
+  
   virtual bool writeImage (std::ostream* stream, Image& image,
 			   int quality, const std::string& compress) = 0;
+  // whether writeImage() handles indexed images, false by default
+  virtual bool supportsIndexed ();
   virtual ImageCodec* instanciateForWrite (std::ostream* stream);
   // slightly named differently to match the public factory name
   virtual bool Write (Image& image,
 		      int quality = 75, const std::string& compress = "", int index = 0);
+  virtual ImageCodec* instanciateForRead (std::istream* stream);
+  virtual int pageCount ();
+  virtual int readPage (Image& image, const std::string& decompress, int index);
+  virtual int probePage (Image& image, int index, int& orientation);
   
   // not pure-virtual so not every codec needs a NOP
   virtual /*bool*/ void decodeNow (Image* image);
@@ -123,4 +165,55 @@ protected:
   const Image* _image;
 };
 
+/* Keeps the codec library contexts of the calling thread (e.g. the
+ * libjpeg de- and compressors) alive between images, so that they are
+ * just reset for the next image instead of created and destroyed each
+ * time. Without a session everything works as before.
+ *
+ * Create one per worker thread for the life time of a batch, images
+ * decoded on demand later on still benefit. Contexts cached by helper
+ * threads (e.g. the band encoders) are kept while any session is alive
+ * and released when their thread exits or finds no session left.
+ */
+class CodecSession
+{
+public:
+  CodecSession ();
+  ~CodecSession ();
+  
+  // whether any thread has a session alive
+  static bool Active ();
+  
+  class Context
+  {
+  public:
+    virtual ~Context () {}
+  };
+  
+  enum Kind {
+    JPEGDecompress,
+    JPEGCompress,
+    PNGMemory,
+    PNGDeflate,
+    Kinds
+  };
+  
+  // for the codecs: the cached context of this thread, or a new one
+  template <class T>
+  static T* Take (Kind kind) {
+    Context* context = take (kind);
+    return context ? static_cast<T*> (context) : new T;
+  }
+  
+  // done with it, kept for the next image or deleted without session
+  static void Give (Kind kind, Context* context);
+  
+private:
+  static Context* take (Kind kind);
+  
+  // not copyable
+  CodecSession (const CodecSession&);
+  CodecSession& operator= (const CodecSession&);
+};
+
 #endif
@@ -31,16 +31,8 @@ namespace svg
 
     //------------------------------------------------------------------------
     path_renderer::path_renderer() :
-        m_curved(m_storage),
-        m_curved_count(m_curved),
-
-        m_curved_stroked(m_curved_count),
-        m_curved_stroked_trans(m_curved_stroked, m_transform),
-
-        m_curved_trans(m_curved_count, m_transform),
-        m_curved_trans_contour(m_curved_trans)
+        m_expand(0.0)
     {
-        m_curved_trans_contour.auto_detect_orientation(false);
     }
 
 
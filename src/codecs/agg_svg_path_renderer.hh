@@ -56,6 +56,27 @@ namespace svg
     };
 
 
+    // Read-only vertex source over a path_storage. The storage's own
+    // rewind() / vertex() modify its iterator, this keeps it separate so
+    // several threads can render the same parsed paths.
+    class path_storage_reader
+    {
+    public:
+        path_storage_reader(const path_storage& ps) : m_storage(&ps), m_iterator(0) {}
+
+        void rewind(unsigned path_id) { m_iterator = path_id; }
+        unsigned vertex(double* x, double* y)
+        {
+            if(m_iterator >= m_storage->total_vertices()) return path_cmd_stop;
+            return m_storage->vertex(m_iterator++, x, y);
+        }
+
+    private:
+        const path_storage* m_storage;
+        unsigned m_iterator;
+    };
+
+
 
 
     //============================================================================
@@ -131,15 +152,41 @@ namespace svg
     public:
         typedef pod_bvector<path_attributes>   attr_storage;
 
-        typedef conv_curve<path_storage>       curved;
-        typedef conv_count<curved>             curved_count;
+        typedef conv_curve<path_storage_reader> curved;
 
-        typedef conv_stroke<curved_count>      curved_stroked;
+        typedef conv_stroke<curved>            curved_stroked;
         typedef conv_transform<curved_stroked> curved_stroked_trans;
 
-        typedef conv_transform<curved_count>   curved_trans;
+        typedef conv_transform<curved>         curved_trans;
         typedef conv_contour<curved_trans>     curved_trans_contour;
 
+        // The conversion pipeline state, one per rendering thread.
+        struct pipeline
+        {
+            pipeline(const path_storage& storage, double expand) :
+                m_source(storage),
+                m_curved(m_source),
+                m_curved_stroked(m_curved),
+                m_curved_stroked_trans(m_curved_stroked, m_transform),
+                m_curved_trans(m_curved, m_transform),
+                m_curved_trans_contour(m_curved_trans)
+            {
+                m_curved_trans_contour.auto_detect_orientation(false);
+                m_curved_trans_contour.width(expand);
+            }
+
+            path_storage_reader          m_source;
+            trans_affine                 m_transform;
+
+            curved                       m_curved;
+
+            curved_stroked               m_curved_stroked;
+            curved_stroked_trans         m_curved_stroked_trans;
+
+            curved_trans                 m_curved_trans;
+            curved_trans_contour         m_curved_trans_contour;
+        };
+
         path_renderer();
 
         void remove_all();
@@ -180,9 +227,6 @@ namespace svg
 //        }
 
 
-        unsigned vertex_count() const { return m_curved_count.count(); }
-        
-
         // Call these functions on <g> tag (start_element, end_element respectively)
         void push_attr();
         void pop_attr();
@@ -210,7 +254,7 @@ namespace svg
         // Expand all polygons 
         void expand(double value)
         {
-            m_curved_trans_contour.width(value);
+            m_expand = value;
         }
 
         unsigned operator [](unsigned idx)
@@ -227,29 +271,31 @@ namespace svg
 
         // Rendering. One can specify two additional parameters: 
         // trans_affine and opacity. They can be used to transform the whole
-        // image and/or to make it translucent.
+        // image and/or to make it translucent. The parsed paths are only
+        // read, so several threads may render them at once, e.g. into
+        // separate clip boxes of the same image.
         template<class Rasterizer, class Scanline, class Renderer> 
         void render(Rasterizer& ras, 
                     Scanline& sl,
                     Renderer& ren, 
                     const trans_affine& mtx, 
                     const rect_i& cb,
-                    double opacity=1.0)
+                    double opacity=1.0) const
         {
             unsigned i;
+            pipeline p(m_storage, m_expand);
 
             ras.clip_box(cb.x1, cb.y1, cb.x2, cb.y2);
-            m_curved_count.count(0);
 
             for(i = 0; i < m_attr_storage.size(); i++)
             {
                 const path_attributes& attr = m_attr_storage[i];
-                m_transform = attr.transform;
-                m_transform *= mtx;
-                double scl = m_transform.scale();
-                //m_curved.approximation_method(curve_inc);
-                m_curved.approximation_scale(scl);
-                m_curved.angle_tolerance(0.0);
+                p.m_transform = attr.transform;
+                p.m_transform *= mtx;
+                double scl = p.m_transform.scale();
+                //p.m_curved.approximation_method(curve_inc);
+                p.m_curved.approximation_scale(scl);
+                p.m_curved.angle_tolerance(0.0);
 
                 rgba8 color;
 
@@ -257,14 +303,14 @@ namespace svg
                 {
                     ras.reset();
                     ras.filling_rule(attr.even_odd_flag ? fill_even_odd : fill_non_zero);
-                    if(fabs(m_curved_trans_contour.width()) < 0.0001)
+                    if(fabs(p.m_curved_trans_contour.width()) < 0.0001)
                     {
-                        ras.add_path(m_curved_trans, attr.index);
+                        ras.add_path(p.m_curved_trans, attr.index);
                     }
                     else
                     {
-                        m_curved_trans_contour.miter_limit(attr.miter_limit);
-                        ras.add_path(m_curved_trans_contour, attr.index);
+                        p.m_curved_trans_contour.miter_limit(attr.miter_limit);
+                        ras.add_path(p.m_curved_trans_contour, attr.index);
                     }
 
                     color = attr.fill_color;
@@ -275,24 +321,24 @@ namespace svg
 
                 if(attr.stroke_flag)
                 {
-                    m_curved_stroked.width(attr.stroke_width);
-                    //m_curved_stroked.line_join((attr.line_join == miter_join) ? miter_join_round : attr.line_join);
-                    m_curved_stroked.line_join(attr.line_join);
-                    m_curved_stroked.line_cap(attr.line_cap);
-                    m_curved_stroked.miter_limit(attr.miter_limit);
-                    m_curved_stroked.inner_join(inner_round);
-                    m_curved_stroked.approximation_scale(scl);
+                    p.m_curved_stroked.width(attr.stroke_width);
+                    //p.m_curved_stroked.line_join((attr.line_join == miter_join) ? miter_join_round : attr.line_join);
+                    p.m_curved_stroked.line_join(attr.line_join);
+                    p.m_curved_stroked.line_cap(attr.line_cap);
+                    p.m_curved_stroked.miter_limit(attr.miter_limit);
+                    p.m_curved_stroked.inner_join(inner_round);
+                    p.m_curved_stroked.approximation_scale(scl);
 
                     // If the *visual* line width is considerable we 
                     // turn on processing of curve cusps.
                     //---------------------
                     if(attr.stroke_width * scl > 1.0)
                     {
-                        m_curved.angle_tolerance(0.2);
+                        p.m_curved.angle_tolerance(0.2);
                     }
                     ras.reset();
                     ras.filling_rule(fill_non_zero);
-                    ras.add_path(m_curved_stroked_trans, attr.index);
+                    ras.add_path(p.m_curved_stroked_trans, attr.index);
                     color = attr.stroke_color;
                     color.opacity(color.opacity() * opacity);
                     ren.color(color);
@@ -308,15 +354,7 @@ namespace svg
         attr_storage   m_attr_storage;
         attr_storage   m_attr_stack;
         trans_affine   m_transform;
-
-        curved                       m_curved;
-        curved_count                 m_curved_count;
-
-        curved_stroked               m_curved_stroked;
-        curved_stroked_trans         m_curved_stroked_trans;
-
-        curved_trans                 m_curved_trans;
-        curved_trans_contour         m_curved_trans_contour;
+        double         m_expand;
     };
 
 }
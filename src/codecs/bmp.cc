@@ -259,10 +259,21 @@ static void rearrangePixels(uint8_t* buf, uint32_t width, uint32_t bit_count)
   }
 }
 
-int BMPCodec::readImage (std::istream* stream, Image& image, const std::string& decompres)
+static void convertColorTable (const uint8_t* clr_tbl, uint32_t clr_tbl_size,
+			       uint32_t n_clr_elems,
+			       uint16_t* rmap, uint16_t* gmap, uint16_t* bmap)
+{
+  for (unsigned int i = 0; i < clr_tbl_size; ++i) {
+    // BMP maps have BGR order ...
+    rmap[i] = 0x101 * clr_tbl[i * n_clr_elems + 2];
+    gmap[i] = 0x101 * clr_tbl[i * n_clr_elems + 1];
+    bmap[i] = 0x101 * clr_tbl[i * n_clr_elems + 0];
+  }
+}
+
+// the file header, false if not a BMP
+static bool readFileHeader (std::istream* stream, BMPFileHeader& file_hdr)
 {
-  BMPFileHeader file_hdr;
-  
   stream->read ((char*)&file_hdr.bType, 2);
   if (file_hdr.bType[0] != 'B' || file_hdr.bType[1] != 'M') {
     stream->seekg (0);
@@ -278,12 +289,30 @@ int BMPCodec::readImage (std::istream* stream, Image& image, const std::string&
   // fix the iSize, in early BMP file this is pure garbage
   stream->seekg (0, std::ios::end);
   file_hdr.iSize = stream->tellg (); // TODO: minus the header?
+  return true;
+}
 
+int BMPCodec::readImage (std::istream* stream, Image& image, const std::string& decompres)
+{
+  BMPFileHeader file_hdr;
+  if (!readFileHeader (stream, file_hdr))
+    return false;
+  
   int i = readImageWithoutFileHeader(stream, image, decompres, &file_hdr);
   return i;
 }
 
-int BMPCodec::readImageWithoutFileHeader (std::istream* stream, Image& image, const std::string& decompres, BMPFileHeader* _file_hdr)
+int BMPCodec::probeImage (std::istream* stream, Image& image, int index,
+			  int& orientation)
+{
+  BMPFileHeader file_hdr;
+  if (index != 0 || !readFileHeader (stream, file_hdr))
+    return false;
+  
+  return readImageWithoutFileHeader(stream, image, "", &file_hdr, true);
+}
+
+int BMPCodec::readImageWithoutFileHeader (std::istream* stream, Image& image, const std::string& decompres, BMPFileHeader* _file_hdr, bool header_only)
 {
   BMPFileHeader* file_hdr = _file_hdr;
   BMPFileHeader file_header; // only used if no file_hdr is supplied
@@ -454,6 +483,22 @@ int BMPCodec::readImageWithoutFileHeader (std::istream* stream, Image& image, co
       info_hdr.iRedMask = 0x1f << 10;
     }
   
+  // just the meta data, as the data would be unpacked below
+  if (header_only) {
+    if (info_hdr.iCompression != BMPC_RGB)
+      image.bps = 8;
+    if (clr_tbl && image.spp < 3) {
+      uint16_t* rmap = new uint16_t [clr_tbl_size * 3];
+      convertColorTable (clr_tbl, clr_tbl_size, n_clr_elems,
+			 rmap, rmap + clr_tbl_size, rmap + 2 * clr_tbl_size);
+      colorspace_de_palette_spec (image.spp, image.bps, clr_tbl_size,
+				  rmap, rmap + clr_tbl_size, rmap + 2 * clr_tbl_size);
+      delete[] (rmap);
+    }
+    free (clr_tbl);
+    return true;
+  }
+  
   /* -------------------------------------------------------------------- */
   /*  Read uncompressed image data.                                       */
   /* -------------------------------------------------------------------- */
@@ -643,7 +688,7 @@ int BMPCodec::readImageWithoutFileHeader (std::istream* stream, Image& image, co
     break;
   } /* switch */
   
-  // convert to RGB color-space - we do not handle palete images internally
+  // attach the color table, kept indexed
   
   // no color table anyway or RGB* ?
   if (clr_tbl && image.spp < 3)
@@ -652,14 +697,9 @@ int BMPCodec::readImageWithoutFileHeader (std::istream* stream, Image& image, co
       uint16_t* gmap = new uint16_t [clr_tbl_size];
       uint16_t* bmap = new uint16_t [clr_tbl_size];
       
-      for (unsigned int i = 0; i < clr_tbl_size; ++i) {
-	// BMP maps have BGR order ...
-	rmap[i] = 0x101 * clr_tbl[i * n_clr_elems + 2];
-	gmap[i] = 0x101 * clr_tbl[i * n_clr_elems + 1];
-	bmap[i] = 0x101 * clr_tbl[i * n_clr_elems + 0];
-      }
+      convertColorTable (clr_tbl, clr_tbl_size, n_clr_elems, rmap, gmap, bmap);
       
-      colorspace_de_palette (image, clr_tbl_size, rmap, gmap, bmap);
+      image.setPalette (clr_tbl_size, rmap, gmap, bmap);
       
       delete[] (rmap);
       delete[] (gmap);
@@ -694,7 +734,9 @@ bool BMPCodec::writeImage (std::ostream* stream, Image& image, int quality,
   BMPInfoHeader info_hdr;
   
   int hdr_size = BIH_WIN4SIZE;
-  int stride = image.stride ();
+  const uint8_t* data = image.getConstAlignedRawData ();
+  const int stride = image.stride (); // padded for sub-image views
+  const int row_bytes = (image.w * image.spp * image.bps + 7) / 8;
   
   memset (&file_hdr, 0, sizeof (file_hdr));
   memset (&info_hdr, 0, sizeof (info_hdr));
@@ -712,7 +754,7 @@ bool BMPCodec::writeImage (std::ostream* stream, Image& image, int quality,
   info_hdr.iPlanes = 1;
   info_hdr.iBitCount = image.spp * image.bps;
   info_hdr.iCompression = BMPC_RGB;
-  info_hdr.iSizeImage  = image.stride()*image.h; // TODO: compressed size
+  info_hdr.iSizeImage  = row_bytes*image.h; // TODO: compressed size
   info_hdr.iXPelsPerMeter = (int32_t) (image.resolutionX() * 100 / 2.54);
   info_hdr.iYPelsPerMeter = (int32_t) (image.resolutionY() * 100 / 2.54);
   info_hdr.iClrUsed = image.spp == 1 ? 1 << image.bps : 0;
@@ -762,7 +804,7 @@ bool BMPCodec::writeImage (std::ostream* stream, Image& image, int quality,
 #endif
       for (int row = image.h-1; row >=0; --row)
 	{
-	  memcpy (payload, image.getRawData() + stride*row, stride);
+	  memcpy (payload, data + stride*row, row_bytes);
 	  rearrangePixels (payload, image.w, info_hdr.iBitCount);
 	  
 	  if (!stream->write ((char*)payload, file_stride)) {
@@ -27,7 +27,8 @@ public:
   virtual std::string getID () { return "BMP"; };
 
   virtual int readImage (std::istream* stream, Image& image, const std::string& decompress);
+  virtual int probeImage (std::istream* stream, Image& image, int index, int& orientation);
   virtual bool writeImage (std::ostream* stream, Image& image, int quality, const std::string& compress);
 
-  static int readImageWithoutFileHeader (std::istream* stream, Image& image, const std::string& decompress = "", BMPFileHeader* header = 0);
+  static int readImageWithoutFileHeader (std::istream* stream, Image& image, const std::string& decompress = "", BMPFileHeader* header = 0, bool header_only = false);
 };
@@ -147,8 +147,7 @@ int DCRAWCodec::readImage (std::istream* stream, Image& im, const std::string& d
   if (!is_raw)
     return false;
   
-  // TODO: lowercase and find in comma seperated list
-  if (decompress == "thumb") {
+  if (hasOption (decompress, "thumb")) {
     if (!thumb_offset) {
       std::cerr << "has no thumbnail." << std::endl;
     }
@@ -21,6 +21,8 @@
 #include "Colorspace.hh"
 
 #include <iostream>
+#include <algorithm>
+#include <vector>
 
 /* The way Interlaced image should. */
 static const int InterlacedOffset[] = { 0, 4, 2, 1 };
@@ -152,14 +154,102 @@ int GIFCodec::readImage (std::istream* stream, Image& image, const std::string&
     bmap[i] = ColorMap->Colors[i].Blue << 8;
   }
   
-  // convert colormap to our 16bit "TIFF"format
-  colorspace_de_palette (image, ColorMap->ColorCount, rmap, gmap, bmap);
+  // convert colormap to our 16bit "TIFF"format, kept indexed
+  image.setPalette (ColorMap->ColorCount, rmap, gmap, bmap);
   
   EGifCloseFile(GifFile);
 
   return true;
 }
 
+int GIFCodec::probeImage (std::istream* stream, Image& image, int index,
+			  int& orientation)
+{
+  { // quick magic check
+    char buf [3];
+    stream->read (buf, sizeof (buf));
+    stream->seekg (0);
+    if (index != 0 || buf[0] != 'G' || buf[1] != 'I' || buf[2] != 'F')
+      return false;
+  }
+  
+  GifFileType* GifFile;
+  GifRecordType RecordType;
+  GifByteType* Extension;
+  GifByteType* CodeBlock;
+  int ExtCode, CodeSize;
+  
+  if ((GifFile = DGifOpen (stream, &GIFInputFunc)) == NULL)
+    {
+      PrintGifError();
+      return false;
+    }
+  
+  image.w = GifFile->SWidth;
+  image.h = GifFile->SHeight;
+  image.spp = 1;
+  image.bps = 8;
+  image.setResolution(0, 0);
+  
+  /* Walk the records for the color map readImage would use, skipping
+     over the compressed data without decoding it */
+  bool ok = true;
+  do {
+    if (DGifGetRecordType(GifFile, &RecordType) == GIF_ERROR) {
+      ok = false;
+      break;
+    }
+    
+    switch (RecordType) {
+    case IMAGE_DESC_RECORD_TYPE:
+      if (DGifGetImageDesc(GifFile) == GIF_ERROR ||
+	  DGifGetCode(GifFile, &CodeSize, &CodeBlock) == GIF_ERROR) {
+	ok = false;
+	break;
+      }
+      while (CodeBlock != NULL)
+	if (DGifGetCodeNext(GifFile, &CodeBlock) == GIF_ERROR) {
+	  ok = false;
+	  break;
+	}
+      break;
+    case EXTENSION_RECORD_TYPE:
+      if (DGifGetExtension(GifFile, &ExtCode, &Extension) == GIF_ERROR) {
+	ok = false;
+	break;
+      }
+      while (Extension != NULL)
+	if (DGifGetExtensionNext(GifFile, &Extension) == GIF_ERROR) {
+	  ok = false;
+	  break;
+	}
+      break;
+    default:
+      break;
+    }
+  }
+  while (ok && RecordType != TERMINATE_RECORD_TYPE);
+  
+  ColorMapObject* ColorMap = (GifFile->Image.ColorMap ? GifFile->Image.ColorMap :
+			      GifFile->SColorMap);
+  if (!ok)
+    PrintGifError();
+  else if (ColorMap) {
+    std::vector<uint16_t> rmap (ColorMap->ColorCount),
+      gmap (ColorMap->ColorCount), bmap (ColorMap->ColorCount);
+    for (int i = 0; i < ColorMap->ColorCount; ++i) {
+      rmap[i] = ColorMap->Colors[i].Red << 8;
+      gmap[i] = ColorMap->Colors[i].Green << 8;
+      bmap[i] = ColorMap->Colors[i].Blue << 8;
+    }
+    colorspace_de_palette_spec (image.spp, image.bps, ColorMap->ColorCount,
+				&rmap[0], &gmap[0], &bmap[0]);
+  }
+  
+  DGifCloseFile(GifFile);
+  return ok;
+}
+
 bool GIFCodec::writeImage (std::ostream* stream, Image& image, int quality,
 			   const std::string& compress)
 {
@@ -174,6 +264,13 @@ bool GIFCodec::writeImage (std::ostream* stream, Image& image, int quality,
   
   int ColorMapSize = 256;
   
+  // indexed images are written with their own palette, as is
+  if (image.isIndexed()) {
+    ColorMapSize = 2; // GIF color maps are a power of two
+    while (ColorMapSize < image.paletteSize() && ColorMapSize < 256)
+      ColorMapSize *= 2;
+  }
+  
   // later use our own colormap generation
   ColorMapObject* OutputColorMap = MakeMapObject(ColorMapSize, NULL);
   if (!OutputColorMap)
@@ -184,29 +281,53 @@ bool GIFCodec::writeImage (std::ostream* stream, Image& image, int quality,
   if (!OutputBuffer)
     return false;
   
-  GifByteType
-    *RedBuffer = new GifByteType [image.w*image.h],
-    *GreenBuffer = new GifByteType [image.w*image.h],
-    *BlueBuffer = new GifByteType [image.w*image.h];
-  GifByteType
-    *rptr = RedBuffer,
-    *gptr = GreenBuffer,
-    *bptr = BlueBuffer;
- 
-  for (Image::iterator it = image.begin(); it != image.end(); ++it) {
-    uint16_t r = 0, g = 0, b = 0;
-    *it;
-    it.getRGB (&r, &g, &b);
-    *rptr++ = r;
-    *gptr++ = g;
-    *bptr++ = b;
+  if (image.isIndexed()) {
+    const int entries = std::min (image.paletteSize(), ColorMapSize);
+    for (int i = 0; i < ColorMapSize; ++i) {
+      const int e = std::min (i, entries - 1);
+      OutputColorMap->Colors[i].Red = image.paletteRed()[e] >> 8;
+      OutputColorMap->Colors[i].Green = image.paletteGreen()[e] >> 8;
+      OutputColorMap->Colors[i].Blue = image.paletteBlue()[e] >> 8;
+    }
+    
+    // one index per byte
+    const uint8_t* data = image.getConstAlignedRawData();
+    const int bps = image.bps, stride = image.stride(); // after the alignment
+    GifByteType* dst = OutputBuffer;
+    for (int y = 0; y < image.h; ++y) {
+      const uint8_t* src = data + y * stride;
+      for (int x = 0; x < image.w; ++x) {
+	const int bit = x * bps;
+	*dst++ = (src[bit / 8] >> (8 - bps - bit % 8)) & ((1 << bps) - 1);
+      }
+    }
   }
-   
-  
-  if (QuantizeBuffer(image.w, image.h, &ColorMapSize,
-		     RedBuffer, GreenBuffer, BlueBuffer,
-		     OutputBuffer, OutputColorMap->Colors) == GIF_ERROR) {
-    return false;
+  else {
+    GifByteType
+      *RedBuffer = new GifByteType [image.w*image.h],
+      *GreenBuffer = new GifByteType [image.w*image.h],
+      *BlueBuffer = new GifByteType [image.w*image.h];
+    GifByteType
+      *rptr = RedBuffer,
+      *gptr = GreenBuffer,
+      *bptr = BlueBuffer;
+ 
+    for (Image::iterator it = image.begin(); it != image.end(); ++it) {
+      uint16_t r = 0, g = 0, b = 0;
+      *it;
+      it.getRGB (&r, &g, &b);
+      *rptr++ = r;
+      *gptr++ = g;
+      *bptr++ = b;
+    }
+    
+    if (QuantizeBuffer(image.w, image.h, &ColorMapSize,
+		       RedBuffer, GreenBuffer, BlueBuffer,
+		       OutputBuffer, OutputColorMap->Colors) == GIF_ERROR) {
+      return false;
+    }
+    
+    delete (RedBuffer); delete (GreenBuffer); delete (BlueBuffer);
   }
   
   std::cerr << "Writing uncompressed GIF file with "
@@ -232,10 +353,13 @@ bool GIFCodec::writeImage (std::ostream* stream, Image& image, int quality,
   }
   free (OutputBuffer);
 
-  delete (RedBuffer); delete (GreenBuffer); delete (BlueBuffer);
-
   EGifCloseFile(GifFile);
   return true;
 }
 
+bool GIFCodec::supportsIndexed ()
+{
+  return true;
+}
+
 GIFCodec gif_loader;
@@ -26,6 +26,10 @@
 
 #include <setjmp.h> // optional error recovery
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "jpeg.hh"
 
 #include "crop.hh"
@@ -33,6 +37,7 @@
 #include "rotate.hh"
 
 #include "Endianess.hh"
+#include "memstream.hh"
 
 /*
  * ERROR HANDLING:
@@ -102,6 +107,7 @@ typedef struct {
   struct jpeg_source_mgr pub;	/* public fields */
 
   std::istream* stream;
+  Utility::membuf* memory;	/* in memory stream, read directly */
   JOCTET* buffer;		/* start of buffer */
   bool start_of_file;	/* have we gotten any data yet? */
 } cpp_src_mgr;
@@ -119,6 +125,15 @@ boolean fill_input_buffer (j_decompress_ptr cinfo)
 {
   cpp_src_mgr* src = (cpp_src_mgr*) cinfo->src;
   
+  // in memory: hand out all the remaining data at once, without a copy
+  if (src->memory && src->memory->tell() < src->memory->size()) {
+    src->pub.next_input_byte = (const JOCTET*) src->memory->data() + src->memory->tell();
+    src->pub.bytes_in_buffer = src->memory->size() - src->memory->tell();
+    src->stream->seekg (0, std::ios::end);
+    src->start_of_file = FALSE;
+    return TRUE;
+  }
+  
   size_t nbytes = src->stream->tellg ();
 
   src->stream->read ((char*)src->buffer, INPUT_BUF_SIZE);
@@ -168,6 +183,7 @@ void term_source (j_decompress_ptr cinfo)
   /* no work necessary here */
   free (((cpp_src_mgr*)cinfo->src)->buffer);
   free (cinfo->src);
+  cinfo->src = NULL; // for the next image of a cached context
 }
 
 
@@ -189,6 +205,7 @@ void cpp_stream_src (j_decompress_ptr cinfo, std::istream* stream)
   src->pub.term_source = term_source;
   
   src->stream = stream;
+  src->memory = Utility::membuf::of (stream);
   
   src->pub.bytes_in_buffer = 0; /* forces fill_input_buffer on first read */
   src->pub.next_input_byte = NULL; /* until buffer loaded */
@@ -253,6 +270,7 @@ void term_destination (j_compress_ptr cinfo)
     ERREXIT(cinfo, JERR_FILE_WRITE);
   
   free (cinfo->dest);
+  cinfo->dest = NULL;
 }
 
 
@@ -272,10 +290,65 @@ void cpp_stream_dest (j_compress_ptr cinfo, std::ostream* stream)
   dest->stream = stream;
 }
 
+/* *** contexts, kept by a CodecSession *** */
+
+struct jpeg_decompress_context : public CodecSession::Context
+{
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+  
+  jpeg_decompress_context () {
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = my_error_exit;
+    jpeg_create_decompress (&cinfo);
+  }
+  
+  ~jpeg_decompress_context () {
+    if (cinfo.src) // after an error
+      term_source (&cinfo);
+    jpeg_destroy_decompress (&cinfo);
+  }
+  
+  static jpeg_decompress_context* take () {
+    return CodecSession::Take<jpeg_decompress_context> (CodecSession::JPEGDecompress);
+  }
+  
+  // also after an error, ready for the next image
+  void give () {
+    jpeg_abort_decompress (&cinfo);
+    CodecSession::Give (CodecSession::JPEGDecompress, this);
+  }
+};
+
+struct jpeg_compress_context : public CodecSession::Context
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  
+  jpeg_compress_context () {
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress (&cinfo);
+  }
+  
+  ~jpeg_compress_context () {
+    free (cinfo.dest);
+    jpeg_destroy_compress (&cinfo);
+  }
+  
+  static jpeg_compress_context* take () {
+    return CodecSession::Take<jpeg_compress_context> (CodecSession::JPEGCompress);
+  }
+  
+  void give () {
+    jpeg_abort_compress (&cinfo);
+    CodecSession::Give (CodecSession::JPEGCompress, this);
+  }
+};
+
 /* *** back on-topic *** */
 
 JPEGCodec::JPEGCodec (Image* _image)
-  : ImageCodec (_image)
+  : ImageCodec (_image), decode_gray (false)
 {
 }
 
@@ -297,7 +370,11 @@ int JPEGCodec::readImage (std::istream* stream, Image& image, const std::string&
       return false;
   }
   
-  if (!readMeta (stream, image))
+  // only decode the luma channel if the caller just needs gray
+  int spp, bps;
+  bool to_gray = decodeTarget (decompres, spp, bps) && spp == 1 && bps <= 8;
+  
+  if (!readMeta (stream, image, &to_gray))
     return false;
   
   // on-demand compression
@@ -305,12 +382,16 @@ int JPEGCodec::readImage (std::istream* stream, Image& image, const std::string&
   
   // freestanding instance
   JPEGCodec* codec = new JPEGCodec(&image);
+  codec->decode_gray = to_gray;
   image.setCodec(codec);
   
   // private copy for deferred decoding
   //private_copy.str().resize(stream->tellg());
   stream->seekg (0);
-  *stream >> codec->private_copy.rdbuf();
+  if (Utility::membuf* memory = Utility::membuf::of (stream))
+    codec->private_copy.write (memory->data(), memory->size());
+  else
+    *stream >> codec->private_copy.rdbuf();
   
   // parse Exif data, might contain non-identifiy orientation transform
   codec->parseExif(image);
@@ -318,6 +399,9 @@ int JPEGCodec::readImage (std::istream* stream, Image& image, const std::string&
   return true;
 }
 
+static bool rewriteMeta (const std::string& jpeg, const Image& image,
+			 std::ostream* stream);
+
 bool JPEGCodec::writeImage (std::ostream* stream, Image& image, int quality,
 			    const std::string& compress)
 {
@@ -327,10 +411,17 @@ bool JPEGCodec::writeImage (std::ostream* stream, Image& image, int quality,
   // if the instance is freestanding it can only be called by the mux
   // if the cache is valid
   if (_image && c != "recompress") {
-    // if meta information was modified re-encode the stream
-    if (image.isMetaModified()) {
-      std::cerr << "Re-encoding DCT coefficients (due meta changes)." << std::endl;
-      doTransform (JXFORM_NONE, image, stream);
+    // if meta information was modified re-encode the stream, likewise
+    // if the image was decoded as gray only
+    if (decode_gray) {
+      std::cerr << "Re-encoding DCT coefficients (due gray decode)." << std::endl;
+      doTransform (JXFORM_NONE, image, stream, decode_gray);
+    } else if (image.isMetaModified()) {
+      std::cerr << "Rewriting meta data of the DCT buffer." << std::endl;
+      if (!rewriteMeta (private_copy.str(), image, stream)) {
+	std::cerr << "Re-encoding DCT coefficients (due meta changes)." << std::endl;
+	doTransform (JXFORM_NONE, image, stream);
+      }
     } else {
       std::cerr << "Writing unmodified DCT buffer." << std::endl;
       *stream << private_copy.str();
@@ -340,65 +431,215 @@ bool JPEGCodec::writeImage (std::ostream* stream, Image& image, int quality,
   }
   
   // really encode
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-
-  JSAMPROW buffer[1];	/* pointer to JSAMPLE row[s] */
-
-  /* Initialize the JPEG compression object with default error handling. */
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
-  cpp_stream_dest (&cinfo, stream);
-  
-  cinfo.in_color_space = JCS_UNKNOWN;
-  if (image.bps == 8 && image.spp == 3)
-    cinfo.in_color_space = JCS_RGB;
-  else if (image.bps == 8 && image.spp == 1)
-    cinfo.in_color_space = JCS_GRAYSCALE;
-  else if (image.bps == 8 && image.spp == 4)
-    cinfo.in_color_space = JCS_CMYK;
-
-  if (cinfo.in_color_space == JCS_UNKNOWN) {
+  if (image.bps != 8 || (image.spp != 1 && image.spp != 3 && image.spp != 4)) {
     if (image.bps < 8)
       std::cerr << "JPEGCodec: JPEG can not hold less than 8 bit-per-channel." << std::endl;
     else
       std::cerr << "Unhandled bps/spp combination." << std::endl;
-    jpeg_destroy_compress(&cinfo);
     return false;
   }
   
-  cinfo.image_width = image.w;
-  cinfo.image_height = image.h;
-  cinfo.input_components = image.spp;
-  cinfo.data_precision = image.bps; 
+  JPEGStreamEncoder encoder (stream, image, quality);
+  return encoder.Write (image.getConstAlignedRawData(), image.h, image.stride()) &&
+    encoder.Finish ();
+}
+
+/* *** band-wise encoding *** */
+
+static void setup_compress (jpeg_compress_struct* cinfo, const Image& image,
+			    int quality)
+{
+  cinfo->in_color_space = image.spp == 1 ? JCS_GRAYSCALE :
+    image.spp == 4 ? JCS_CMYK : JCS_RGB;
+  
+  cinfo->image_width = image.w;
+  cinfo->image_height = image.h;
+  cinfo->input_components = image.spp;
+  cinfo->data_precision = image.bps; 
   
   /* defaults depending on in_color_space */
-  jpeg_set_defaults(&cinfo);
+  jpeg_set_defaults(cinfo);
   
-  jpeg_compress_set_density (&cinfo, image);
+  jpeg_compress_set_density (cinfo, image);
 
-  jpeg_set_quality(&cinfo, quality, FALSE); /* do not limit to baseline-JPEG values */
-
-  /* Start compressor */
-  jpeg_start_compress(&cinfo, TRUE);
+  jpeg_set_quality(cinfo, quality, FALSE); /* do not limit to baseline-JPEG values */
+}
 
-  /* Process data */
-  while (cinfo.next_scanline < cinfo.image_height) {
-    buffer[0] = (JSAMPLE*) image.getRawData() +
-      cinfo.next_scanline*image.stride();
-    (void) jpeg_write_scanlines(&cinfo, buffer, 1);
+// the offset after the SOS header, where the entropy coded data starts
+static size_t scan_start (const std::string& jpeg, size_t* sof = 0)
+{
+  for (size_t i = 2; i + 4 <= jpeg.size();) {
+    if ((uint8_t)jpeg[i] != 0xFF)
+      return 0;
+    const uint8_t marker = jpeg[i + 1];
+    const size_t len = ((uint8_t)jpeg[i + 2] << 8) | (uint8_t)jpeg[i + 3];
+    if (sof && marker >= 0xC0 && marker <= 0xC2)
+      *sof = i;
+    if (marker == 0xDA)
+      return i + 2 + len;
+    i += 2 + len;
   }
+  return 0;
+}
 
-  /* Finish compression and release memory */
-  jpeg_finish_compress(&cinfo);
-  jpeg_destroy_compress(&cinfo);
+JPEGStreamEncoder::JPEGStreamEncoder (std::ostream* _stream, const Image& image,
+				      int _quality)
+  : stream (_stream), quality (_quality), rows_done (0), band (0),
+    pending_rows (0)
+{
+  meta.w = image.w;
+  meta.h = image.h;
+  meta.spp = image.spp;
+  meta.bps = image.bps;
+  meta.setResolution (image.resolutionX(), image.resolutionY());
+  row_bytes = meta.w * meta.spp;
+  
+  // the MCU size, as chosen by the library defaults
+  jpeg_compress_context* context = jpeg_compress_context::take ();
+  struct jpeg_compress_struct& cinfo = context->cinfo;
+  setup_compress (&cinfo, meta, quality);
+  int mcu_w = 0, mcu_h = 0;
+  for (int i = 0; i < cinfo.num_components; ++i) {
+    mcu_w = std::max (mcu_w, cinfo.comp_info[i].h_samp_factor * DCTSIZE);
+    mcu_h = std::max (mcu_h, cinfo.comp_info[i].v_samp_factor * DCTSIZE);
+  }
+  context->give ();
+  
+  /* Bands of about 1 MiB input, in multiples of 8 MCU rows so that the
+     restart marker numbers (modulo 8) continue seamlessly across bands.
+     Preferably the whole band is one restart interval, the interval is
+     limited to 65535 MCUs though. */
+  const int unit = 8 * mcu_h;
+  band_rows = std::max (1, (1 << 20) / std::max (row_bytes, 1));
+  band_rows = (band_rows + unit - 1) / unit * unit;
+  const int mcus_per_row = (meta.w + mcu_w - 1) / mcu_w;
+  restart_rows = mcus_per_row * (band_rows / mcu_h) <= 65535 ?
+    band_rows / mcu_h : 1;
+  band_intervals = band_rows / mcu_h / restart_rows;
+  
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads ();
+#endif
+  batch_rows = band_rows * std::max (threads, 1);
+}
 
-  if (jerr.num_warnings)
-    std::cerr << jerr.num_warnings << " Warnings." << std::endl;
+bool JPEGStreamEncoder::encodeBands (const uint8_t* data, int rows, int stride)
+{
+  const int bands = (rows + band_rows - 1) / band_rows;
+  const bool restart = meta.h > band_rows;
+  std::vector<std::string> coded (bands);
+  
+  #pragma omp parallel for schedule (dynamic, 1)
+  for (int i = 0; i < bands; ++i)
+    {
+      const int y = i * band_rows;
+      Image band_meta;
+      band_meta.w = meta.w;
+      band_meta.h = std::min (band_rows, rows - y);
+      band_meta.spp = meta.spp;
+      band_meta.bps = meta.bps;
+      band_meta.setResolution (meta.resolutionX(), meta.resolutionY());
+      
+      // per thread, cached with a CodecSession
+      jpeg_compress_context* context = jpeg_compress_context::take ();
+      struct jpeg_compress_struct& cinfo = context->cinfo;
+      
+      std::ostringstream out;
+      cpp_stream_dest (&cinfo, &out);
+      setup_compress (&cinfo, band_meta, quality);
+      if (restart)
+	cinfo.restart_in_rows = restart_rows;
+      
+      jpeg_start_compress(&cinfo, TRUE);
+      while (cinfo.next_scanline < cinfo.image_height) {
+	JSAMPROW buffer[1] = {
+	  (JSAMPLE*) data + (y + cinfo.next_scanline) * stride };
+	(void) jpeg_write_scanlines(&cinfo, buffer, 1);
+      }
+      jpeg_finish_compress(&cinfo);
+      context->give ();
+      
+      coded[i] = out.str();
+    }
+  
+  // stitch: one header, the bands' entropy coded data and restart markers
+  for (int i = 0; i < bands; ++i, ++band)
+    {
+      const std::string& jpeg = coded[i];
+      size_t sof = 0;
+      const size_t start = scan_start (jpeg, &sof);
+      if (!start || !sof || jpeg.size() < start + 2)
+	return false;
+      
+      if (band == 0) {
+	std::string header = jpeg.substr (0, start);
+	header[sof + 5] = meta.h >> 8;
+	header[sof + 6] = meta.h & 0xff;
+	*stream << header;
+      }
+      else {
+	const int interval = band * band_intervals - 1;
+	stream->put ((char)0xFF);
+	stream->put ((char)(0xD0 + interval % 8));
+      }
+      // without EOI
+      stream->write (jpeg.data() + start, jpeg.size() - start - 2);
+    }
+  
+  return !!*stream;
+}
 
+bool JPEGStreamEncoder::Write (const uint8_t* data, int rows, int stride)
+{
+  if (rows_done + pending_rows + rows > meta.h)
+    return false;
+  
+  while (rows > 0)
+    {
+      // whole batches, and the final rows, are encoded in place
+      if (pending_rows == 0 &&
+	  (rows >= batch_rows || rows_done + rows == meta.h)) {
+	const int n = std::min (rows, batch_rows);
+	if (!encodeBands (data, n, stride))
+	  return false;
+	rows_done += n;
+	data += n * stride;
+	rows -= n;
+	continue;
+      }
+      
+      const int n = std::min (rows, batch_rows - pending_rows);
+      pending.resize ((size_t)batch_rows * row_bytes);
+      for (int y = 0; y < n; ++y)
+	memcpy (&pending[(size_t)(pending_rows + y) * row_bytes],
+		data + y * stride, row_bytes);
+      pending_rows += n;
+      data += n * stride;
+      rows -= n;
+      
+      if (pending_rows == batch_rows || rows_done + pending_rows == meta.h) {
+	if (!encodeBands (&pending[0], pending_rows, row_bytes))
+	  return false;
+	rows_done += pending_rows;
+	pending_rows = 0;
+      }
+    }
+  
   return true;
 }
 
+bool JPEGStreamEncoder::Finish ()
+{
+  if (rows_done != meta.h || band == 0)
+    return false;
+  
+  stream->put ((char)0xFF);
+  stream->put ((char)0xD9);
+  stream->flush ();
+  return !!*stream;
+}
+
 template<typename T>
 T readExif(const void* raw_ptr, const bool big_endian)
 {
@@ -410,18 +651,17 @@ T readExif(const void* raw_ptr, const bool big_endian)
     return ByteSwap<LittleEndianTraits, NativeEndianTraits, T>::Swap(v);
 }
 
-void JPEGCodec::parseExif (Image& image)
+// the orientation tag, 0 if none, the data must start with the SOI
+// marker and be padded to cover a whole Exif APP1 segment
+static unsigned exifOrientation (const uint8_t* exif_data)
 {
   // for now we're only interested in the orientation tag
   // TODO: parse, provide and re-write the whole meta data
   
-  const std::string& exif_data_p = private_copy.str();
-  const uint8_t* exif_data = (uint8_t*)exif_data_p.c_str();
-  
   // check for JPEG SOI + Exif APP1
   if (exif_data[0] != 0xFF ||
       exif_data[1] != 0xD8)
-    return;
+    return 0;
 
   // check "Exif" header
   for (int offset = 2; offset <= 20; offset = 20) {
@@ -439,7 +679,7 @@ void JPEGCodec::parseExif (Image& image)
     }
 
     if (offset == 20)
-      return;
+      return 0;
   }
 
   // Get the marker parameter length count
@@ -447,10 +687,10 @@ void JPEGCodec::parseExif (Image& image)
   
   // length includes itself, so must be at least 2 + Exif data length must be at least 6
   if (length < 8)
-    return;
+    return 0;
   length -= 8;
   if (length < 12)
-    return; // length of an IFD entry
+    return 0; // length of an IFD entry
   
   exif_data += 10;
 
@@ -461,41 +701,187 @@ void JPEGCodec::parseExif (Image& image)
   else if (exif_data[0] == 0x4D && exif_data[1] == 0x4D)
     big_endian = true;
   else
-    return;
+    return 0;
   
   // Check tag mark
   if (big_endian) {
-    if (exif_data[2] != 0) return;
-    if (exif_data[3] != 0x2A) return;
+    if (exif_data[2] != 0) return 0;
+    if (exif_data[3] != 0x2A) return 0;
   } else {
-    if (exif_data[3] != 0) return;
-    if (exif_data[2] != 0x2A) return;
+    if (exif_data[3] != 0) return 0;
+    if (exif_data[2] != 0x2A) return 0;
   }
 
   // get first IFD offset (offset to IFD0)
   unsigned offset = readExif<uint32_t>(exif_data + 4, big_endian);
-  if (offset > length - 2) return; // check end of data segment
+  if (offset > length - 2) return 0; // check end of data segment
 
   // get the number of directory entries contained in this IFD
   unsigned number_of_tags = readExif<uint16_t>(exif_data + offset, big_endian);
-  if (number_of_tags == 0) return;
+  if (number_of_tags == 0) return 0;
   offset += 2;
 
   // search for orientation tag in IFD0
   for (;;) {
-    if (offset > length - 12) return; // check end of data segment
+    if (offset > length - 12) return 0; // check end of data segment
     // get tag number
     unsigned tagnum = readExif<uint16_t>(exif_data + offset, big_endian);
     if (tagnum == 0x0112) break; // orientation tag
-    if (--number_of_tags == 0) return;
+    if (--number_of_tags == 0) return 0;
     offset += 12;
   }
 
   // get the orientation value
   unsigned orientation = readExif<uint16_t>(exif_data + offset + 8, big_endian);
-  if (orientation > 8) return;
+  if (orientation > 8) return 0;
+  
+  return orientation;
+}
+
+template<typename T>
+void writeExif(void* raw_ptr, T v, const bool big_endian)
+{
+  using namespace Exact;
+  if (big_endian)
+    v = ByteSwap<NativeEndianTraits, BigEndianTraits, T>::Swap(v);
+  else
+    v = ByteSwap<NativeEndianTraits, LittleEndianTraits, T>::Swap(v);
+  memcpy (raw_ptr, &v, sizeof(v));
+}
+
+// patches the IFD0 resolution and orientation tags of the Exif TIFF
+// structure in place, they are fixed size so nothing needs to move
+static void patchExif (uint8_t* exif_data, unsigned length, const Image& image)
+{
+  if (length < 8)
+    return;
+  
+  bool big_endian;
+  if (exif_data[0] == 0x49 && exif_data[1] == 0x49)
+    big_endian = false;
+  else if (exif_data[0] == 0x4D && exif_data[1] == 0x4D)
+    big_endian = true;
+  else
+    return;
+  
+  unsigned offset = readExif<uint32_t>(exif_data + 4, big_endian);
+  if (offset > length - 2)
+    return;
+  unsigned number_of_tags = readExif<uint16_t>(exif_data + offset, big_endian);
+  offset += 2;
   
-  exif_rotate(image, orientation);
+  const bool known = image.resolutionX() != 0 && image.resolutionY() != 0;
+  for (; number_of_tags && offset <= length - 12; --number_of_tags, offset += 12)
+    {
+      uint8_t* entry = exif_data + offset;
+      const unsigned tagnum = readExif<uint16_t>(entry, big_endian);
+      const unsigned type = readExif<uint16_t>(entry + 2, big_endian);
+      
+      switch (tagnum) {
+      case 0x0112: // orientation, the pixel data is upright
+	if (type == 3) // SHORT
+	  writeExif<uint16_t>(entry + 8, 1, big_endian);
+	break;
+      case 0x0128: // resolution unit
+	if (type == 3 && known)
+	  writeExif<uint16_t>(entry + 8, 2, big_endian); // inch
+	break;
+      case 0x011A: // x and y resolution
+      case 0x011B:
+	if (type == 5 && known) { // RATIONAL, always stored at an offset
+	  const unsigned value = readExif<uint32_t>(entry + 8, big_endian);
+	  if (value <= length - 8) {
+	    writeExif<uint32_t>(exif_data + value, tagnum == 0x011A ?
+				image.resolutionX() : image.resolutionY(),
+				big_endian);
+	    writeExif<uint32_t>(exif_data + value + 4, 1, big_endian);
+	  }
+	}
+	break;
+      }
+    }
+}
+
+/* Lossless meta data update: the JFIF density and the Exif resolution
+ * and orientation are patched in the marker segments, everything else,
+ * including the entropy coded data, is copied verbatim. Returns false
+ * for a stream it does not understand, for a full transcode. */
+static bool rewriteMeta (const std::string& jpeg, const Image& image,
+			 std::ostream* stream)
+{
+  const uint8_t* data = (const uint8_t*) jpeg.data();
+  const size_t size = jpeg.size();
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    return false;
+  
+  // the marker segments up to the scan header
+  size_t sos = 2;
+  for (;;) {
+    if (sos + 4 > size || data[sos] != 0xFF)
+      return false;
+    const uint8_t marker = data[sos + 1];
+    if (marker == 0xFF) { // fill byte
+      ++sos;
+      continue;
+    }
+    if (marker == 0xDA)
+      break;
+    sos += 2 + ((data[sos + 2] << 8) | data[sos + 3]);
+  }
+  std::string header (jpeg, 0, sos);
+  
+  // unknown: no unit, just the (square) pixel aspect ratio
+  uint8_t units = 0, density[4] = {0, 1, 0, 1};
+  const bool known = image.resolutionX() != 0 && image.resolutionY() != 0;
+  if (known) {
+    const int xres = std::min (image.resolutionX(), 0xFFFF);
+    const int yres = std::min (image.resolutionY(), 0xFFFF);
+    units = 1; /* 1 for dots/inch */
+    density[0] = xres >> 8; density[1] = xres;
+    density[2] = yres >> 8; density[3] = yres;
+  }
+  
+  bool jfif = false;
+  for (size_t i = 2; i + 4 <= header.size();) {
+    uint8_t* segment = (uint8_t*) &header[i];
+    if (segment[1] == 0xFF) {
+      ++i;
+      continue;
+    }
+    const unsigned length = (segment[2] << 8) | segment[3];
+    if (segment[1] == 0xE0 && length >= 16 &&
+	memcmp (segment + 4, "JFIF", 5) == 0) {
+      segment[11] = units;
+      memcpy (segment + 12, density, 4);
+      jfif = true;
+    }
+    else if (segment[1] == 0xE1 && length >= 8 &&
+	     memcmp (segment + 4, "Exif\0", 6) == 0)
+      patchExif (segment + 10, length - 8, image);
+    i += 2 + length;
+  }
+  
+  // Exif only, the density would be lost, add a JFIF header
+  if (!jfif && known) {
+    const char app0[18] = { (char)0xFF, (char)0xE0, 0, 16,
+			    'J', 'F', 'I', 'F', 0, 1, 2, (char)units,
+			    (char)density[0], (char)density[1],
+			    (char)density[2], (char)density[3], 0, 0 };
+    header.insert (2, app0, sizeof (app0));
+  }
+  
+  stream->write (header.data(), header.size());
+  stream->write (jpeg.data() + sos, size - sos);
+  return !!*stream;
+}
+
+void JPEGCodec::parseExif (Image& image)
+{
+  const std::string& exif_data_p = private_copy.str();
+  const unsigned orientation =
+    exifOrientation ((const uint8_t*)exif_data_p.c_str());
+  if (orientation)
+    exif_rotate(image, orientation);
 }
 
 // on-demand decoding
@@ -509,25 +895,20 @@ void JPEGCodec::parseExif (Image& image)
 
 /*bool*/ void JPEGCodec::decodeNow (Image* image, int factor)
 {
-  struct jpeg_decompress_struct* cinfo = new jpeg_decompress_struct;
-  struct my_error_mgr jerr;
+  /* Step 1: allocate and initialize JPEG decompression object, or
+     reuse the one cached with a CodecSession */
+  jpeg_decompress_context* context = jpeg_decompress_context::take ();
+  struct jpeg_decompress_struct* cinfo = &context->cinfo;
   
-  /* Step 1: allocate and initialize JPEG decompression object */
-
-  /* We set up the normal JPEG error routines, then override error_exit. */
-  cinfo->err = jpeg_std_error(&jerr.pub);
-  jerr.pub.error_exit = my_error_exit;
   /* Establish the setjmp return context for my_error_exit to use. */
-  if (setjmp(jerr.setjmp_buffer)) {
+  if (setjmp(context->jerr.setjmp_buffer)) {
     /* If we get here, the JPEG code has signaled an error.
      * We need to clean up the JPEG object, close the input file, and return.
      */
-    jpeg_destroy_decompress (cinfo);
+    context->give ();
     return;
   }
   
-  jpeg_create_decompress (cinfo);
-  
   /* Step 2: specify data source (eg, a file) */
   
   private_copy.seekg (0);
@@ -540,7 +921,10 @@ void JPEGCodec::parseExif (Image& image)
   /* Step 4: set parameters for decompression */
   
   cinfo->buffered_image = TRUE; /* select buffered-image mode */
-
+  
+  if (decode_gray && cinfo->jpeg_color_space == JCS_YCbCr)
+    cinfo->out_color_space = JCS_GRAYSCALE;
+  
   // TODO: set scaling
   if (factor != 1) {
     cinfo->scale_num = 1;
@@ -578,8 +962,7 @@ void JPEGCodec::parseExif (Image& image)
   }
 
   jpeg_finish_decompress(cinfo);
-  jpeg_destroy_decompress(cinfo);
-  delete (cinfo);
+  context->give ();
   
   // shadow data is still valid for more transformations
   image->setCodec (this);
@@ -669,31 +1052,23 @@ bool JPEGCodec::scale (Image& image, double xscale, double yscale)
   return true;
 }
 
-bool JPEGCodec::readMeta (std::istream* stream, Image& image)
+bool JPEGCodec::readMeta (std::istream* stream, Image& image, bool* to_gray)
 {
   stream->seekg (0);
   
-  struct jpeg_decompress_struct* cinfo = new jpeg_decompress_struct;
-  
-  struct my_error_mgr jerr;
-  
   /* Step 1: allocate and initialize JPEG decompression object */
-
-  /* We set up the normal JPEG error routines, then override error_exit. */
-  cinfo->err = jpeg_std_error(&jerr.pub);
-  jerr.pub.error_exit = my_error_exit;
+  jpeg_decompress_context* context = jpeg_decompress_context::take ();
+  struct jpeg_decompress_struct* cinfo = &context->cinfo;
+  
   /* Establish the setjmp return context for my_error_exit to use. */
-  if (setjmp(jerr.setjmp_buffer)) {
+  if (setjmp(context->jerr.setjmp_buffer)) {
     /* If we get here, the JPEG code has signaled an error.
      * We need to clean up the JPEG object, close the input file, and return.
      */
-    jpeg_destroy_decompress (cinfo);
-    free (cinfo);
+    context->give ();
     return false;
   }
   
-  jpeg_create_decompress (cinfo);
-  
   /* Step 2: specify data source (eg, a file) */
   
   cpp_stream_src (cinfo, stream);
@@ -706,9 +1081,17 @@ bool JPEGCodec::readMeta (std::istream* stream, Image& image)
   
   cinfo->buffered_image = TRUE; /* select buffered-image mode */
   
-  /* Step 5: Start decompressor */
+  // libjpeg can only skip the chroma channels of YCbCr data
+  if (to_gray) {
+    *to_gray = *to_gray && cinfo->jpeg_color_space == JCS_YCbCr;
+    if (*to_gray)
+      cinfo->out_color_space = JCS_GRAYSCALE;
+  }
   
-  jpeg_start_decompress (cinfo);
+  /* Only compute the output geometry, starting (and finishing) the
+   * decompressor would consume all the scans. */
+  
+  jpeg_calc_output_dimensions (cinfo);
   
   image.w = cinfo->output_width;
   image.h = cinfo->output_height;
@@ -730,14 +1113,36 @@ bool JPEGCodec::readMeta (std::istream* stream, Image& image)
       image.setResolution(0, 0);
     }
   
-  /* This is an important step since it will release a good deal of memory. */
-  jpeg_finish_decompress(cinfo);
-  jpeg_destroy_decompress(cinfo);
-  delete (cinfo);
+  // not finished, so release the source manager ourselves
+  term_source (cinfo);
+  context->give ();
 
   return true;
 }
 
+int JPEGCodec::probeImage (std::istream* stream, Image& image, int index,
+			   int& orientation)
+{
+  if (index != 0 || stream->peek () != 0xFF)
+    return false;
+  
+  if (!readMeta (stream, image))
+    return false;
+  
+  // the Exif APP1 segment is within the first few bytes
+  std::string head (20 + 0x10000 + 12, 0);
+  stream->clear ();
+  stream->seekg (0);
+  stream->read (&head[0], head.size());
+  orientation = exifOrientation ((const uint8_t*)head.data());
+  
+  // as Read() applies it: left or right side up
+  if (orientation >= 5)
+    std::swap (image.w, image.h);
+  
+  return true;
+}
+
 bool JPEGCodec::doTransform (JXFORM_CODE code, Image& image,
 			     std::ostream* s, bool to_gray, bool crop,
 			     unsigned int x, unsigned int y,
@@ -773,7 +1178,8 @@ bool JPEGCodec::doTransform (JXFORM_CODE code, Image& image,
   transformoption.transform = code;
   transformoption.trim = TRUE;
   transformoption.perfect = FALSE;
-  transformoption.force_grayscale = to_gray ? TRUE : FALSE;
+  // keep the gray decode consistent with the transformed copy
+  transformoption.force_grayscale = (to_gray || decode_gray) ? TRUE : FALSE;
   
   transformoption.crop = crop ? TRUE : FALSE;
   if (crop) {
@@ -836,6 +1242,10 @@ bool JPEGCodec::doTransform (JXFORM_CODE code, Image& image,
   if (!s) {
     // copy into the shadow buffer
     private_copy.str (stream.str());
+    if (decode_gray) {
+      decode_gray = false; // the copy is gray now
+      to_gray = true;
+    }
     
     // if the data is accessed again, it must be re-encoded
     image.setRawData(0);
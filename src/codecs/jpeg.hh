@@ -23,13 +23,14 @@ extern "C" {
 }
 
 #include <sstream>
+#include <vector>
 
 #include "Codecs.hh"
 
 class JPEGCodec : public ImageCodec {
 public:
   
-  JPEGCodec () {
+  JPEGCodec () : decode_gray (false) {
     registerCodec ("jpeg", this);
     registerCodec ("jpg", this);
   };
@@ -40,6 +41,7 @@ public:
   virtual std::string getID () { return "JPEG"; };
   
   virtual int readImage (std::istream* stream, Image& image, const std::string& decompres);
+  virtual int probeImage (std::istream* stream, Image& image, int index, int& orientation);
   virtual bool writeImage (std::ostream* stream, Image& image,
 			   int quality, const std::string& compress);
   
@@ -59,11 +61,43 @@ private:
   void parseExif (Image& image);
   void decodeNow (Image* image, int factor);
   
-  // internals and helper
-  bool readMeta (std::istream* stream, Image& image);
+  // internals and helper, optionally for a gray (luma only) decode
+  bool readMeta (std::istream* stream, Image& image, bool* to_gray = 0);
   bool doTransform (JXFORM_CODE code, Image& image,
 		    std::ostream* stream = 0, bool to_gray = false, bool crop = false,
 		    unsigned int x = 0, unsigned int y = 0, unsigned int w = 0, unsigned int h = 0);
   
   std::stringstream private_copy;
+  // colour data decoded as gray, the private copy is still colour
+  bool decode_gray;
+};
+
+/* Band-wise baseline encoder. The image is cut into horizontal bands of
+ * whole MCU rows that are compressed concurrently, each band ending in a
+ * restart interval, and then stitched into one JPEG stream. Rows can be
+ * written as they are produced, only a few bands per thread are held in
+ * memory. The meta image just provides w, h, spp, bps and resolution. */
+class JPEGStreamEncoder
+{
+public:
+  JPEGStreamEncoder (std::ostream* stream, const Image& meta, int quality = 75);
+  
+  // the next rows, top to bottom
+  bool Write (const uint8_t* data, int rows, int stride);
+  // all rows written, completes the stream
+  bool Finish ();
+  
+private:
+  bool encodeBands (const uint8_t* data, int rows, int stride);
+  
+  std::ostream* stream;
+  Image meta; // without pixel data
+  int quality;
+  int row_bytes;
+  int band_rows; // in pixel
+  int restart_rows, band_intervals; // MCU rows per interval, per band
+  int batch_rows; // bands encoded at once
+  int rows_done, band;
+  std::vector<uint8_t> pending;
+  int pending_rows;
 };
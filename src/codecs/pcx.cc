@@ -239,7 +239,7 @@ int PCXCodec::readImage(std::istream* stream,
 	return false;
       }
       
-      colorspace_de_palette (image, 256, rmap, gmap, bmap);
+      image.setPalette (256, rmap, gmap, bmap);
     }
     else if (header.PaletteInfo == 1 || header.PaletteInfo == 2)
       {
@@ -250,7 +250,7 @@ int PCXCodec::readImage(std::istream* stream,
 	    gmap[i] = header.Colormap[i][1] * 0xffff / 0xff;
 	    bmap[i] = header.Colormap[i][2] * 0xffff / 0xff;
 	  }
-	colorspace_de_palette(image, ncolors, rmap, gmap, bmap);
+	image.setPalette (ncolors, rmap, gmap, bmap);
       }
   }
   
@@ -270,6 +270,7 @@ bool PCXCodec::writeImage(std::ostream* stream, Image& image, int quality,
   
   header.Encoding = 0; // 1: RLE
   header.NPlanes = image.spp;
+  const uint8_t* pixels = image.getRawData(); // packs sub-image views
   header.BytesPerLine = image.stride() / image.spp;
   header.BitsPerPixel = image.bps;
   header.PaletteInfo = 0;
@@ -302,7 +303,7 @@ bool PCXCodec::writeImage(std::ostream* stream, Image& image, int quality,
     {
       for (int plane = 0; plane < image.spp; ++plane)
 	{
-	  uint8_t* data = image.getRawData() + image.stride() * y + plane;
+	  const uint8_t* data = pixels + image.stride() * y + plane;
 	  for (int x = 0; x < image.w; ++x)
 	    {
 	      stream->write((char*)data, 1);
@@ -427,8 +427,8 @@ struct PDFXObject : public PDFStream
   
   virtual void writeStreamImpl(std::ostream& s)
   {
-    const int bytes = image.stride() * image.h;
     uint8_t* data = image.getRawData();
+    const int bytes = image.stride() * image.h;
     
     if (encoding == "/FlateDecode")
       EncodeZlib(s, (const char*)data, bytes);
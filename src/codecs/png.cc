@@ -16,9 +16,13 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <png.h>
+#include <zlib.h>
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 #include "png.hh"
 #include "Endianess.hh"
@@ -43,8 +47,71 @@ void stdstream_flush_data(png_structp png_ptr)
   stream = stream;
 }
 
+/* The allocations of a libpng read or write struct. libpng can not
+ * reset its structs for the next image, but with a CodecSession their
+ * memory (mostly the zlib state and row buffers, of the same sizes
+ * again for similar images) is recycled. */
+class png_memory : public CodecSession::Context
+{
+public:
+  ~png_memory ()
+  {
+    for (unsigned i = 0; i < blocks.size(); ++i)
+      ::free (blocks[i]);
+  }
+  
+  static png_voidp malloc (png_structp png_ptr, png_size_t size)
+  {
+    png_memory* memory = (png_memory*) png_get_mem_ptr (png_ptr);
+    std::vector<size_t*>& blocks = memory->blocks;
+    for (unsigned i = 0; i < blocks.size(); ++i)
+      if (*blocks[i] == size) {
+	uint8_t* block = (uint8_t*) blocks[i];
+	blocks.erase (blocks.begin() + i);
+	return block + header_bytes;
+      }
+    
+    size_t* block = (size_t*) ::malloc (size + header_bytes);
+    if (!block)
+      return 0;
+    *block = size;
+    return (uint8_t*) block + header_bytes;
+  }
+  
+  static void free (png_structp png_ptr, png_voidp ptr)
+  {
+    if (!ptr)
+      return;
+    png_memory* memory = (png_memory*) png_get_mem_ptr (png_ptr);
+    size_t* block = (size_t*) ((uint8_t*) ptr - header_bytes);
+    if (memory->blocks.size() < max_blocks)
+      memory->blocks.push_back (block);
+    else
+      ::free (block);
+  }
+  
+private:
+  static const size_t header_bytes = 16; // keeps malloc's alignment
+  static const unsigned max_blocks = 32;
+  std::vector<size_t*> blocks; // free, their size in front
+};
 
-int PNGCodec::readImage (std::istream* stream, Image& image, const std::string& decompres)
+// the png_memory of this thread, for the life time of a libpng struct
+struct png_memory_scope
+{
+  png_memory_scope ()
+    : memory (CodecSession::Take<png_memory> (CodecSession::PNGMemory)) {}
+  ~png_memory_scope () {
+    CodecSession::Give (CodecSession::PNGMemory, memory);
+  }
+  
+  png_memory* memory;
+};
+
+
+// with header_only just the meta data is set up, as it would be decoded
+static int readPNG (std::istream* stream, Image& image, const std::string& decompres,
+		    bool header_only)
 {
   { // quick magic check
     char buf [4];
@@ -60,10 +127,13 @@ int PNGCodec::readImage (std::istream* stream, Image& image, const std::string&
   png_uint_32 width, height;
   int bit_depth, color_type, interlace_type;
   
-  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-				   NULL /*user_error_ptr*/,
-				   NULL /*user_error_fn*/,
-				   NULL /*user_warning_fn*/);
+  png_memory_scope memory;
+  png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+				     NULL /*user_error_ptr*/,
+				     NULL /*user_error_fn*/,
+				     NULL /*user_warning_fn*/,
+				     memory.memory,
+				     png_memory::malloc, png_memory::free);
   
   if (png_ptr == NULL)
     return 0;
@@ -119,8 +189,19 @@ int PNGCodec::readImage (std::istream* stream, Image& image, const std::string&
    * (not useful if you are using png_set_packing). */
   // png_set_packswap(png_ptr);
 
+  int target_spp, target_bps;
+  const bool target = ImageCodec::decodeTarget (decompres, target_spp, target_bps);
+  
+  /* Keep paletted data indexed, if the palette needs no alpha channel,
+     Read() expands it unless asked not to */
+  png_colorp palette = 0;
+  int num_palette = 0;
+  if (color_type == PNG_COLOR_TYPE_PALETTE && !header_only && !target &&
+      !png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+    png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
+  
   /* Expand paletted colors into true RGB triplets */
-  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+  if (color_type == PNG_COLOR_TYPE_PALETTE && !palette) {
     png_set_palette_to_rgb(png_ptr);
     image.bps = 8;
     if (info_ptr->num_trans)
@@ -143,6 +224,18 @@ int PNGCodec::readImage (std::istream* stream, Image& image, const std::string&
   if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
     png_set_tRNS_to_alpha(png_ptr);
   
+  /* Reduce to what the caller asked for while decoding, instead of
+   * expanding all the colour and alpha data first. */
+  if (target) {
+    if (target_bps <= 8 && bit_depth == 16)
+      png_set_strip_16(png_ptr);
+    if (target_spp < 4 && (color_type & PNG_COLOR_MASK_ALPHA ||
+			   png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)))
+      png_set_strip_alpha(png_ptr);
+    if (target_spp == 1 && (color_type & PNG_COLOR_MASK_COLOR))
+      png_set_rgb_to_gray_fixed(png_ptr, 1 /* silently */, -1, -1);
+  }
+  
   /* Set the background color to draw transparent and alpha images over.
    * It is possible to set the red, green, and blue components directly
    * for paletted images instead of supplying a palette index.  Note that
@@ -188,6 +281,14 @@ int PNGCodec::readImage (std::istream* stream, Image& image, const std::string&
 
   /* Allocate the memory to hold the image using the fields of info_ptr. */
   int stride = png_get_rowbytes (png_ptr, info_ptr);
+  // all the transformations above, applied
+  image.spp = png_get_channels (png_ptr, info_ptr);
+  image.bps = png_get_bit_depth (png_ptr, info_ptr);
+  
+  if (header_only) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
+    return true;
+  }
   
   image.resize (image.w, image.h);
   png_bytep row_pointers[1];
@@ -199,6 +300,17 @@ int PNGCodec::readImage (std::istream* stream, Image& image, const std::string&
       png_read_rows(png_ptr, row_pointers, png_bytepp_NULL, 1);
     }
   
+  if (palette) {
+    // convert to our 16bit "TIFF" format
+    std::vector<uint16_t> map (3 * num_palette);
+    for (int i = 0; i < num_palette; ++i) {
+      map[i] = palette[i].red * 0x101;
+      map[num_palette + i] = palette[i].green * 0x101;
+      map[2 * num_palette + i] = palette[i].blue * 0x101;
+    }
+    image.setPalette (num_palette, &map[0], &map[num_palette], &map[2 * num_palette]);
+  }
+  
   /* clean up after the read, and free any memory allocated - REQUIRED */
   png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
   
@@ -206,16 +318,197 @@ int PNGCodec::readImage (std::istream* stream, Image& image, const std::string&
   return true;
 }
 
+int PNGCodec::readImage (std::istream* stream, Image& image, const std::string& decompres)
+{
+  return readPNG (stream, image, decompres, false);
+}
+
+int PNGCodec::probeImage (std::istream* stream, Image& image, int index,
+			  int& orientation)
+{
+  return index == 0 && readPNG (stream, image, "", true);
+}
+
+/* Parallel IDAT encoding, in the style of pigz: the image is split into
+ * blocks of rows that are filtered and deflated independently on worker
+ * threads. Each block is primed with the last 32k of the previous one as
+ * dictionary and ends on a byte boundary (sync flush), so that the raw
+ * deflate blocks simply concatenate to one zlib stream. */
+
+static const int block_bytes = 256 << 10; // uncompressed, per thread job
+static const int window_bytes = 32768;
+
+static inline int paeth (int a, int b, int c)
+{
+  const int p = a + b - c;
+  const int pa = abs (p - a), pb = abs (p - b), pc = abs (p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// PNG filter type of row cur, prev is 0 for the first row
+static void filterRow (int type, const uint8_t* cur, const uint8_t* prev,
+		       int n, int bpp, uint8_t* out)
+{
+  out[0] = type;
+  ++out;
+  for (int i = 0; i < n; ++i) {
+    const int a = i >= bpp ? cur[i - bpp] : 0;
+    const int b = prev ? prev[i] : 0;
+    const int c = prev && i >= bpp ? prev[i - bpp] : 0;
+    switch (type) {
+    case 0: out[i] = cur[i]; break;
+    case 1: out[i] = cur[i] - a; break;
+    case 2: out[i] = cur[i] - b; break;
+    case 3: out[i] = cur[i] - ((a + b) >> 1); break;
+    case 4: out[i] = cur[i] - paeth (a, b, c); break;
+    }
+  }
+}
+
+struct PNGRows
+{
+  const uint8_t* data;
+  int stride, row_bytes, bpp;
+  bool swap; // 16 bit to network byte order
+  int filter_type; // fixed, or -1 for adaptive
+  
+  // the native row in PNG byte order, tmp is used if conversion is needed
+  const uint8_t* row (int y, uint8_t* tmp) const
+  {
+    const uint8_t* src = data + y * stride;
+    if (!swap)
+      return src;
+    for (int i = 0; i + 1 < row_bytes; i += 2) {
+      tmp[i] = src[i + 1];
+      tmp[i + 1] = src[i];
+    }
+    return tmp;
+  }
+  
+  // filters rows [y0, y1) into out, 1 + row_bytes each
+  void filter (int y0, int y1, uint8_t* out) const
+  {
+    const int n = row_bytes;
+    std::vector<uint8_t> buf (2 * n + 5 * (n + 1));
+    uint8_t* tmp[2] = { &buf[0], &buf[n] };
+    uint8_t* cand = &buf[2 * n];
+    
+    const uint8_t* prev = y0 > 0 ? row (y0 - 1, tmp[0]) : 0;
+    for (int y = y0, t = 1; y < y1; ++y, t ^= 1, out += n + 1) {
+      const uint8_t* cur = row (y, tmp[t]);
+      if (filter_type >= 0)
+	filterRow (filter_type, cur, prev, n, bpp, out);
+      else {
+	// minimum sum of absolute differences, as libpng does
+	int best = 0;
+	unsigned long best_sum = ~0ul;
+	for (int type = 0; type < 5; ++type) {
+	  uint8_t* c = cand + type * (n + 1);
+	  filterRow (type, cur, prev, n, bpp, c);
+	  unsigned long sum = 0;
+	  for (int i = 1; i <= n && sum < best_sum; ++i)
+	    sum += abs ((int)(int8_t)c[i]);
+	  if (sum < best_sum) {
+	    best_sum = sum;
+	    best = type;
+	  }
+	}
+	memcpy (out, cand + best * (n + 1), n + 1);
+      }
+      prev = cur;
+    }
+  }
+};
+
+// a raw deflate stream, reset for the next block instead of reallocated
+struct png_deflate_context : public CodecSession::Context
+{
+  png_deflate_context () : ready (false) {}
+  ~png_deflate_context () {
+    if (ready)
+      deflateEnd (&z);
+  }
+  
+  bool reset (int _level, int _strategy) {
+    if (ready && level == _level && strategy == _strategy)
+      return deflateReset (&z) == Z_OK;
+    
+    if (ready)
+      deflateEnd (&z);
+    memset (&z, 0, sizeof (z));
+    level = _level;
+    strategy = _strategy;
+    ready = deflateInit2 (&z, level, Z_DEFLATED, -15, 8, strategy) == Z_OK;
+    return ready;
+  }
+  
+  z_stream z;
+  int level, strategy;
+  bool ready;
+};
+
+struct PNGBlock
+{
+  std::vector<uint8_t> coded;
+  uLong adler;
+  uLong length; // uncompressed
+};
+
+static bool deflateBlock (const PNGRows& rows, int y0, int y1, bool last,
+			  int level, int strategy, PNGBlock& block)
+{
+  const int line = rows.row_bytes + 1;
+  std::vector<uint8_t> filtered ((y1 - y0) * line + 1);
+  rows.filter (y0, y1, &filtered[0]);
+  block.length = (y1 - y0) * line;
+  block.adler = adler32 (1, &filtered[0], block.length);
+  
+  // per thread, cached with a CodecSession
+  png_deflate_context* context =
+    CodecSession::Take<png_deflate_context> (CodecSession::PNGDeflate);
+  z_stream& z = context->z;
+  if (!context->reset (level, strategy)) {
+    CodecSession::Give (CodecSession::PNGDeflate, context);
+    return false;
+  }
+  
+  if (y0 > 0) {
+    // the tail of the previous block, filtered the same way again
+    const int dict_rows = std::min (y0, (window_bytes + line - 1) / line);
+    std::vector<uint8_t> dict (dict_rows * line);
+    rows.filter (y0 - dict_rows, y0, &dict[0]);
+    const int n = std::min ((int)dict.size(), window_bytes);
+    deflateSetDictionary (&z, &dict[dict.size() - n], n);
+  }
+  
+  block.coded.resize (deflateBound (&z, block.length) + 16);
+  z.next_in = &filtered[0];
+  z.avail_in = block.length;
+  z.next_out = &block.coded[0];
+  z.avail_out = block.coded.size();
+  const int err = deflate (&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+  block.coded.resize (block.coded.size() - z.avail_out);
+  const bool complete = z.avail_in == 0;
+  CodecSession::Give (CodecSession::PNGDeflate, context);
+  
+  return err == (last ? Z_STREAM_END : Z_OK) && complete;
+}
+
 bool PNGCodec::writeImage (std::ostream* stream, Image& image, int quality,
 			   const std::string& compress)
 {
   png_structp png_ptr;
   png_infop info_ptr;
   
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-				    NULL /*user_error_ptr*/,
-				    NULL /*user_error_fn*/,
-				    NULL /*user_warning_fn*/);
+  png_memory_scope memory;
+  png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING,
+				      NULL /*user_error_ptr*/,
+				      NULL /*user_error_fn*/,
+				      NULL /*user_warning_fn*/,
+				      memory.memory,
+				      png_memory::malloc, png_memory::free);
   
   if (png_ptr == NULL) {
     return false;
@@ -255,7 +548,8 @@ bool PNGCodec::writeImage (std::ostream* stream, Image& image, int quality,
   int color_type;
   switch (image.spp) {
   case 1:
-    color_type = PNG_COLOR_TYPE_GRAY;
+    color_type = image.isIndexed() ? PNG_COLOR_TYPE_PALETTE :
+                                     PNG_COLOR_TYPE_GRAY;
     break;
   case 4:
     color_type = PNG_COLOR_TYPE_RGB_ALPHA;
@@ -268,6 +562,16 @@ bool PNGCodec::writeImage (std::ostream* stream, Image& image, int quality,
 		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
 		PNG_FILTER_TYPE_BASE);
   
+  if (image.isIndexed()) {
+    std::vector<png_color> palette (std::min (image.paletteSize(), 1 << image.bps));
+    for (unsigned int i = 0; i < palette.size(); ++i) {
+      palette[i].red = image.paletteRed()[i] >> 8;
+      palette[i].green = image.paletteGreen()[i] >> 8;
+      palette[i].blue = image.paletteBlue()[i] >> 8;
+    }
+    png_set_PLTE (png_ptr, info_ptr, &palette[0], palette.size());
+  }
+  
   png_set_pHYs (png_ptr, info_ptr,
 		(int)(image.resolutionX() * 100 / 2.54),
 		(int)(image.resolutionY() * 100 / 2.54),
@@ -275,22 +579,63 @@ bool PNGCodec::writeImage (std::ostream* stream, Image& image, int quality,
 
   png_write_info (png_ptr, info_ptr);
   
-  int stride = png_get_rowbytes (png_ptr, info_ptr);
-
+  // sub-image views have padded rows
+  PNGRows rows;
+  rows.data = image.getConstAlignedRawData ();
+  rows.stride = image.stride ();
+  rows.row_bytes = (image.w * image.spp * image.bps + 7) / 8;
+  rows.bpp = std::max (1, image.spp * image.bps / 8);
   /* swap bytes of 16 bit data as PNG stores in network-byte-order */
-  if (!Exact::NativeEndianTraits::IsBigendian)
-    png_set_swap(png_ptr);
+  rows.swap = image.bps == 16 && !Exact::NativeEndianTraits::IsBigendian;
+  
+  /* Like libpng, filter sub-byte data not at all, otherwise pick one per
+     row adaptively. The "fast" option uses a fixed filter for bilevel and
+     gray data, which is usually as good for scans, and run-length
+     matching for bilevel data. */
+  rows.filter_type = image.bps < 8 || image.isIndexed() ? 0 : -1;
+  int strategy = Z_DEFAULT_STRATEGY;
+  if (ImageCodec::hasOption (compress, "fast") && image.spp == 1) {
+    rows.filter_type = image.bps < 8 || image.isIndexed() ? 0 : 2; // up
+    if (image.bps == 1)
+      strategy = Z_RLE;
+  }
   
-  png_bytep row_pointers[1]; 
-  /* The other way to write images */
-  int number_passes = 1;
-  for (int pass = 0; pass < number_passes; ++pass)
-    for (int y = 0; y < image.h; ++y) {
-      row_pointers[0] = image.getRawData() + y * stride;
-      png_write_rows(png_ptr, (png_byte**)&row_pointers, 1);
-    }
-
-  png_write_end(png_ptr, NULL);
+  const int block_rows = std::max (1, block_bytes / (rows.row_bytes + 1));
+  const int n_blocks = std::max (1, (image.h + block_rows - 1) / block_rows);
+  std::vector<PNGBlock> blocks (n_blocks);
+  bool ok = true;
+  
+  #pragma omp parallel for schedule (dynamic, 1)
+  for (int i = 0; i < n_blocks; ++i)
+    if (!deflateBlock (rows, i * block_rows,
+		       std::min (image.h, (i + 1) * block_rows),
+		       i == n_blocks - 1, quality, strategy, blocks[i]))
+      ok = false;
+  
+  if (!ok) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return false;
+  }
+  
+  // zlib header (deflate, 32k window, default level) and adler32 trailer
+  uLong adler = 1;
+  for (int i = 0; i < n_blocks; ++i)
+    adler = adler32_combine (adler, blocks[i].adler, blocks[i].length);
+  
+  blocks.front().coded.insert (blocks.front().coded.begin(), 2, 0);
+  blocks.front().coded[0] = 0x78;
+  blocks.front().coded[1] = 0x9c;
+  for (int shift = 24; shift >= 0; shift -= 8)
+    blocks.back().coded.push_back ((adler >> shift) & 0xff);
+  
+  for (int i = 0; i < n_blocks; ++i)
+    if (!blocks[i].coded.empty())
+      png_write_chunk (png_ptr, (png_bytep)"IDAT",
+		       &blocks[i].coded[0], blocks[i].coded.size());
+  
+  // png_write_end() does not know about the IDATs written above
+  png_write_chunk (png_ptr, (png_bytep)"IEND", NULL, 0);
+  stream->flush ();
   
   /* clean up after the read, and free any memory allocated - REQUIRED */
   png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -298,4 +643,9 @@ bool PNGCodec::writeImage (std::ostream* stream, Image& image, int quality,
   return true;
 }
 
+bool PNGCodec::supportsIndexed ()
+{
+  return true;
+}
+
 PNGCodec png_loader;
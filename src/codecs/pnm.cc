@@ -23,256 +23,473 @@
  * access via the C FILE* exclusively (???!!!) we had to write our
  * own parser here ...
  *
+ * As PNM is mostly used as interchange format between pipeline stages
+ * the header and the plain text samples are parsed char by char from
+ * the stream buffer, and binary rasters are read and written in blocks,
+ * not thru the formatted iostream operators. PAM (P7) is supported as
+ * well, for alpha channels.
  */
 
+#include <stdio.h> // EOF
 #include <string.h> // memcpy
 
 #include <iostream>
 #include <string>
-#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "pnm.hh"
 #include "Endianess.hh"
 using namespace Exact;
 
-int getNextHeaderNumber (std::istream* stream)
+// 16 bit samples are stored big-endian, swap them in place if we are not
+static void swapSamples (uint8_t* data, size_t bytes)
 {
-  for (bool whitespace = true; whitespace && stream;)
-    {
-      int c = stream->peek();
-      switch (c) {
-      case ' ':
-	stream->get(); // consume silently
-	break;
-      case '\n':
-      case '\r':
-	stream->get(); // consume silently
-	// comment line?
-	while (stream->peek() == '#') {
-	  std::string str;
-	  std::getline(*stream, str); // consume comment line
-	}
-	break;
-      default:
-	whitespace = false;
-      }
-    }
-  
-  int i;
-  *stream >> i;
+  if (NativeEndianTraits::IsBigendian)
+    return;
+
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i*)(data + i));
+    v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+    _mm_storeu_si128 ((__m128i*)(data + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= bytes; i += 16)
+    vst1q_u8 (data + i, vrev16q_u8 (vld1q_u8 (data + i)));
+#endif
+  for (; i + 1 < bytes; i += 2)
+    std::swap (data[i], data[i + 1]);
+}
+
+// is this publically defined somewhere??? PBM stores 1 == black
+static void invertBits (uint8_t* data, size_t bytes)
+{
+  for (size_t i = 0; i < bytes; ++i)
+    data[i] ^= 0xff;
+}
+
+// whitespace and comments, returns the next char without consuming it
+static int skipSpace (std::streambuf* sb)
+{
+  int c = sb->sgetc ();
+  for (;;) {
+    if (c == '#') // till the end of the line
+      do c = sb->snextc (); while (c != '\n' && c != '\r' && c != EOF);
+    else if (c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+	     c == '\v' || c == '\f')
+      c = sb->snextc ();
+    else
+      return c;
+  }
+}
+
+// the next decimal number, -1 if there is none
+static int readNumber (std::streambuf* sb)
+{
+  int c = skipSpace (sb);
+  if (c < '0' || c > '9')
+    return -1;
+
+  int i = 0;
+  for (; c >= '0' && c <= '9'; c = sb->snextc ())
+    i = i * 10 + (c - '0');
   return i;
 }
 
-int PNMCodec::readImage (std::istream* stream, Image& image, const std::string& decompres)
+static std::string readWord (std::streambuf* sb)
+{
+  std::string word;
+  for (int c = skipSpace (sb);
+       c != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r';
+       c = sb->snextc ())
+    word += (char)c;
+  return word;
+}
+
+struct PNMHeader {
+  char mode; // the format number, '1' - '7'
+  int depth; // samples per pixel in the file
+  int maxval;
+};
+
+// parse the header, returns the format number or 0 if not a PNM
+static char readHeader (std::istream* stream, Image& image, PNMHeader& header)
 {
+  std::streambuf* sb = stream->rdbuf ();
+
   // check signature
-  if (stream->peek () != 'P')
-    return false;
-  stream->get(); // consume P
-  
-  image.bps = 0;
-  char mode = stream->peek();
-  switch (mode) {
-  case '1':
-  case '4':
-    image.bps = 1;
-  case '2':
-  case '5':
+  if (sb->sgetc () != 'P')
+    return 0;
+  const char mode = sb->snextc ();
+  if (mode < '1' || mode > '7') {
+    sb->sungetc (); // P
+    return 0;
+  }
+  sb->sbumpc (); // consume format number
+
+  header.mode = mode;
+  header.depth = (mode == '3' || mode == '6') ? 3 : 1;
+  header.maxval = 1;
+
+  int w = -1, h = -1;
+  if (mode == '7')
+    {
+      std::string tupltype;
+      for (std::string key = readWord (sb); key != "ENDHDR"; key = readWord (sb))
+	{
+	  if (key == "WIDTH")
+	    w = readNumber (sb);
+	  else if (key == "HEIGHT")
+	    h = readNumber (sb);
+	  else if (key == "DEPTH")
+	    header.depth = readNumber (sb);
+	  else if (key == "MAXVAL")
+	    header.maxval = readNumber (sb);
+	  else if (key == "TUPLTYPE")
+	    tupltype = readWord (sb);
+	  else
+	    return 0; // also EOF
+	}
+    }
+  else
+    {
+      w = readNumber (sb);
+      h = readNumber (sb);
+      if (mode != '1' && mode != '4')
+	header.maxval = readNumber (sb);
+    }
+
+  // the single whitespace (newline for PAM) before the raster
+  if (mode != '1' && mode != '2' && mode != '3') {
+    int c = sb->sbumpc ();
+    while (mode == '7' && c != '\n' && c != EOF)
+      c = sb->sbumpc ();
+  }
+
+  if (w <= 0 || h <= 0 || header.maxval <= 0 || header.maxval > 65535 ||
+      header.depth < 1 || header.depth > 4)
+    return 0;
+
+  image.w = w;
+  image.h = h;
+
+  // gray in the bit depth covering maxval, color in 8 or 16 bit, and
+  // with alpha RGBA, which is only supported with 8 bit, for now
+  const int bps = header.maxval > 255 ? 16 : 8;
+  switch (header.depth) {
+  case 1:
     image.spp = 1;
+    image.bps = 1;
+    while ((1 << image.bps) - 1 < header.maxval)
+      image.bps *= 2;
     break;
-  case '3':
-  case '6':
+  case 3:
     image.spp = 3;
+    image.bps = bps;
     break;
-  default:
-    stream->unget(); // P
-    return false;
-  }
-  stream->get(); // consume format number
-  
-  image.w = getNextHeaderNumber (stream);
-  image.h = getNextHeaderNumber (stream);
-  
-  int maxval = 1;
-  if (image.bps != 1) {
-    maxval = getNextHeaderNumber (stream);
+  default: // GRAYSCALE_ALPHA, RGB_ALPHA
+    image.spp = 4;
+    image.bps = 8;
   }
-  
-  image.bps = 1;
-  while ((1 << image.bps) < maxval)
-    ++image.bps;
-  
+
   // not stored in the format :-(
   image.setResolution(0, 0);
-  
+
+  return mode;
+}
+
+// convert a row of file samples into the raster
+static void storeRow (const uint16_t* src, int w, int depth, int maxval,
+		      uint8_t* dst, int spp, int bps)
+{
+  const int full = (1 << bps) - 1;
+  const int n = w * depth;
+
+  std::vector<uint16_t> scaled;
+  if (maxval != full) {
+    scaled.resize (n);
+    for (int i = 0; i < n; ++i)
+      scaled[i] = ((int)src[i] * full + maxval / 2) / maxval;
+    src = &scaled[0];
+  }
+
+  if (bps == 16) {
+    memcpy (dst, src, n * 2);
+    return;
+  }
+
+  if (bps < 8) {
+    memset (dst, 0, (w * bps + 7) / 8);
+    for (int x = 0; x < w; ++x) {
+      const int bit = x * bps;
+      dst[bit / 8] |= src[x] << (8 - bps - bit % 8);
+    }
+    return;
+  }
+
+  if (spp == 4 && depth == 2) { // GRAYSCALE_ALPHA
+    for (int x = 0; x < w; ++x, src += 2, dst += 4) {
+      dst[0] = dst[1] = dst[2] = src[0];
+      dst[3] = src[1];
+    }
+    return;
+  }
+
+  for (int i = 0; i < n; ++i)
+    dst[i] = src[i];
+}
+
+int PNMCodec::readImage (std::istream* stream, Image& image, const std::string& decompres)
+{
+  PNMHeader header;
+  const char mode = readHeader (stream, image, header);
+  if (!mode)
+    return false;
+
   // allocate data, if necessary
   image.resize (image.w, image.h);
-  
-  // consume the left over spaces and newline 'till the data begins
-  {
-    std::string str;
-    std::getline (*stream, str);
-  }
-  
+
+  const int stride = image.stride ();
+  uint8_t* data = image.getRawData ();
+  std::vector<uint16_t> samples (image.w * header.depth);
+
   if (mode <= '3') // ascii / plain text
     {
-      Image::iterator it = image.begin ();
+      std::streambuf* sb = stream->rdbuf ();
       for (int y = 0; y < image.h; ++y)
 	{
-	  for (int x = 0; x < image.w; ++x)
+	  for (size_t i = 0; i < samples.size(); ++i)
 	    {
-	      if (image.spp == 1) {
-		int i;
-		*stream >> i;
-		
-		i = i * (255 / maxval);
-
+	      int v;
+	      if (mode == '1') { // single digits, not necessarily separated
+		v = skipSpace (sb) - '0';
+		if (v == 0 || v == 1)
+		  sb->sbumpc ();
 		// only mode 1 is defined with 1 == black, ...
-		if (mode == '1') i = 255 - i;
-
-		it.setL (i);
-	      }
-	      else {
-		uint16_t r, g, b;
-		*stream >> r >> g >> b;
-		
-		it.setRGB (r, g, b);
+		v = 1 - v;
 	      }
-	      
-	      it.set (it);
-	      ++it;
+	      else
+		v = readNumber (sb);
+
+	      if (v < 0 || v > header.maxval)
+		return false;
+	      samples[i] = v;
 	    }
+	  storeRow (&samples[0], image.w, header.depth, header.maxval,
+		    data + y * stride, image.spp, image.bps);
 	}
+      return true;
     }
-  else // binary data
+
+  // binary data, directly into the raster if it is stored just the same
+  if (mode == '4' || (header.depth == image.spp &&
+		      header.maxval == (1 << image.bps) - 1 &&
+		      image.bps >= 8))
     {
-      const int stride = image.stride ();
-      const int bps = image.bps;
-      
-      for (int y = 0; y < image.h; ++y)
-	{
-	  uint8_t* dest = image.getRawData() + y * stride;
-	  stream->read ((char*)dest, stride);
-
-	  // is it publically defined somewhere???
-	  if (bps == 1) {
-	    uint8_t* xor_ptr = dest;
-	    for (int x = 0; x < image.w; x += 8)
-	      *xor_ptr++ ^= 0xff;
-	  }
-	  
-	  if (bps == 16) {
-	    uint16_t* swap_ptr = (uint16_t*)dest;
-	    for (int x = 0; x < stride/2; ++x, ++swap_ptr)
-	      *swap_ptr = ByteSwap<NativeEndianTraits,BigEndianTraits, uint16_t>::Swap (*swap_ptr);
-	  }
-	}
+      stream->read ((char*)data, stride * image.h);
+      if (!*stream)
+	return false;
+
+      if (mode == '4')
+	invertBits (data, stride * image.h);
+      else if (image.bps == 16)
+	swapSamples (data, stride * image.h);
+      return true;
     }
-  
+
+  // otherwise converted row by row
+  const int bytes = header.maxval > 255 ? 2 : 1;
+  std::vector<uint8_t> row (samples.size() * bytes);
+  for (int y = 0; y < image.h; ++y)
+    {
+      if (!stream->read ((char*)&row[0], row.size()))
+	return false;
+
+      for (size_t i = 0; i < samples.size(); ++i) {
+	samples[i] = bytes == 2 ? row[2 * i] << 8 | row[2 * i + 1] : row[i];
+	if (samples[i] > header.maxval)
+	  samples[i] = header.maxval;
+      }
+
+      storeRow (&samples[0], image.w, header.depth, header.maxval,
+		data + y * stride, image.spp, image.bps);
+    }
+
   return true;
 }
 
+int PNMCodec::probeImage (std::istream* stream, Image& image, int index,
+			  int& orientation)
+{
+  PNMHeader header;
+  return index == 0 && readHeader (stream, image, header);
+}
+
+// plain text numbers, lines should not be longer than 70 chars
+static void writeNumber (std::vector<char>& out, int& column, int i)
+{
+  char digits [8];
+  int n = 0;
+  do {
+    digits[n++] = '0' + i % 10;
+    i /= 10;
+  } while (i);
+
+  if (column) {
+    if (column + 1 + n > 70) {
+      out.push_back ('\n');
+      column = 0;
+    }
+    else {
+      out.push_back (' ');
+      ++column;
+    }
+  }
+
+  column += n;
+  while (n)
+    out.push_back (digits[--n]);
+}
+
 bool PNMCodec::writeImage (std::ostream* stream, Image& image, int quality,
 			   const std::string& compress)
 {
   // ok writing should be easy ,-) just dump the header
   // and the data thereafter ,-)
-  
+
   int format = 0;
-  
+
   if (image.spp == 1 && image.bps == 1)
     format = 1;
   else if (image.spp == 1)
     format = 2;
   else if (image.spp == 3)
     format = 3;
+  else if (image.spp == 4 && image.bps == 8)
+    format = 7;
   else {
     std::cerr << "Not (yet?) supported PBM format." << std::endl;
     return false;
   }
-  
+
   std::string c (compress);
   std::transform (c.begin(), c.end(), c.begin(), tolower);
   if (c == "plain")
     c = "ascii";
 
-  
-  if (c != "ascii")
+  // PAM has no plain text variant
+  if (pam || c == "pam")
+    format = 7;
+  const bool ascii = c == "ascii" && format != 7;
+  if (!ascii && format != 7)
     format += 3;
-  
-  *stream << "P" << format << std::endl;
-  *stream << "# http://exactcode.com/oss/exactimage/" << std::endl;
 
-  *stream << image.w << " " << image.h << std::endl;
-  
   // maxval
-  int maxval = (1 << image.bps) - 1;
-  
-  if (image.bps > 1)
-    *stream << maxval << std::endl;
-  
-  Image::iterator it = image.begin ();
-  if (c == "ascii")
+  const int maxval = (1 << image.bps) - 1;
+
+  char header [256];
+  if (format == 7) {
+    static const char* tupltypes[] = {
+      "", "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"
+    };
+    snprintf (header, sizeof (header),
+	      "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+	      image.w, image.h, image.spp, maxval,
+	      image.bps == 1 ? "BLACKANDWHITE" : tupltypes[image.spp]);
+  }
+  else if (image.bps == 1)
+    snprintf (header, sizeof (header),
+	      "P%d\n# http://exactcode.com/oss/exactimage/\n%d %d\n",
+	      format, image.w, image.h);
+  else
+    snprintf (header, sizeof (header),
+	      "P%d\n# http://exactcode.com/oss/exactimage/\n%d %d\n%d\n",
+	      format, image.w, image.h, maxval);
+  stream->write (header, strlen (header));
+
+  const uint8_t* data = image.getConstAlignedRawData ();
+  const int stride = image.stride (); // padded for sub-image views
+  const int row_bytes = (image.w * image.spp * image.bps + 7) / 8;
+  const int bps = image.bps;
+
+  if (ascii)
     {
+      std::vector<char> out;
       for (int y = 0; y < image.h; ++y)
 	{
-	  for (int x = 0; x < image.w; ++x)
+	  const uint8_t* src = data + y * stride;
+	  const uint16_t* src16 = (const uint16_t*) src;
+	  int column = 0;
+	  out.clear ();
+	  for (int i = 0; i < image.w * image.spp; ++i)
 	    {
-	      *it;
-	      
-	      if (x != 0)
-		*stream << " ";
-	      
-	      if (image.spp == 1) {
-		int i = it.getL();
+	      int v;
+	      if (bps == 16)
+		v = src16[i];
+	      else if (bps == 8)
+		v = src[i];
+	      else
+		v = (src[i * bps / 8] >> (8 - bps - i * bps % 8)) & maxval;
 
-		// only mode 1 is defined with 1 == black, ...
-                if (format == 1) i = 255 - i;
-
-		*stream << i / (255 / maxval);
-	      }
-	      else {
-		uint16_t r = 0, g = 0, b = 0;
-		it.getRGB (&r, &g, &b);
-		*stream << (int)r << " " << (int)g << " " << (int)b;
-	      }
-	      ++it;
+	      // only mode 1 is defined with 1 == black, ...
+	      if (format == 1)
+		v = 1 - v;
+	      writeNumber (out, column, v);
 	    }
-	  *stream << std::endl;
+	  out.push_back ('\n');
+	  stream->write (&out[0], out.size());
 	}
     }
+  else if (stride == row_bytes && (bps == 8 ||
+				   (bps == 16 && NativeEndianTraits::IsBigendian)))
+    {
+      // stored just the same, in one go
+      stream->write ((const char*)data, stride * image.h);
+    }
   else
     {
-      const int stride = image.stride ();
-      const int bps = image.bps;
-      
-      uint8_t* ptr = (uint8_t*) malloc (stride);
-      
-      for (int y = 0; y < image.h; ++y)
+      // in blocks of rows, converted as needed: inverted (PBM), swapped
+      // (16 bit) or one sample per byte (sub-byte gray, PAM bilevel)
+      const bool unpack = bps < 8 && format != 4;
+      const int out_bytes = unpack ? image.w : row_bytes;
+      const int rows = std::max (1, (1 << 20) / std::max (out_bytes, 1));
+      std::vector<uint8_t> buffer (out_bytes * rows);
+
+      for (int y = 0; y < image.h; y += rows)
 	{
-	  memcpy (ptr, image.getRawData() + y * stride, stride);
-	  
-	  // is this publically defined somewhere???
-	  if (bps == 1) {
-	    uint8_t* xor_ptr = ptr;
-	    for (int x = 0; x < image.w; x += 8)
-	      *xor_ptr++ ^= 0xff;
-	  }
-	  
-	  if (bps == 16) {
-	    uint16_t* swap_ptr = (uint16_t*)ptr;
-	    for (int x = 0; x < stride/2; ++x, ++swap_ptr)
-	      *swap_ptr = ByteSwap<BigEndianTraits, NativeEndianTraits, uint16_t>::Swap (*swap_ptr);
-	  }
-	  
-	  stream->write ((char*)ptr, stride);
+	  const int n = std::min (rows, image.h - y);
+	  for (int r = 0; r < n; ++r)
+	    {
+	      const uint8_t* src = data + (y + r) * stride;
+	      uint8_t* dst = &buffer[r * out_bytes];
+	      if (!unpack)
+		memcpy (dst, src, row_bytes);
+	      else
+		for (int x = 0; x < image.w; ++x)
+		  dst[x] = (src[x * bps / 8] >> (8 - bps - x * bps % 8)) & maxval;
+	    }
+
+	  if (format == 4)
+	    invertBits (&buffer[0], n * out_bytes);
+	  else if (bps == 16)
+	    swapSamples (&buffer[0], n * out_bytes);
+
+	  stream->write ((const char*)&buffer[0], n * out_bytes);
 	}
-      free (ptr);
     }
-  
+
   stream->flush ();
-  
-  return true;
+
+  return stream->good ();
 }
 
 PNMCodec pnm_loader;
+PNMCodec pam_loader (true);
@@ -20,7 +20,12 @@
 class PNMCodec : public ImageCodec {
 public:
   
-  PNMCodec () {
+  PNMCodec (bool _pam = false) : pam (_pam) {
+    // PAM writer instance, reading is handled by the PNM one
+    if (pam) {
+      registerCodec ("pam", this, true);
+      return;
+    }
     registerCodec ("pnm", this);
     registerCodec ("ppm", this);
     registerCodec ("pgm", this);
@@ -30,6 +35,10 @@ public:
   virtual std::string getID () { return "PNM"; };
   
   virtual int readImage (std::istream* stream, Image& image, const std::string& decompres);
+  virtual int probeImage (std::istream* stream, Image& image, int index, int& orientation);
   virtual bool writeImage (std::ostream* stream, Image& image,
 			   int quality, const std::string& compress);
+
+private:
+  bool pam; // always write PAM (P7)
 };
@@ -107,8 +107,8 @@ void PSCodec::encodeImage (std::ostream* stream, Image& image, double scale,
 		">> image"
 		<< std::endl;
 
-	const int bytes = image.stride() * h;
 	uint8_t* data = image.getRawData();
+	const int bytes = image.stride() * h;
 	if (encoding == "ASCII85Decode")
 		EncodeASCII85(*stream, data, bytes);
 	else if (encoding == "ASCIIHexDecode")
@@ -19,6 +19,14 @@
  * Copyright (C) 2002-2005 Maxim Shemanarev (http://www.antigrain.com)
  */
 
+#include <stdlib.h>
+
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "agg_basics.h"
 #include "agg_rendering_buffer.h"
 #include "agg_rasterizer_scanline_aa.h"
@@ -31,6 +39,25 @@
 
 #include "agg.hh" // EI Agg
 
+// the value of a "scale=<factor>" decompress option, 1 if not given
+static double renderScale (const std::string& decompress)
+{
+  std::string::size_type start = 0;
+  while (start < decompress.size()) {
+    std::string::size_type end = decompress.find (',', start);
+    if (end == std::string::npos)
+      end = decompress.size();
+    
+    if (decompress.compare (start, 6, "scale=") == 0) {
+      const double scale = atof (decompress.substr (start + 6, end - start - 6).c_str());
+      if (scale > 0)
+	return scale;
+    }
+    start = end + 1;
+  }
+  return 1;
+}
+
 int SVGCodec::readImage (std::istream* stream, Image& image, const std::string& decompres)
 {
   agg::svg::path_renderer m_path;
@@ -70,31 +97,68 @@ int SVGCodec::readImage (std::istream* stream, Image& image, const std::string&
   else if (min_y == max_y)
     max_y += 1;
 
-  image.bps = 8; image.spp = 3;
-  image.resize ((int)(max_x - min_x), (int)(max_y - min_y));
+  // e.g. for thumbnails, rasterize directly at the target size
+  const double scale = renderScale (decompres);
   
-  renderer_exact_image rb (image);
-  typedef agg::renderer_scanline_aa_solid<renderer_base> renderer_solid;
-  renderer_solid ren (rb);
-  
-  rb.clear (agg::rgba(1,1,1));
+  image.bps = 8; image.spp = 3;
+  image.resize (std::max ((int)((max_x - min_x) * scale), 1),
+		std::max ((int)((max_y - min_y) * scale), 1));
+  // once, the bands only write into their rows of the buffer
+  uint8_t* data = image.getRawData ();
+  const int stride = image.stride ();
   
-  agg::rasterizer_scanline_aa<> ras;
-  agg::scanline_p8 sl;
   agg::trans_affine mtx;
-  
-  ras.gamma(agg::gamma_power(gamma));
-  mtx *= agg::trans_affine_translation ((min_x + max_x) * -0.5,
-					(min_y + max_y) * -0.5);
-  //mtx *= agg::trans_affine_scaling (scale);
-  mtx *= agg::trans_affine_translation ((min_x + max_x) * 0.5,
-					(min_y + max_y) * 0.5);
-  
+  mtx *= agg::trans_affine_scaling (scale);
   m_path.expand(expand);
-  m_path.render(ras, sl, ren, mtx, rb.clip_box(), 1.0);
   
-  //std::cerr << "Vertices=" << m_path.vertex_count() << " Time=" << tm << " ms" std::endl;
+  /* Render horizontal bands in parallel, each with its own rasterizer
+     and renderer on an image of just the band's rows, sharing the
+     parsed paths. Each band processes all paths, so there are only
+     about as many as threads. */
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads ();
+#endif
+  const int band_rows = std::max ((image.h + 2 * threads - 1) / (2 * threads), 64);
+  const int bands = (image.h + band_rows - 1) / band_rows;
+  
+  #pragma omp parallel for schedule (dynamic, 1)
+  for (int i = 0; i < bands; ++i)
+    {
+      const int y1 = i * band_rows;
+      const int rows = std::min (band_rows, image.h - y1);
+      
+      // not shared with the other threads, just wraps the rows
+      Image band;
+      band.copyMeta (image);
+      band.h = rows;
+      band.setRawDataWithoutDelete (data + y1 * stride);
+      
+      renderer_exact_image rb (band);
+      typedef agg::renderer_scanline_aa_solid<renderer_base> renderer_solid;
+      renderer_solid ren (rb);
+      
+      const agg::rgba8 white (agg::rgba (1,1,1));
+      for (int y = 0; y < rows; ++y)
+	rb.copy_hline (0, y, image.w - 1, white);
+      
+      agg::rasterizer_scanline_aa<> ras;
+      agg::scanline_p8 sl;
+      ras.gamma(agg::gamma_power(gamma));
+      
+      agg::trans_affine band_mtx (mtx);
+      band_mtx *= agg::trans_affine_translation (0, -y1);
+      
+      // the rasterizer clips at the band's bottom edge, the last band
+      // like before at the last row
+      const agg::rect_i cb (0, 0, image.w - 1,
+			    i == bands - 1 ? rows - 1 : rows);
+      m_path.render(ras, sl, ren, band_mtx, cb, 1.0);
+      
+      band.setRawDataWithoutDelete (0); // not ours to free
+    }
   
+  image.setRawData(); // invalidate cache
   return true;
 }
 
@@ -207,7 +207,8 @@ bool TGACodec::writeImage(std::ostream* stream, Image& image, int quality,
   
   stream->write((char*)&header, sizeof(header));
   
-  stream->write((char*)image.getRawData(), image.stride() * image.height());
+  const uint8_t* data = image.getRawData();
+  stream->write((const char*)data, image.stride() * image.height());
   
   TGAFooter footer;
   footer.ExtensionOffset = 0;
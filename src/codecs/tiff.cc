@@ -23,9 +23,13 @@
 #include "tiff.hh"
 
 #include "Colorspace.hh"
+#include "memstream.hh"
+
+#include <zlib.h>
 
 #include <algorithm>
 #include <iostream>
+#include <vector>
 
 /* Well, sadly our own c++ glue, the libtiff native one does not provide
    readble out streams it requires for multi-page files, ... */
@@ -261,6 +265,19 @@ extern "C" {
   {
   }
 
+  // in memory streams are "mapped", libtiff then reads the data in place
+  static int _tiffisMapProc(thandle_t fd, tdata_t* base, toff_t* size)
+  {
+    tiffis_data	*data = (tiffis_data*)fd;
+    Utility::membuf* memory = Utility::membuf::of (data->IS);
+    if (!memory || (size_t)data->streamStartPos > memory->size())
+      return 0;
+    
+    *base = (tdata_t)(memory->data() + data->streamStartPos);
+    *size = memory->size() - data->streamStartPos;
+    return 1;
+  }
+
 } // end. extern "C"
 
 static TIFF* _tiffStreamOpen(const char* name, const char* mode, void* fd)
@@ -291,7 +308,7 @@ static TIFF* _tiffStreamOpen(const char* name, const char* mode, void* fd)
 			 _tiffisReadProc, _tiffisWriteProc,
 			 _tiffisSeekProc, _tiffisCloseProc,
 			 _tiffisSizeProc,
-			 _tiffDummyMapProc, _tiffDummyUnmapProc);
+			 _tiffisMapProc, _tiffDummyUnmapProc);
   }
   
   if (trace)
@@ -322,7 +339,9 @@ static TIFF* TIFFStreamOpen(const char* name, std::ostream* os)
 
 static TIFF* TIFFStreamOpen(const char* name, std::istream* is)
 {
-  // NB: We don't support mapped files with streams so add 'm'
+  // NB: We only support mapping in memory streams, otherwise add 'm'
+  if (Utility::membuf::of (is))
+    return _tiffStreamOpen(name, "r", is);
   return _tiffStreamOpen(name, "rm", is); // m for no mmap
 }
 
@@ -342,24 +361,184 @@ TIFCodec::~TIFCodec()
     TIFFClose(tiffCtx);
 }
 
+// RGB to gray with the weights of colorspace_rgb8_to_gray8, 16 bit samples
+// are in native byte order, so just the high byte is kept
+static void reduce_scanline (const uint8_t* src, uint8_t* dst, int w,
+			     int spp, int bps, int dst_spp)
+{
+  const int n = w * spp;
+  if (spp == dst_spp) {
+    const uint16_t* src16 = (const uint16_t*) src;
+    for (int i = 0; i < n; ++i)
+      dst[i] = src16[i] >> 8;
+    return;
+  }
+  
+  for (int i = 0; i < n; i += 3) {
+    int r, g, b;
+    if (bps == 16) {
+      const uint16_t* src16 = (const uint16_t*) src + i;
+      r = src16[0] >> 8; g = src16[1] >> 8; b = src16[2] >> 8;
+    } else {
+      r = src[i]; g = src[i + 1]; b = src[i + 2];
+    }
+    *dst++ = (uint8_t)((r * 28 + g * 59 + b * 11) / 100);
+  }
+}
+
 int TIFCodec::readImage (std::istream* stream, Image& image, const std::string& decompres, int index)
 {
-  TIFF* in;
+  return readImageImpl (stream, image, decompres, index, 0);
+}
 
-  // quick magic check
-  {
-    char a, b;
-    a = stream->get ();
-    b = stream->peek ();
-    stream->putback (a);
-    
-    int magic = (a << 8) | b;
-    
-    if (magic != TIFF_BIGENDIAN && magic != TIFF_LITTLEENDIAN)
+int TIFCodec::probeImage (std::istream* stream, Image& image, int index, int& orientation)
+{
+  return readImageImpl (stream, image, "", index, &orientation);
+}
+
+/* Deflate strips are independent zlib streams: the raw strips are read
+   in file order, and then inflated in parallel directly into the image. */
+static bool deflateStrips (TIFF* in, const Image& image)
+{
+  uint16 compression = 0, predictor = PREDICTOR_NONE;
+  TIFFGetField (in, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetFieldDefaulted (in, TIFFTAG_PREDICTOR, &predictor);
+  
+  return (compression == COMPRESSION_DEFLATE ||
+	  compression == COMPRESSION_ADOBE_DEFLATE) && !TIFFIsTiled (in) &&
+    (predictor == PREDICTOR_NONE ||
+     (predictor == PREDICTOR_HORIZONTAL && image.bps >= 8)) &&
+    TIFFScanlineSize (in) == image.stride();
+}
+
+static bool readDeflateStrips (TIFF* in, Image& image)
+{
+  uint16 predictor = PREDICTOR_NONE;
+  TIFFGetFieldDefaulted (in, TIFFTAG_PREDICTOR, &predictor);
+  uint32 rowsperstrip = image.h;
+  TIFFGetFieldDefaulted (in, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+  rowsperstrip = std::min (rowsperstrip, (uint32)image.h);
+  
+  const int strips = TIFFNumberOfStrips (in);
+  std::vector<std::vector<uint8_t> > raw (strips);
+  for (int s = 0; s < strips; ++s) {
+    tsize_t size = TIFFRawStripSize (in, s);
+    if (size <= 0)
+      continue;
+    raw[s].resize (size);
+    if (TIFFReadRawStrip (in, s, &raw[s][0], size) < 0)
       return false;
   }
   
-  in = TIFFStreamOpen ("", stream);
+  const int stride = image.stride();
+  const int spp = image.spp;
+  const bool swap = image.bps == 16 && TIFFIsByteSwapped (in);
+  uint8_t* data = image.getRawData();
+  bool ok = true;
+  
+  #pragma omp parallel for schedule (dynamic, 1)
+  for (int s = 0; s < strips; ++s)
+    {
+      const int y = s * rowsperstrip;
+      const int rows = std::min ((int)rowsperstrip, image.h - y);
+      if (rows <= 0 || raw[s].empty())
+	continue;
+      
+      uint8_t* dst = data + y * stride;
+      uLongf len = rows * stride;
+      int err = uncompress (dst, &len, &raw[s][0], raw[s].size());
+      // the last strip may be coded padded to the full strip size
+      if (err != Z_OK && !(err == Z_BUF_ERROR && len == (uLongf)rows * stride)) {
+	ok = false;
+	continue;
+      }
+      
+      if (swap)
+	TIFFSwabArrayOfShort ((uint16*)dst, len / 2);
+      
+      if (predictor == PREDICTOR_HORIZONTAL)
+	for (int row = 0; row < rows; ++row, dst += stride) {
+	  if (image.bps == 16) {
+	    uint16_t* p = (uint16_t*)dst;
+	    for (int i = spp; i < stride / 2; ++i)
+	      p[i] += p[i - spp];
+	  }
+	  else
+	    for (int i = spp; i < stride; ++i)
+	      dst[i] += dst[i - spp];
+	}
+    }
+  
+  return ok;
+}
+
+// compress the strips in parallel, libtiff then just writes them
+static bool writeDeflateStrips (TIFF* out, const Image& image, uint32 rowsperstrip)
+{
+  const uint8_t* data = image.getConstAlignedRawData();
+  const int stride = image.stride(); // after the alignment
+  const int row_bytes = (image.w * image.spp * image.bps + 7) / 8;
+  const int strips = (image.h + rowsperstrip - 1) / rowsperstrip;
+  const bool invert = image.bps == 1 && !image.isIndexed();
+  std::vector<std::vector<uint8_t> > coded (strips);
+  bool ok = true;
+  
+  #pragma omp parallel for schedule (dynamic, 1)
+  for (int s = 0; s < strips; ++s)
+    {
+      const int y = s * rowsperstrip;
+      const int rows = std::min ((int)rowsperstrip, image.h - y);
+      
+      // we on-the-fly invert 1-bit data, and drop the sub-image padding
+      const uint8_t* src = data + y * stride;
+      std::vector<uint8_t> plain;
+      if (invert || stride != row_bytes) {
+	plain.resize (rows * row_bytes);
+	for (int row = 0; row < rows; ++row) {
+	  uint8_t* dst = &plain[row * row_bytes];
+	  memcpy (dst, data + (y + row) * stride, row_bytes);
+	  if (invert)
+	    for (int i = 0; i < row_bytes; ++i)
+	      dst[i] ^= 0xFF;
+	}
+	src = &plain[0];
+      }
+      
+      uLongf len = compressBound (rows * row_bytes);
+      coded[s].resize (len);
+      if (compress2 (&coded[s][0], &len, src, rows * row_bytes,
+		     Z_DEFAULT_COMPRESSION) != Z_OK)
+	ok = false;
+      coded[s].resize (len);
+    }
+  
+  for (int s = 0; ok && s < strips; ++s)
+    if (TIFFWriteRawStrip (out, s, &coded[s][0], coded[s].size()) < 0)
+      ok = false;
+  
+  return ok;
+}
+
+// quick magic check
+static bool isTIFF (std::istream* stream)
+{
+  char a, b;
+  a = stream->get ();
+  b = stream->peek ();
+  stream->putback (a);
+  
+  int magic = (a << 8) | b;
+  
+  return magic == TIFF_BIGENDIAN || magic == TIFF_LITTLEENDIAN;
+}
+
+int TIFCodec::readImageImpl (std::istream* stream, Image& image, const std::string& decompres,
+			     int index, int* orientation)
+{
+  if (!isTIFF (stream))
+    return false;
+  
+  TIFF* in = TIFFStreamOpen ("", stream);
   if (!in)
     return false;
 
@@ -370,6 +549,16 @@ int TIFCodec::readImage (std::istream* stream, Image& image, const std::string&
       return false;
     }
   
+  bool ret = readDirectory (in, image, decompres, orientation);
+  TIFFClose (in);
+  return ret ? n_images : 0;
+}
+
+// decodes the current directory, with orientation just the directory
+// is read, the image data is not
+bool TIFCodec::readDirectory (TIFF* in, Image& image, const std::string& decompres,
+			      int* orientation)
+{
   uint16 photometric = 0;
   TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric);
   // std::cerr << "photometric: " << (int)photometric << std::endl;
@@ -382,7 +571,6 @@ int TIFCodec::readImage (std::istream* stream, Image& image, const std::string&
       break;
     default:
       std::cerr << "TIFCodec: Unrecognized photometric: " << (int)photometric << std::endl;
-      TIFFClose(in);
       return false;
     }
   
@@ -398,11 +586,8 @@ int TIFCodec::readImage (std::istream* stream, Image& image, const std::string&
   uint16 _bps = 0;
   TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &_bps);
   
-  if (!_w || !_h || !_spp || !_bps) {
-    TIFFClose(in);
-    stream->seekg(0);
+  if (!_w || !_h || !_spp || !_bps)
     return false;
-  }
   
   //uint16 config;
   //TIFFGetField(in, TIFFTAG_PLANARCONFIG, &config);
@@ -419,7 +604,42 @@ int TIFCodec::readImage (std::istream* stream, Image& image, const std::string&
     _yres = 0;
   image.setResolution(_xres, _yres);
   
+  if (orientation) {
+    uint16 _orientation = 0;
+    if (TIFFGetField(in, TIFFTAG_ORIENTATION, &_orientation))
+      *orientation = _orientation;
+    
+    // the post load fixups below, without data
+    if (image.spp == 2) {
+      image.spp = 1;
+      image.bps *= 2;
+    }
+    if (photometric == PHOTOMETRIC_PALETTE) {
+      uint16 *rmap = 0, *gmap = 0, *bmap = 0;
+      if (TIFFGetField (in, TIFFTAG_COLORMAP, &rmap, &gmap, &bmap))
+	colorspace_de_palette_spec (image.spp, image.bps, 1 << image.bps,
+				    rmap, gmap, bmap);
+    }
+    
+    return true;
+  }
+  
   int stride = image.stride();
+  
+  /* Reduce RGB to gray and 16 to 8 bit per scanline, if that is all the
+   * caller wants, so that the full depth image is never allocated. */
+  int target_spp, target_bps;
+  uint8_t* scanline = 0;
+  if ((photometric == PHOTOMETRIC_RGB || photometric == PHOTOMETRIC_MINISBLACK) &&
+      decodeTarget (decompres, target_spp, target_bps) && target_bps <= 8 &&
+      (image.spp == 1 || image.spp == 3) && (image.bps == 8 || image.bps == 16) &&
+      (target_spp < image.spp || image.bps == 16))
+    {
+      scanline = (uint8_t*) malloc (stride);
+      image.bps = 8;
+      if (target_spp == 1)
+	image.spp = 1;
+    }
   image.resize (image.w, image.h);
   
   uint16 *rmap = 0, *gmap = 0, *bmap = 0;
@@ -430,17 +650,34 @@ int TIFCodec::readImage (std::istream* stream, Image& image, const std::string&
     }
 
   uint8_t* data2 = image.getRawData();
+  if (!scanline && deflateStrips (in, image))
+    {
+      if (!readDeflateStrips (in, image))
+	std::cerr << "TIFCodec: Error decoding strips." << std::endl;
+      
+      if (photometric == PHOTOMETRIC_MINISWHITE && image.bps == 1)
+	for (uint8_t* it = data2; it < image.getRawDataEnd(); ++it)
+	  *it ^= 0xFF;
+    }
+  else
   for (int row = 0; row < image.h; row++)
     {
-      if (TIFFReadScanline(in, data2, row, 0) < 0)
+      if (TIFFReadScanline(in, scanline ? scanline : data2, row, 0) < 0)
 	break;
       
+      if (scanline) {
+	reduce_scanline (scanline, data2, image.w, _spp, _bps, image.spp);
+	data2 += image.stride();
+	continue;
+      }
+      
       if (photometric == PHOTOMETRIC_MINISWHITE && image.bps == 1)
 	for (int i = 0; i < stride; ++i)
 	  data2[i] = data2[i] ^ 0xFF;
       
       data2 += stride;
     }
+  free (scanline);
   
   /* some post load fixup */
   
@@ -462,13 +699,61 @@ int TIFCodec::readImage (std::istream* stream, Image& image, const std::string&
       image.bps *= 2;
     }
   
-  if (photometric == PHOTOMETRIC_PALETTE) {
-    colorspace_de_palette (image, 1 << image.bps, rmap, gmap, bmap);
+  if (photometric == PHOTOMETRIC_PALETTE && rmap && image.bps <= 8) {
+    // kept indexed, Read() expands it unless asked not to
+    image.setPalette (1 << image.bps, rmap, gmap, bmap);
     /* free'd by TIFFClose; free(rmap); free(gmap); free(bmap); */
   }
   
-  TIFFClose (in);
-  return n_images;
+  return true;
+}
+
+// for multi-page reading
+ImageCodec* TIFCodec::instanciateForRead (std::istream* stream)
+{
+  if (!isTIFF (stream))
+    return 0;
+  
+  TIFF* in = TIFFStreamOpen ("", stream);
+  if (in == NULL)
+    return 0;
+  
+  // walk the IFD chain once, afterwards each page is a single seek away
+  TIFCodec* reader = new TIFCodec(in);
+  do
+    reader->pageOffsets.push_back (TIFFCurrentDirOffset (in));
+  while (TIFFReadDirectory (in));
+  
+  return reader;
+}
+
+int TIFCodec::pageCount ()
+{
+  return pageOffsets.size();
+}
+
+bool TIFCodec::setPage (int index)
+{
+  if (!tiffCtx || index < 0 || index >= (int)pageOffsets.size())
+    return false;
+  
+  if (TIFFCurrentDirOffset (tiffCtx) == pageOffsets[index])
+    return true;
+  return TIFFSetSubDirectory (tiffCtx, pageOffsets[index]);
+}
+
+int TIFCodec::readPage (Image& image, const std::string& decompress, int index)
+{
+  if (!setPage (index) || !readDirectory (tiffCtx, image, decompress, 0))
+    return 0;
+  return pageOffsets.size();
+}
+
+int TIFCodec::probePage (Image& image, int index, int& orientation)
+{
+  if (!setPage (index) || !readDirectory (tiffCtx, image, "", &orientation))
+    return 0;
+  return pageOffsets.size();
 }
 
 // for multi-page writing
@@ -505,8 +790,10 @@ bool TIFCodec::writeImageImpl (TIFF* out, const Image& image, const std::string&
 {
   uint32 rowsperstrip = (uint32)-1;
   
-  uint16 compression = image.bps == 1 ? COMPRESSION_CCITTFAX4 :
-                                        COMPRESSION_DEFLATE;
+  // fax compression is for bilevel data only, not palette images
+  const bool bilevel = image.bps == 1 && !image.isIndexed();
+  uint16 compression = bilevel ? COMPRESSION_CCITTFAX4 :
+                                 COMPRESSION_DEFLATE;
 
   if (!compress.empty())
   {
@@ -542,20 +829,23 @@ bool TIFCodec::writeImageImpl (TIFF* out, const Image& image, const std::string&
   TIFFSetField (out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 
   TIFFSetField (out, TIFFTAG_COMPRESSION, compression);
-  if (image.spp == 1 && image.bps == 1)
+  if (image.isIndexed()) {
+    // the ColorMap has exactly 2^bps entries
+    const int entries = 1 << image.bps;
+    std::vector<uint16> map (3 * entries, 0);
+    const int n = std::min (entries, image.paletteSize());
+    std::copy (image.paletteRed(), image.paletteRed() + n, map.begin());
+    std::copy (image.paletteGreen(), image.paletteGreen() + n, map.begin() + entries);
+    std::copy (image.paletteBlue(), image.paletteBlue() + n, map.begin() + 2 * entries);
+    TIFFSetField (out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_PALETTE);
+    TIFFSetField (out, TIFFTAG_COLORMAP, &map[0], &map[entries], &map[2 * entries]);
+  }
+  else if (image.spp == 1 && image.bps == 1)
     // internally we actually have MINISBLACK, but some programs,
     // including the Apple Preview.app appear to ignore this bit
     TIFFSetField (out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
   else if (image.spp == 1)
     TIFFSetField (out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-  else if (false) { /* just saved for reference */
-    uint16 rmap[256], gmap[256], bmap[256];
-    for (int i = 0;i < 256; ++i) {
-      rmap[i] = gmap[i] = bmap[i] = i * 0xffff / 255;
-    }
-    TIFFSetField (out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_PALETTE);
-    TIFFSetField (out, TIFFTAG_COLORMAP, rmap, gmap, bmap);
-  }
   else
     TIFFSetField (out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
   
@@ -573,21 +863,33 @@ bool TIFCodec::writeImageImpl (TIFF* out, const Image& image, const std::string&
     TIFFSetField (out, TIFFTAG_SOFTWARE, "ExactImage");
   }
   //TIFFSetField (out, TIFFTAG_IMAGEDESCRIPTION, "");
+  
+  const int row_bytes = (image.w * image.spp * image.bps + 7) / 8;
+  
+  // deflate is compressed in parallel, in strips of about 1 MiB each
+  if (compression == COMPRESSION_DEFLATE) {
+    rowsperstrip = std::max (1, (1 << 20) / std::max (row_bytes, 1));
+    TIFFSetField (out, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
+    if (!writeDeflateStrips (out, image, rowsperstrip))
+      return false;
+    return TIFFWriteDirectory(out);
+  }
+  
   rowsperstrip = TIFFDefaultStripSize (out, rowsperstrip); 
   TIFFSetField (out, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
   
-  const int stride = image.stride();
   /* Note: we on-the-fly invert 1-bit data to please some historic apps */
   
-  uint8_t* src = image.getRawData();
+  uint8_t* src = (uint8_t*) image.getConstAlignedRawData();
+  const int stride = image.stride(); // padded for sub-image views
   uint8_t* scanline = 0;
-  if (image.bps == 1)
-    scanline = (uint8_t*) malloc (stride);
+  if (bilevel)
+    scanline = (uint8_t*) malloc (row_bytes);
   
   for (int row = 0; row < image.h; ++row, src += stride) {
     int err = 0;
-    if (image.bps == 1) {
-      for (int i = 0; i < stride; ++i)
+    if (bilevel) {
+      for (int i = 0; i < row_bytes; ++i)
         scanline [i] = src [i] ^ 0xFF;
       err = TIFFWriteScanline (out, scanline, row, 0);
     }
@@ -604,4 +906,9 @@ bool TIFCodec::writeImageImpl (TIFF* out, const Image& image, const std::string&
   return TIFFWriteDirectory(out);
 }
 
+bool TIFCodec::supportsIndexed ()
+{
+  return true;
+}
+
 TIFCodec tif_loader;
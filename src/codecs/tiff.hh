@@ -15,6 +15,8 @@
  * copyright holder ExactCODE GmbH Germany.
  */
 
+#include <vector>
+
 #include "Codecs.hh"
 
 #include <tiffconf.h>
@@ -30,18 +32,33 @@ public:
   virtual std::string getID () { return "TIFF"; };
   
   virtual int readImage (std::istream* stream, Image& image, const std::string& decompres, int index);
+  virtual int probeImage (std::istream* stream, Image& image, int index, int& orientation);
   virtual bool writeImage (std::ostream* stream, Image& image,
 			   int quality, const std::string& compress);
+  virtual bool supportsIndexed ();
 
   // for multi-page writing
   virtual ImageCodec* instanciateForWrite (std::ostream* stream);
   virtual bool Write (Image& image,
 		      int quality, const std::string& compress, int index);
   
+  // for multi-page reading
+  virtual ImageCodec* instanciateForRead (std::istream* stream);
+  virtual int pageCount ();
+  virtual int readPage (Image& image, const std::string& decompress, int index);
+  virtual int probePage (Image& image, int index, int& orientation);
+  
 private:
   
+  static int readImageImpl (std::istream* stream, Image& image, const std::string& decompres,
+			    int index, int* orientation);
+  static bool readDirectory (TIFF* in, Image& image, const std::string& decompres,
+			     int* orientation);
   static bool writeImageImpl (TIFF* out, const Image& image, const std::string& conpress, int page = 0);
 
+  bool setPage (int index);
+
 private:
   TIFF* tiffCtx;
+  std::vector<toff_t> pageOffsets; // IFD of each page, when reading
 };
@@ -25,7 +25,10 @@
 #include <cctype>
 
 #include "ArgumentList.hh"
+#include "Prefetch.hh"
+#include "memstream.hh"
 #include "Codecs.hh"
+#include "Profile.hh"
 
 #include "Tokenizer.hh"
 #include "Scanner.hh"
@@ -94,6 +97,11 @@ int main (int argc, char* argv[])
   arglist.Add (&arg_directions);
   arglist.Add (&arg_concurrent_lines);
   arglist.Add (&arg_line_skip);
+  
+  Argument<std::string> arg_profile ("", "profile",
+				     "write a Chrome trace of the per stage timings to the file,\n\t\tand a summary to stderr",
+				     0, 1);
+  arglist.Add (&arg_profile);
 
   // parse the specified argument list - and maybe output the Usage
   if (!arglist.Read (argc, argv) || arg_help.Get() == true)
@@ -107,17 +115,33 @@ int main (int argc, char* argv[])
       return 1;
     }
 
-  const std::vector<std::string>& filenames = arglist.Residuals();
+  if (arg_profile.Size())
+    Profile::Enable ();
+  
+  // directories are scanned for images, the next files are read ahead
+  std::vector<std::string> filenames = arglist.Residuals();
+  Utility::Prefetch::ExpandDirectories (filenames);
+  std::vector<std::string> codecs;
+  for (unsigned i = 0; i < filenames.size(); ++i)
+    codecs.push_back (ImageCodec::getCodec (filenames[i]));
+  Utility::Prefetch prefetch (filenames);
+  
   Image image;
   int errors = 0;
   bool multiple_files = filenames.size () > 1;
   
-  for (std::vector<std::string>::const_iterator file = filenames.begin();
-       file != filenames.end ();
-       ++file)
+  std::string filename, data;
+  bool prefetched;
+  for (int j = 0; prefetch.Next (filename, data, prefetched); ++j)
     {
-      if (!ImageCodec::Read (*file, image)) {
-	std::cerr << "Error reading " << *file << std::endl;
+      const std::string& codec = codecs[j];
+      
+      // the scanner only looks at the luminance
+      Utility::memistream stream (data.data(), data.size());
+      if (!(prefetched ? ImageCodec::Read (&stream, image, codec, "gray8") :
+	    ImageCodec::Read (codec.empty() ? filename : codec + ":" + filename,
+			      image, "gray8"))) {
+	std::cerr << "Error reading " << filename << std::endl;
 	++errors;
 	continue;
       }
@@ -128,6 +152,7 @@ int main (int argc, char* argv[])
       int line_skip = arg_line_skip.Get();
 
       std::map<scanner_result_t,int,comp> codes;
+      Profile::Scope profile ("barcode scan", (uint64_t)image.stride() * image.h);
       if ( directions&(left_right|right_left) ) {
           BarDecode::BarcodeIterator<> it(&image,threshold,ean|code128|gs1_128|code39|code25i,directions,concurrent_lines,line_skip);
           while (! it.end() ) {
@@ -150,7 +175,7 @@ int main (int argc, char* argv[])
 	   ++it) {
 	if (it->first.type&(ean|code128|gs1_128) || it->second > 1)
 	  {
-	    if (multiple_files) std::cout << *file << ": ";
+	    if (multiple_files) std::cout << filename << ": ";
             std::cout << filter_non_printable(it->first.code) << " [type: " << it->first.type
                 << " at: (" << it->first.x << "," << it->first.y
                 << ")]" << std::endl;
@@ -162,5 +187,11 @@ int main (int argc, char* argv[])
       if (codes.empty())
 	++errors;
     }
+  
+  if (arg_profile.Size()) {
+    if (!Profile::WriteTrace (arg_profile.Get()))
+      std::cerr << "Error writing profile " << arg_profile.Get() << std::endl;
+    Profile::PrintSummary (std::cerr);
+  }
   return errors;
 }
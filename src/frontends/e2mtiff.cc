@@ -75,9 +75,16 @@ int main (int argc, char* argv[])
        file != filenames.end ();
        ++file)
     {
+      // multi-page input is read via one open, indexed reader
+      std::string filename = *file;
+      std::string cod = ImageCodec::getCodec (filename);
+      std::ifstream input (filename.c_str(), std::ios::in | std::ios::binary);
+      ImageCodec* reader = ImageCodec::MultiRead (&input, cod);
+      
       for (int i = 0, n = 1; i < n; ++i)
       {
-        int ret = ImageCodec::Read (*file, image, "", i);
+        int ret = reader ? reader->Read (image, "", i) :
+	  ImageCodec::Read (*file, image, "", i);
 	if (ret == 0) {
 	  std::cerr << "Error reading " << *file << std::endl;
 	  ++errors;
@@ -89,6 +96,7 @@ int main (int argc, char* argv[])
 	  codec->Write (image, 75, ""/*compression*/, tiff_page++);
         }
       }
+      delete reader;
     }
   
   delete(codec); codec = 0;
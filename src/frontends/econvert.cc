@@ -33,6 +33,8 @@
 #include "config.h"
 
 #include "ArgumentList.hh"
+#include "Prefetch.hh"
+#include "memstream.hh"
 
 #include "Image.hh"
 #include "Codecs.hh"
@@ -53,6 +55,7 @@
 
 #include "vectorial.hh"
 #include "GaussianBlur.hh"
+#include "Profile.hh"
 
 #include "agg_trans_affine.h"
 
@@ -75,10 +78,18 @@ using namespace Utility;
 std::list<Image*> images;
 typedef std::list<Image*>::iterator images_iterator;
 
-#define FOR_ALL_IMAGES(f,...) \
+// images are read indexed, if they are; the palette aware operations
+// work on them as is, all others on the expanded colors
+#define FOR_ALL_INDEXED_IMAGES(f,...) \
   for (images_iterator it = images.begin(); it != images.end(); ++it) \
     f(**it, ##__VA_ARGS__)
 
+#define FOR_ALL_IMAGES(f,...) \
+  for (images_iterator it = images.begin(); it != images.end(); ++it) { \
+    colorspace_de_palette(**it); \
+    f(**it, ##__VA_ARGS__); \
+  }
+
 static void freeImages()
 {
   while (!images.empty()) {
@@ -129,26 +140,45 @@ bool convert_input (const Argument<std::string>& arg)
   }
   freeImages();
   
+  // read the next files ahead, while the current is decoded
+  std::vector<std::string> files, codecs;
   for (int j = 0; j < arg.Size(); ++j)
     {
       std::string file = arg.Get(j);
-      std::string cod = ImageCodec::getCodec(file);
-      std::string ext = ImageCodec::getExtension(file);
-
-      std::ifstream stream(file.c_str(), std::ios::in | std::ios::binary);
+      codecs.push_back(ImageCodec::getCodec(file));
+      files.push_back(file);
+    }
+  Utility::Prefetch prefetch (files);
+  
+  std::string file, data;
+  bool prefetched;
+  for (int j = 0; prefetch.Next(file, data, prefetched); ++j)
+    {
+      std::string cod = codecs[j];
+      
+      Utility::memistream mstream(data.data(), data.size());
+      std::ifstream fstream;
+      if (!prefetched)
+	fstream.open(file.c_str(), std::ios::in | std::ios::binary);
+      std::istream& stream = prefetched ? (std::istream&)mstream : fstream;
       
-      std::string decompression = "";
+      std::string decompression = "indexed";
       if (arg_decompression.Size())
-	decompression = arg_decompression.Get();
+	decompression = arg_decompression.Get() + "," + decompression;
+      
+      // multi-page input is read via one open, indexed reader
+      ImageCodec* reader = ImageCodec::MultiRead (&stream, cod);
       
       for (int i = 0, n = 1; i < n; ++i)
 	{
 	  if (!image)
 	    image = new Image;
 
-	  int ret = ImageCodec::Read(&stream, *image, cod, decompression, i);
+	  int ret = reader ? reader->Read(*image, decompression, i) :
+	    ImageCodec::Read(&stream, *image, cod, decompression, i);
 	  if (ret <= 0) {
 	    std::cerr << "Error reading input file " << arg.Get(j) << ", image: " << i << std::endl;
+	    delete reader;
 	    delete image;
 	    return false;
 	  }
@@ -158,6 +188,7 @@ bool convert_input (const Argument<std::string>& arg)
 	  images.push_back(image);
 	  image = 0;
 	}
+      delete reader;
     }
 
   if (image) delete image;
@@ -169,6 +200,7 @@ bool convert_append (const Argument<std::string>& arg)
 {
   Image* base = 0;
   for (images_iterator it = images.begin(); it != images.end(); ++it) {
+    colorspace_de_palette(**it);
     if (it == images.begin())
       base = *it;
     else
@@ -241,6 +273,22 @@ bool convert_output (const Argument<std::string>& arg)
   return true;
 }
 
+bool convert_profile (const Argument<std::string>& arg)
+{
+  // written at the end
+  Profile::Enable ();
+  return true;
+}
+
+static void writeProfile (const Argument<std::string>& arg)
+{
+  if (!Profile::Enabled ())
+    return;
+  if (!Profile::WriteTrace (arg.Get()))
+    std::cerr << "Error writing profile " << arg.Get() << std::endl;
+  Profile::PrintSummary (std::cerr);
+}
+
 bool convert_split (const Argument<std::string>& arg)
 {
   // TODO: we could split the result into the iamge stack
@@ -329,14 +377,14 @@ bool convert_blur (const Argument<double>& arg)
 bool convert_scale (const Argument<double>& arg)
 {
   double f = arg.Get();
-  FOR_ALL_IMAGES(scale, f, f);
+  FOR_ALL_INDEXED_IMAGES(scale, f, f);
   return true;
 }
 
 bool convert_thumbnail_scale (const Argument<double>& arg)
 {
   double f = arg.Get();
-  FOR_ALL_IMAGES(thumbnail_scale, f, f);
+  FOR_ALL_INDEXED_IMAGES(thumbnail_scale, f, f);
   return true;
 }
 
@@ -364,53 +412,53 @@ bool convert_lightness (const Argument<double>& arg)
 bool convert_nearest_scale (const Argument<double>& arg)
 {
   double f = arg.Get();
-  FOR_ALL_IMAGES(nearest_scale, f, f);
+  FOR_ALL_INDEXED_IMAGES(nearest_scale, f, f);
   return true;
 }
 
 bool convert_bilinear_scale (const Argument<double>& arg)
 {
   double f = arg.Get();
-  FOR_ALL_IMAGES(bilinear_scale, f, f);
+  FOR_ALL_INDEXED_IMAGES(bilinear_scale, f, f);
   return true;
 }
 
 bool convert_bicubic_scale (const Argument<double>& arg)
 {
   double f = arg.Get();
-  FOR_ALL_IMAGES(bicubic_scale, f, f);
+  FOR_ALL_INDEXED_IMAGES(bicubic_scale, f, f);
   return true;
 }
 
 bool convert_box_scale (const Argument<double>& arg)
 {
   double f = arg.Get();
-  FOR_ALL_IMAGES(box_scale, f, f);
+  FOR_ALL_INDEXED_IMAGES(box_scale, f, f);
   return true;
 }
 
 bool convert_ddt_scale (const Argument<double>& arg)
 {
   double f = arg.Get();
-  FOR_ALL_IMAGES(ddt_scale, f, f);
+  FOR_ALL_INDEXED_IMAGES(ddt_scale, f, f);
   return true;
 }
 
 bool convert_flip (const Argument<bool>& arg)
 {
-  FOR_ALL_IMAGES(flipY);
+  FOR_ALL_INDEXED_IMAGES(flipY);
   return true;
 }
 
 bool convert_flop (const Argument<bool>& arg)
 {
-  FOR_ALL_IMAGES(flipX);
+  FOR_ALL_INDEXED_IMAGES(flipX);
   return true;
 }
 
 bool convert_rotate (const Argument<double>& arg)
 {
-  FOR_ALL_IMAGES(rotate, arg.Get(), background_color);
+  FOR_ALL_INDEXED_IMAGES(rotate, arg.Get(), background_color);
   return true;
 }
 
@@ -435,6 +483,7 @@ bool convert_dither_floyd_steinberg (const Argument<int>& arg)
   bool ret = true;
   for (images_iterator it = images.begin(); it != images.end(); ++it)
     {
+      colorspace_de_palette(**it);
       if ((*it)->bps != 8) {
 	std::cerr << "Can only dither 8 bit data right now." << std::endl;
 	ret = false;
@@ -450,6 +499,7 @@ bool convert_dither_riemersma (const Argument<int>& arg)
   bool ret = true;
   for (images_iterator it = images.begin(); it != images.end(); ++it)
     {
+      colorspace_de_palette(**it);
       if ((*it)->bps != 8) {
 	std::cerr << "Can only dither 8 bit data right now." << std::endl;
 	ret = false;
@@ -522,7 +572,7 @@ bool convert_crop (const Argument<std::string>& arg)
   // TODO: pretty C++ parser
   if ((n = sscanf(arg.Get().c_str(), "%d,%d,%d,%d", &x, &y, &w, &h)) == 4)
     {
-      FOR_ALL_IMAGES(crop, x, y, w, h);
+      FOR_ALL_INDEXED_IMAGES(crop, x, y, w, h);
       return true;
     }
   std::cerr << "Crop '" << arg.Get() << "' could not be parsed." << std::endl;
@@ -531,7 +581,7 @@ bool convert_crop (const Argument<std::string>& arg)
 
 bool convert_fast_auto_crop (const Argument<bool>& arg)
 {
-  FOR_ALL_IMAGES(fastAutoCrop);
+  FOR_ALL_INDEXED_IMAGES(fastAutoCrop);
   return true;
 }
 
@@ -716,6 +766,7 @@ bool convert_text (const Argument<std::string>& arg)
   
   for (images_iterator it = images.begin(); it != images.end(); ++it)
   {
+    colorspace_de_palette(**it);
     Path path;
     path.moveTo (0, 0);
     double r = 0, g = 0, b = 0;
@@ -853,6 +904,13 @@ int main (int argc, char* argv[])
   arglist.Add (&arg_compression);
   arglist.Add (&arg_decompression);
   
+  Argument<std::string> arg_profile ("", "profile",
+				     "write a Chrome trace of the per stage timings of the following\n\t\t"
+				     "operations to the file, and a summary to stderr",
+				     0, 1, true, true);
+  arg_profile.Bind (convert_profile);
+  arglist.Add (&arg_profile);
+  
   Argument<std::string> arg_split ("", "split",
 			   "filenames to save the images split in Y-direction into n parts",
 			   0, 1, true, true);
@@ -1067,6 +1125,7 @@ int main (int argc, char* argv[])
   
   // parse the specified argument list - and maybe output the Usage
   if (!arglist.Read (argc, argv)) {
+    writeProfile (arg_profile);
     freeImages();
     return 1;
   }
@@ -1087,6 +1146,7 @@ int main (int argc, char* argv[])
   // stack: insert, append, delete, swap, clone
   
   // all is done inside the argument callback functions
+  writeProfile (arg_profile);
   freeImages();
   return 0;
 }
@@ -20,6 +20,7 @@
 #include <math.h>
 
 #include <iostream>
+#include <fstream>
 #include <iomanip>
 
 #include "config.h"
@@ -82,9 +83,17 @@ int main (int argc, char* argv[])
   const std::vector<std::string>& list = arglist.Residuals();
   for (std::vector<std::string>::const_iterator file = list.begin();
        file != list.end(); ++file) {
+    // multi-page input is read via one open, indexed reader
+    std::string filename = *file;
+    std::string cod = ImageCodec::getCodec (filename);
+    std::ifstream input (filename.c_str(), std::ios::in | std::ios::binary);
+    ImageCodec* reader = ImageCodec::MultiRead (&input, cod);
+    
     for (int i = 0, n = 1; i < n; ++i)
     {
-      int ret = ImageCodec::Read(*file, image, "", i);
+      // only the meta data is needed, do not decode the pixels
+      int ret = reader ? reader->Probe(image, i) :
+	ImageCodec::Probe(*file, image, i);
       if (ret < 1) {
 	std::cout << "edentify: unable to open image '" << *file << "'." << std::endl;
 	continue;
@@ -201,6 +210,7 @@ int main (int argc, char* argv[])
 	std::cout << std::endl;
       }
     }
+    delete reader;
   }
   return errors;
 }
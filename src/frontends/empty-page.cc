@@ -72,7 +72,8 @@ int main (int argc, char* argv[])
   }
   
   Image image;
-  if (!ImageCodec::Read (arg_input.Get(), image)) {
+  // no colour is used, only decode gray
+  if (!ImageCodec::Read (arg_input.Get(), image, "gray8")) {
     std::cerr << "Error reading input file." << std::endl;
     return 1;
   }
@@ -23,6 +23,8 @@
 #include <limits>
 
 #include "ArgumentList.hh"
+#include "Prefetch.hh"
+#include "memstream.hh"
 
 #include "Image.hh"
 #include "Codecs.hh"
@@ -32,6 +34,7 @@
 #include "scale.hh"
 
 #include "optimize2bw.hh"
+#include "Profile.hh"
 
 using namespace Utility;
 
@@ -90,6 +93,11 @@ int main (int argc, char* argv[])
   arglist.Add (&arg_dpi);
   arglist.Add (&arg_sd);
   arglist.Add (&arg_denoise);
+  
+  Argument<std::string> arg_profile ("", "profile",
+				     "write a Chrome trace of the per stage timings to the file,\n\t\tand a summary to stderr",
+				     0, 1);
+  arglist.Add (&arg_profile);
 
   // parse the specified argument list - and maybe output the Usage
   if (!arglist.Read (argc, argv))
@@ -97,17 +105,38 @@ int main (int argc, char* argv[])
       usage(arg_help);
     }
   
+  if (arg_profile.Size())
+    Profile::Enable ();
+  
   int errors = 0;
   ImageCodec* codec = 0;
   std::fstream* stream = 0;
   Image image;
   
+  // read the next input files ahead, while the current is processed
+  std::vector<std::string> files, codecs;
+  for (int f = 0; f < arg_input.Size(); ++f)
+    {
+      std::string file = arg_input.Get(f);
+      codecs.push_back(ImageCodec::getCodec(file));
+      files.push_back(file);
+    }
+  Utility::Prefetch prefetch (files);
+  
+  std::string input_file, data;
+  bool prefetched;
   int f2 = 0;
-  for (int f = 0, i2 = 0; f < arg_input.Size(); ++f)
+  for (int i2 = 0, j = 0; prefetch.Next(input_file, data, prefetched); ++j)
     {
+      const std::string& cod = codecs[j];
+      
       for (int n = 1, i = 0; i < n; ++i)
 	{
-	  int ret = ImageCodec::Read(arg_input.Get(f), image, "", i);
+	  // at most rgb8 is used, no alpha or 16 bit data
+	  Utility::memistream input(data.data(), data.size());
+	  int ret = prefetched ? ImageCodec::Read(&input, image, cod, "rgb8", i) :
+	    ImageCodec::Read(cod.empty() ? input_file : cod + ":" + input_file,
+			     image, "rgb8", i);
 	  if (!ret) {
 	    std::cerr << "Error reading input file." << std::endl;
 	    ++errors;
@@ -251,5 +280,11 @@ int main (int argc, char* argv[])
   if (stream)
     delete stream;
   
+  if (arg_profile.Size()) {
+    if (!Profile::WriteTrace (arg_profile.Get()))
+      std::cerr << "Error writing profile " << arg_profile.Get() << std::endl;
+    Profile::PrintSummary (std::cerr);
+  }
+  
   return errors;
 }
@@ -0,0 +1,234 @@
+/*
+ * Pooled, aligned pixel buffer allocation.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <map>
+#include <list>
+#include <algorithm>
+#include <iostream>
+
+#include "BufferPool.hh"
+
+// small buffers are not worth the bookkeeping, malloc is fast enough
+static const size_t min_pooled = 4096;
+
+// size classes: four steps per power of two, at most 25% slack
+static size_t size_class (size_t size)
+{
+  size_t p = min_pooled;
+  while (p < size && p < ((size_t)-1 >> 2))
+    p <<= 1;
+  if (p == min_pooled)
+    return p;
+
+  const size_t q = p >> 3; // p/2 + n * p/8
+  for (size_t c = (p >> 1) + q; c < p; c += q)
+    if (c >= size)
+      return c;
+  return p;
+}
+
+namespace {
+
+  struct Pool
+  {
+    // capacity of each buffer handed out or cached by the pool
+    std::map<void*, size_t> capacity;
+    // released buffers, most recent first
+    std::list<std::pair<void*, size_t> > cache;
+
+    size_t limit;
+    BufferPool::Stats stats;
+
+    Pool () : limit (256 << 20) { memset (&stats, 0, sizeof(stats)); }
+
+    void evict (size_t keep)
+    {
+      while (!cache.empty() && stats.cached_bytes > keep) {
+	std::pair<void*, size_t>& last = cache.back();
+	capacity.erase (last.first);
+	free (last.first);
+	stats.cached_bytes -= last.second;
+	--stats.cached_buffers;
+	++stats.evicted;
+	cache.pop_back ();
+      }
+    }
+  };
+
+  pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  // never destructed, images might be released in static destructors
+  Pool& pool ()
+  {
+    static Pool* p = new Pool;
+    return *p;
+  }
+
+  struct Lock {
+    Lock () { pthread_mutex_lock (&pool_mutex); }
+    ~Lock () { pthread_mutex_unlock (&pool_mutex); }
+  };
+
+  void* aligned_malloc (size_t size)
+  {
+    void* ptr = 0;
+    if (posix_memalign (&ptr, BufferPool::Alignment, size ? size : 1) != 0)
+      return 0;
+    return ptr;
+  }
+
+  // capacity of a buffer handed out by the pool, 0 for foreign memory;
+  // called with the lock held
+  size_t lookup (Pool& p, void* ptr)
+  {
+    std::map<void*, size_t>::iterator it = p.capacity.find (ptr);
+    if (it == p.capacity.end())
+      return 0;
+#ifdef __GLIBC__
+    // a pooled buffer free()d behind our back, the address since
+    // reused by a smaller block: forget the stale capacity
+    if (malloc_usable_size (ptr) < it->second) {
+      p.capacity.erase (it);
+      return 0;
+    }
+#endif
+    return it->second;
+  }
+}
+
+void* BufferPool::Allocate (size_t size)
+{
+  if (size <= min_pooled)
+    return aligned_malloc (size);
+
+  const size_t c = size_class (size);
+  {
+    Lock lock;
+    Pool& p = pool ();
+
+    // the most recently released frame of this or the next class
+    for (std::list<std::pair<void*, size_t> >::iterator it = p.cache.begin();
+	 it != p.cache.end(); ++it)
+      if (it->second >= c && it->second <= size_class (c + 1)) {
+	void* ptr = it->first;
+	p.stats.cached_bytes -= it->second;
+	--p.stats.cached_buffers;
+	++p.stats.hits;
+	p.cache.erase (it);
+	return ptr;
+      }
+    ++p.stats.misses;
+  }
+
+  void* ptr = aligned_malloc (c);
+  if (!ptr)
+    return 0;
+
+  Lock lock;
+  pool().capacity[ptr] = c; // replaces a stale entry of a reused address
+  return ptr;
+}
+
+void BufferPool::Release (void* ptr)
+{
+  if (!ptr)
+    return;
+
+  {
+    Lock lock;
+    Pool& p = pool ();
+    const size_t cap = lookup (p, ptr);
+    if (cap) {
+      if (cap <= p.limit) {
+	p.evict (p.limit - cap);
+	p.cache.push_front (std::make_pair (ptr, cap));
+	p.stats.cached_bytes += cap;
+	++p.stats.cached_buffers;
+	++p.stats.cached;
+	return;
+      }
+      p.capacity.erase (ptr);
+    }
+  }
+  free (ptr);
+}
+
+void* BufferPool::Reallocate (void* ptr, size_t size)
+{
+  if (!ptr)
+    return Allocate (size);
+
+  size_t cap = 0;
+  {
+    Lock lock;
+    cap = lookup (pool(), ptr);
+  }
+
+  // plain heap memory, e.g. from a codec
+  if (!cap)
+    return realloc (ptr, size);
+
+  // fits, and does not waste more than half of the buffer
+  if (size <= cap && size_class (size) * 2 > cap)
+    return ptr;
+
+  void* nptr = Allocate (size);
+  if (!nptr)
+    return 0;
+  memcpy (nptr, ptr, std::min (size, cap));
+  Release (ptr);
+  return nptr;
+}
+
+void BufferPool::SetLimit (size_t bytes)
+{
+  Lock lock;
+  pool().limit = bytes;
+  pool().evict (bytes);
+}
+
+void BufferPool::Trim ()
+{
+  Lock lock;
+  pool().evict (0);
+}
+
+BufferPool::Stats BufferPool::GetStats ()
+{
+  Lock lock;
+  return pool().stats;
+}
+
+void BufferPool::PrintStats (std::ostream& os)
+{
+  Stats s = GetStats ();
+  const uint64_t total = s.hits + s.misses;
+  os << "buffer pool: " << s.hits << " hits, " << s.misses << " misses";
+  if (total)
+    os << " (" << (100 * s.hits / total) << "% reused)";
+  os << ", " << s.cached << " cached, " << s.evicted << " evicted, "
+     << s.cached_buffers << " buffers with " << (s.cached_bytes >> 10)
+     << " KiB idle" << std::endl;
+}
@@ -0,0 +1,67 @@
+/*
+ * Pooled, aligned pixel buffer allocation.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Image operations usually allocate a fresh full-frame buffer and
+ * release the old one right after. Instead of handing the memory back
+ * to the OS (and page faulting it in again for the next frame) the
+ * released buffers are kept in a process wide cache and reused for
+ * the next allocation of the same size class.
+ *
+ * All buffers are Alignment aligned, the larger ones are rounded up
+ * to a size class (four per power of two). Buffers of the pool must
+ * only be released by Release() or Reallocate(), as Image does: the
+ * pool remembers their capacity by address, which goes stale when
+ * they are free()d behind its back. Release() and Reallocate() accept
+ * any other malloc()ed pointer, e.g. decoder allocated pixel data.
+ */
+
+#ifndef BUFFERPOOL_HH
+#define BUFFERPOOL_HH
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include <iosfwd>
+
+class BufferPool
+{
+public:
+  static const size_t Alignment = 64;
+
+  static void* Allocate (size_t size);
+  // realloc() semantics, including ptr == 0
+  static void* Reallocate (void* ptr, size_t size);
+  // free() semantics, pooled buffers are cached for reuse
+  static void Release (void* ptr);
+
+  // upper bound of the cached (unused) memory, 0 disables caching
+  static void SetLimit (size_t bytes);
+  // free all cached buffers
+  static void Trim ();
+
+  struct Stats {
+    uint64_t hits, misses; // allocations served from the cache or not
+    uint64_t cached, evicted; // buffers released to the cache, dropped
+    size_t cached_bytes, cached_buffers; // currently
+  };
+
+  static Stats GetStats ();
+  static void PrintStats (std::ostream& os);
+};
+
+#endif
@@ -21,11 +21,19 @@
 #include <map>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
 #include "Image.hh"
 #include "ImageIterator2.hh"
 
 #include "Codecs.hh"
 #include "Colorspace.hh"
+#include "BufferPool.hh"
+#include "Profile.hh"
 
 #include "Endianess.hh"
 
@@ -114,10 +122,31 @@ void normalize (Image& image, uint8_t l, uint8_t h)
   codegen<normalize_template> (image, l, h);
 }
 
+// Output of the reducing conversions, usually done in-place. If the
+// pixel data is shared (copy on write) only the smaller result is
+// allocated, instead of duplicating the whole input first.
+static uint8_t* reduced_output (Image& image, size_t size)
+{
+  // the loops expect packed rows, so sub-image views are packed first
+  if (image.isShared() && !image.isView())
+    return (uint8_t*) BufferPool::Allocate (size);
+  return image.getRawData();
+}
+
+static void reduced_done (Image& image, uint8_t* output)
+{
+  if (output != image.getConstRawData())
+    image.setRawData(output);
+  else
+    image.resize(image.w, image.h); // realloc
+}
+
 void colorspace_rgba8_to_rgb8 (Image& image)
 {
-  uint8_t* output = image.getRawData();
-  for (uint8_t* it = image.getRawData(); it < image.getRawData() + image.w*image.h*image.spp;)
+  uint8_t* const data = reduced_output(image, image.w*image.h*3);
+  uint8_t* output = data;
+  const uint8_t* end = image.getConstRawData() + image.w*image.h*image.spp;
+  for (const uint8_t* it = image.getConstRawData(); it < end;)
     {
       *output++ = *it++;
       *output++ = *it++;
@@ -125,13 +154,15 @@ void colorspace_rgba8_to_rgb8 (Image& image)
       it++; // skip over a
     }
   image.spp = 3; // converted data right now
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
 }
 
 void colorspace_argb8_to_rgb8 (Image& image)
 {
-  uint8_t* output = image.getRawData();
-  for (uint8_t* it = image.getRawData(); it < image.getRawData() + image.w*image.h*image.spp;)
+  uint8_t* const data = reduced_output(image, image.w*image.h*3);
+  uint8_t* output = data;
+  const uint8_t* end = image.getConstRawData() + image.w*image.h*image.spp;
+  for (const uint8_t* it = image.getConstRawData(); it < end;)
     {
       it++; // skip over a
       *output++ = *it++;
@@ -139,13 +170,64 @@ void colorspace_argb8_to_rgb8 (Image& image)
       *output++ = *it++;
     }
   image.spp = 3; // converted data right now
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
+}
+
+// RGBA (e.g. camera frames) 16 pixels at a time, with the same result as
+// the scalar loop, returns the number of pixels converted; in place is
+// fine, the output never overtakes the input
+static size_t rgba8_to_gray8 (const uint8_t* it, uint8_t* output, size_t pixels)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  // R and B, G and A as 16 bit pairs for the multiply-add
+  const __m128i mask = _mm_set1_epi32 (0x00ff00ff);
+  const __m128i rb = _mm_set1_epi32 (11 << 16 | 28), ga = _mm_set1_epi32 (59);
+  // c / 100 == (c * 5243) >> 19 for all c <= 255 * 100
+  const __m128i div = _mm_set1_epi16 (5243);
+  for (; i + 16 <= pixels; i += 16) {
+    __m128i c[4];
+    for (int j = 0; j < 4; ++j) {
+      const __m128i v = _mm_loadu_si128 ((const __m128i*)(it + 4 * (i + 4 * j)));
+      c[j] = _mm_add_epi32 (_mm_madd_epi16 (_mm_and_si128 (v, mask), rb),
+			    _mm_madd_epi16 (_mm_and_si128 (_mm_srli_epi32 (v, 8), mask), ga));
+    }
+    const __m128i lo = _mm_srli_epi16 (_mm_mulhi_epu16 (_mm_packs_epi32 (c[0], c[1]), div), 3);
+    const __m128i hi = _mm_srli_epi16 (_mm_mulhi_epu16 (_mm_packs_epi32 (c[2], c[3]), div), 3);
+    _mm_storeu_si128 ((__m128i*)(output + i), _mm_packus_epi16 (lo, hi));
+  }
+#elif defined(__wasm_simd128__)
+  const v128_t mask = wasm_i32x4_splat (0x00ff00ff);
+  const v128_t rb = wasm_i32x4_splat (11 << 16 | 28), ga = wasm_i32x4_splat (59);
+  const v128_t div = wasm_i32x4_splat (5243);
+  for (; i + 16 <= pixels; i += 16) {
+    v128_t c[4];
+    for (int j = 0; j < 4; ++j) {
+      const v128_t v = wasm_v128_load (it + 4 * (i + 4 * j));
+      c[j] = wasm_i32x4_add (wasm_i32x4_dot_i16x8 (wasm_v128_and (v, mask), rb),
+			     wasm_i32x4_dot_i16x8 (wasm_v128_and (wasm_u32x4_shr (v, 8), mask), ga));
+      c[j] = wasm_u32x4_shr (wasm_i32x4_mul (c[j], div), 19);
+    }
+    const v128_t lo = wasm_i16x8_narrow_i32x4 (c[0], c[1]);
+    const v128_t hi = wasm_i16x8_narrow_i32x4 (c[2], c[3]);
+    wasm_v128_store (output + i, wasm_u8x16_narrow_i16x8 (lo, hi));
+  }
+#endif
+  return i;
 }
 
 void colorspace_rgb8_to_gray8 (Image& image, const int bytes)
 {
-  uint8_t* output = image.getRawData();
-  for (uint8_t* it = image.getRawData(); it < image.getRawData() + image.stride() * image.h; it += bytes)
+  uint8_t* const data = reduced_output(image, image.w*image.h);
+  uint8_t* output = data;
+  const uint8_t* end = image.getConstRawData() + image.stride() * image.h;
+  const uint8_t* it = image.getConstRawData();
+  if (bytes == 4) {
+    const size_t done = rgba8_to_gray8 (it, output, image.w*image.h);
+    it += done * 4;
+    output += done;
+  }
+  for (; it < end; it += bytes)
     {
       // R G B order and associated weighting
       int c = (int)it[0] * 28;
@@ -154,14 +236,15 @@ void colorspace_rgb8_to_gray8 (Image& image, const int bytes)
       *output++ = (uint8_t)(c / 100);
     }
   image.spp = 1; // converted data right now
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
 }
 
 void colorspace_rgb16_to_gray16 (Image& image)
 {
-  uint16_t* output = (uint16_t*)image.getRawData();
-  for (uint16_t* it = output;
-       it < (uint16_t*)(image.getRawData() + image.stride() * image.h);)
+  uint8_t* const data = reduced_output(image, image.w*image.h*2);
+  uint16_t* output = (uint16_t*)data;
+  const uint16_t* end = (const uint16_t*)(image.getConstRawData() + image.stride() * image.h);
+  for (const uint16_t* it = (const uint16_t*)image.getConstRawData(); it < end;)
     {
       // R G B order and associated weighting
       int c = (int)*it++ * 28;
@@ -171,12 +254,12 @@ void colorspace_rgb16_to_gray16 (Image& image)
       *output++ = (uint16_t)(c / 100);
     }
   image.spp = 1; // converted data right now
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
 }
 
 void colorspace_rgb8_to_rgb8a (Image& image, uint8_t alpha)
 {
-  image.setRawDataWithoutDelete	((uint8_t*)realloc(image.getRawData(),
+  image.setRawDataWithoutDelete	((uint8_t*)BufferPool::Reallocate(image.getRawData(),
 						   image.w * 4 * image.h));
   image.setSamplesPerPixel(4);
   
@@ -205,7 +288,7 @@ void colorspace_gray8_denoise_neighbours (Image &image, bool gross)
     return;
   
   uint8_t* it = image.getRawData();
-  uint8_t* ndata = (uint8_t*)malloc(image.stride() * image.h);
+  uint8_t* ndata = (uint8_t*)BufferPool::Allocate(image.stride() * image.h);
   uint8_t* it2 = ndata;
   
   struct compare_and_set
@@ -291,8 +374,9 @@ void colorspace_gray8_denoise_neighbours (Image &image, bool gross)
 
 void colorspace_gray8_to_gray1 (Image& image, uint8_t threshold)
 {
-  uint8_t *output = image.getRawData();
-  uint8_t *input = image.getRawData();
+  uint8_t* const data = reduced_output(image, (image.w*1 + 7) / 8 * image.h);
+  uint8_t *output = data;
+  const uint8_t *input = image.getConstRawData();
   
   for (int row = 0; row < image.h; row++)
     {
@@ -318,13 +402,14 @@ void colorspace_gray8_to_gray1 (Image& image, uint8_t threshold)
 	}
     }
   image.bps = 1;
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
 }
 
 void colorspace_gray8_to_gray4 (Image& image)
 {
-  uint8_t *output = image.getRawData();
-  uint8_t *input = image.getRawData();
+  uint8_t* const data = reduced_output(image, (image.w*4 + 7) / 8 * image.h);
+  uint8_t *output = data;
+  const uint8_t *input = image.getConstRawData();
   
   for (int row = 0; row < image.h; row++)
     {
@@ -349,12 +434,13 @@ void colorspace_gray8_to_gray4 (Image& image)
 	}
     }
   image.bps = 4;
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
 }
 void colorspace_gray8_to_gray2 (Image& image)
 {
-  uint8_t *output = image.getRawData();
-  uint8_t *input = image.getRawData();
+  uint8_t* const data = reduced_output(image, (image.w*2 + 7) / 8 * image.h);
+  uint8_t *output = data;
+  const uint8_t *input = image.getConstRawData();
   
   for (int row = 0; row < image.h; ++row)
     {
@@ -379,12 +465,12 @@ void colorspace_gray8_to_gray2 (Image& image)
 	}
     }
   image.bps = 2;
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
 }
 
 void colorspace_gray8_to_rgb8 (Image& image)
 {
-  uint8_t* data = (uint8_t*)malloc (image.w*image.h*3);
+  uint8_t* data = (uint8_t*)BufferPool::Allocate (image.w*image.h*3);
   uint8_t* output = data;
   for (uint8_t* it = image.getRawData ();
        it < image.getRawData() + image.w*image.h*image.spp; ++it)
@@ -399,13 +485,13 @@ void colorspace_gray8_to_rgb8 (Image& image)
 
 void colorspace_grayX_to_gray8 (Image& image)
 {
-  uint8_t* old_data = image.getRawData();
+  const uint8_t* old_data = image.getConstAlignedRawData();
   int old_stride = image.stride();
   
   const int bps = image.bps;
   image.bps = 8;
-  image.setRawDataWithoutDelete ((uint8_t*)malloc(image.h * image.stride()));
-  uint8_t* output = image.getRawData();
+  uint8_t* const data = (uint8_t*)BufferPool::Allocate(image.h * image.stride());
+  uint8_t* output = data;
   
   const int vmax = 1 << bps;
 #ifdef _MSC_VER
@@ -421,7 +507,7 @@ void colorspace_grayX_to_gray8 (Image& image)
   const unsigned int bitshift = 8 - bps;
   for (int row = 0; row < image.h; ++row)
     {
-      uint8_t* input = old_data + row * old_stride;
+      const uint8_t* input = old_data + row * old_stride;
       uint8_t z = 0;
       unsigned int bits = 0;
       
@@ -438,19 +524,19 @@ void colorspace_grayX_to_gray8 (Image& image)
 	  bits -= bps;
 	}
     }
-  free (old_data);
+  image.setRawData (data);
 }
 
 void colorspace_grayX_to_rgb8 (Image& image)
 {
-  uint8_t* old_data = image.getRawData();
+  const uint8_t* old_data = image.getConstAlignedRawData();
   int old_stride = image.stride();
   
   const int bps = image.bps;
   image.bps = 8;
   image.spp = 3;
-  image.setRawDataWithoutDelete ((uint8_t*)malloc(image.h * image.stride()));
-  uint8_t* output = image.getRawData();
+  uint8_t* const data = (uint8_t*)BufferPool::Allocate(image.h * image.stride());
+  uint8_t* output = data;
   
   const int vmax = 1 << bps;
 #ifdef _MSC_VER
@@ -466,7 +552,7 @@ void colorspace_grayX_to_rgb8 (Image& image)
   const unsigned int bitshift = 8 - bps;
   for (int row = 0; row < image.h; ++row)
     {
-      uint8_t* input = old_data + row * old_stride;
+      const uint8_t* input = old_data + row * old_stride;
       uint8_t z = 0;
       unsigned int bits = 0;
       
@@ -485,23 +571,23 @@ void colorspace_grayX_to_rgb8 (Image& image)
 	  bits -= bps;
 	}
     }
-  free (old_data);
+  image.setRawData (data);
 }
 
 void colorspace_gray1_to_gray2 (Image& image)
 {
-  uint8_t* old_data = image.getRawData();
+  const uint8_t* old_data = image.getConstAlignedRawData();
   int old_stride = image.stride();
   
   image.bps = 2;
-  image.setRawDataWithoutDelete ((uint8_t*) malloc (image.h*image.stride()));
-  uint8_t* output = image.getRawData();
+  uint8_t* const data = (uint8_t*) BufferPool::Allocate (image.h*image.stride());
+  uint8_t* output = data;
   
   for (int row = 0; row < image.h; ++row)
     {
       uint8_t z = 0;
       uint8_t zz = 0;
-      uint8_t* input = old_data + row * old_stride;
+      const uint8_t* input = old_data + row * old_stride;
 
       int x;
       for (x = 0; x < image.w; ++x)
@@ -525,24 +611,24 @@ void colorspace_gray1_to_gray2 (Image& image)
 	  *output++ = zz;
 	}
     }
-  free (old_data);
+  image.setRawData (data);
 }
 
 void colorspace_gray1_to_gray4 (Image& image)
 {
-  uint8_t* old_data = image.getRawData();
+  const uint8_t* old_data = image.getConstAlignedRawData();
   int old_stride = image.stride();
   
   image.bps = 4;
-  image.setRawDataWithoutDelete ((uint8_t*) malloc (image.h*image.stride()));
-  uint8_t* output = image.getRawData();
+  uint8_t* const data = (uint8_t*) BufferPool::Allocate (image.h*image.stride());
+  uint8_t* output = data;
   
   for (int row = 0; row < image.h; ++row)
     {
       uint8_t z = 0;
       uint8_t zz = 0;
       
-      uint8_t* input = old_data + row * old_stride;
+      const uint8_t* input = old_data + row * old_stride;
       
       int x;
       for (x = 0; x < image.w; ++x)
@@ -567,13 +653,15 @@ void colorspace_gray1_to_gray4 (Image& image)
 	}
     }
   
-  free (old_data);
+  image.setRawData (data);
 }
 
 void colorspace_16_to_8 (Image& image)
 {
-  uint8_t* output = image.getRawData();
-  for (uint8_t* it = output; it < image.getRawDataEnd(); it += 2)
+  uint8_t* const data = reduced_output(image, image.stride() / 2 * image.h);
+  uint8_t* output = data;
+  const uint8_t* end = image.getConstRawDataEnd();
+  for (const uint8_t* it = image.getConstRawData(); it < end; it += 2)
     {
       if (Exact::NativeEndianTraits::IsBigendian)
 	*output++ = it[0];
@@ -581,12 +669,12 @@ void colorspace_16_to_8 (Image& image)
 	*output++ = it[1];
     }
   image.bps = 8; // converted 8bit data
-  image.resize(image.w, image.h); // realloc
+  reduced_done(image, data);
 }
 
 void colorspace_8_to_16 (Image& image)
 {
-  image.setRawDataWithoutDelete	((uint8_t*)realloc(image.getRawData(),
+  image.setRawDataWithoutDelete	((uint8_t*)BufferPool::Reallocate(image.getRawData(),
 		    		 image.stride() * 2 * image.h));
 	
   uint8_t* data = image.getRawData();
@@ -600,11 +688,18 @@ void colorspace_8_to_16 (Image& image)
   image.bps = 16; // converted 16bit data
 }
 
-void colorspace_de_palette (Image& image, int table_entries,
-			    uint16_t* rmap, uint16_t* gmap, uint16_t* bmap)
+// what colorspace_de_palette makes of a palette
+enum palette_kind {
+  PALETTE_BW, PALETTE_BW_INVERTED, PALETTE_ORDERED_GRAY,
+  PALETTE_GRAY, PALETTE_RGB
+};
+
+static palette_kind classify_palette (int bps, int table_entries,
+				      const uint16_t* rmap, const uint16_t* gmap,
+				      const uint16_t* bmap)
 {
   // detect 1bps b/w tables
-  if (image.bps == 1 && table_entries >= 2) {
+  if (bps == 1 && table_entries >= 2) {
     if (rmap[0] == 0 &&
 	gmap[0] == 0 &&
 	bmap[0] == 0 &&
@@ -613,7 +708,7 @@ void colorspace_de_palette (Image& image, int table_entries,
 	bmap[1] >= 0xff00)
       {
 	//std::cerr << "correct b/w table." << std::endl;
-	return;
+	return PALETTE_BW;
       }
     if (rmap[1] == 0 &&
 	gmap[1] == 0 &&
@@ -623,23 +718,18 @@ void colorspace_de_palette (Image& image, int table_entries,
 	bmap[0] >= 0xff00)
       {
 	//std::cerr << "inverted b/w table." << std::endl;
-	for (uint8_t* it = image.getRawData();
-	     it < image.getRawDataEnd();
-	     ++it)
-	  *it ^= 0xff;
-	image.setRawData ();
-	return;
+	return PALETTE_BW_INVERTED;
       }
   }
   
   // detect gray tables
   bool is_gray = false;
   if (table_entries > 1) {
-    bool is_ordered_gray = (image.bps == 8 || image.bps == 4 ||
-			    image.bps == 2) && (1 << image.bps == table_entries);
+    bool is_ordered_gray = (bps == 8 || bps == 4 ||
+			    bps == 2) && (1 << bps == table_entries);
     is_gray = true;
     
-    // std::cerr << (1 << image.bps) << " vs " << table_entries << std::endl;
+    // std::cerr << (1 << bps) << " vs " << table_entries << std::endl;
     
     // std::cerr << "checking for gray table" << std::endl;
     for (int i = 0; (is_gray || is_ordered_gray) && i < table_entries; ++i) {
@@ -660,15 +750,57 @@ void colorspace_de_palette (Image& image, int table_entries,
     // std::cerr << "gray: " << is_gray << ", is ordered: " << is_ordered_gray << std::endl;
     
     if (is_ordered_gray)
-      return;
+      return PALETTE_ORDERED_GRAY;
   }
   
+  return is_gray ? PALETTE_GRAY : PALETTE_RGB;
+}
+
+void colorspace_de_palette_spec (int& spp, int& bps, int table_entries,
+				 const uint16_t* rmap, const uint16_t* gmap,
+				 const uint16_t* bmap)
+{
+  switch (classify_palette (bps, table_entries, rmap, gmap, bmap)) {
+  case PALETTE_BW:
+  case PALETTE_BW_INVERTED:
+  case PALETTE_ORDERED_GRAY:
+    break; // kept as is
+  case PALETTE_GRAY:
+    spp = 1; bps = 8; break;
+  case PALETTE_RGB:
+    spp = 3; bps = 8; break;
+  }
+}
+
+void colorspace_de_palette (Image& image, int table_entries,
+			    const uint16_t* rmap, const uint16_t* gmap,
+			    const uint16_t* bmap)
+{
+  const palette_kind kind = classify_palette (image.bps, table_entries,
+					      rmap, gmap, bmap);
+  switch (kind) {
+  case PALETTE_BW:
+  case PALETTE_ORDERED_GRAY:
+    return;
+  case PALETTE_BW_INVERTED:
+    for (uint8_t* it = image.getRawData();
+	 it < image.getRawDataEnd();
+	 ++it)
+      *it ^= 0xff;
+    image.setRawData ();
+    return;
+  default:
+    ;
+  }
+  
+  const bool is_gray = kind == PALETTE_GRAY;
+  
   int new_size = image.w * image.h;
   if (!is_gray) // RGB
     new_size *= 3;
   
   uint8_t* orig_data = image.getRawData();
-  uint8_t* new_data = (uint8_t*) malloc (new_size);
+  uint8_t* new_data = (uint8_t*) BufferPool::Allocate (new_size);
   
   uint8_t* src = orig_data;
   uint8_t* dst = new_data;
@@ -710,13 +842,41 @@ void colorspace_de_palette (Image& image, int table_entries,
   image.setRawData (new_data);  
 }
 
-bool colorspace_by_name (Image& image, const std::string& target_colorspace,
-			 uint8_t threshold)
+void colorspace_de_palette (Image& image)
+{
+  if (!image.isIndexed ())
+    return;
+  
+  // the image keeps the palette, which we are about to drop
+  const std::vector<uint16_t> map (image.paletteRed(),
+				   image.paletteRed() + 3 * image.paletteSize());
+  const int entries = image.paletteSize ();
+  image.clearPalette ();
+  colorspace_de_palette (image, entries, &map[0], &map[entries], &map[2 * entries]);
+}
+
+void colorspace_reduce_palette (Image& image)
 {
-  std::string space = target_colorspace;
+  if (!image.isIndexed ())
+    return;
+  
+  switch (classify_palette (image.bps, image.paletteSize(), image.paletteRed(),
+			    image.paletteGreen(), image.paletteBlue())) {
+  case PALETTE_BW:
+  case PALETTE_BW_INVERTED:
+  case PALETTE_ORDERED_GRAY:
+    colorspace_de_palette (image); // not expanded, at most inverted
+    break;
+  default:
+    ;
+  }
+}
+
+bool colorspace_spec_by_name (const std::string& colorspace, int& spp, int& bps)
+{
+  std::string space = colorspace;
   std::transform (space.begin(), space.end(), space.begin(), tolower);
     
-  int spp, bps;
   if (space == "bw" || space == "bilevel" || space == "gray1") {
     spp = 1; bps = 1;
   } else if (space == "gray2") {
@@ -734,7 +894,17 @@ bool colorspace_by_name (Image& image, const std::string& target_colorspace,
   } else if (space == "rgb16") {
     spp = 3; bps = 16;
   // TODO: CYMK, YVU, RGBA, GRAYA...
-  } else {
+  } else
+    return false;
+  
+  return true;
+}
+
+bool colorspace_by_name (Image& image, const std::string& target_colorspace,
+			 uint8_t threshold)
+{
+  int spp, bps;
+  if (!colorspace_spec_by_name (target_colorspace, spp, bps)) {
     std::cerr << "Requested colorspace conversion not yet implemented."
               << std::endl;
     return false;
@@ -745,6 +915,7 @@ bool colorspace_by_name (Image& image, const std::string& target_colorspace,
 
 bool colorspace_convert(Image& image, int spp, int bps, uint8_t threshold)
 {
+  Profile::Scope profile ("colorspace", (uint64_t)image.stride() * image.h);
   // thru the codec?
   if (!image.isModified() && image.getCodec())
     if (spp == 1 && bps >= 8)
@@ -51,6 +51,8 @@ void colorspace_8_to_16 (Image& image);
 bool colorspace_convert (Image& image, int spp, int bps, uint8_t threshold = 127);
 bool colorspace_by_name (Image& image, const std::string& target_colorspace,
 			 uint8_t threshold = 127);
+// just the samples per pixel and bits per sample of a named colorspace
+bool colorspace_spec_by_name (const std::string& colorspace, int& spp, int& bps);
 
 const char* colorspace_name (Image& image);
 
@@ -62,6 +64,16 @@ void invert (Image& image);
 // "internal" helper (for image loading)
 
 void colorspace_de_palette (Image& image, int table_entries,
-			    uint16_t* rmap, uint16_t* gmap, uint16_t* bmap);
+			    const uint16_t* rmap, const uint16_t* gmap,
+			    const uint16_t* bmap);
+// expands indexed images with the attached palette, to gray or RGB
+void colorspace_de_palette (Image& image);
+// drops the attached palette if the indices are plain b/w or gray
+// values already (inverting the data if necessary)
+void colorspace_reduce_palette (Image& image);
+// the spp and bps colorspace_de_palette will convert to, without data
+void colorspace_de_palette_spec (int& spp, int& bps, int table_entries,
+				 const uint16_t* rmap, const uint16_t* gmap,
+				 const uint16_t* bmap);
 
 #endif
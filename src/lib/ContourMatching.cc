@@ -2,7 +2,12 @@
 #include <algorithm>
 #include <iostream>
 
+#include <string.h>
+
+#include "MappedFile.hh"
+
 #include "ContourMatching.hh"
+#include "Profile.hh"
 
 const unsigned int logo_trans_before_rot=10000; // TODO: calculate useful value !!
 
@@ -37,6 +42,9 @@ LogoRepresentation::LogoRepresentation(Contours* logo_contours,
 				       double angle_step)
 {
   source=logo_contours;
+  owned_source=0;
+  origin=0;
+  max_features=max_feature_no;
   tolerance=max_avg_tolerance;
   shift=reduction_shift;
   rot_max=maximum_angle;
@@ -107,10 +115,143 @@ LogoRepresentation::~LogoRepresentation()
   for (unsigned int s=0; s<logo_sets.size(); s++)
     for (unsigned int j=0; j<logo_set_count; j++)
       delete logo_sets[s][j].contour;
+  delete owned_source;
+}
+
+LogoRepresentation::LogoRepresentation()
+  : origin(0), source(0), owned_source(0), max_features(0), tolerance(0), shift(0),
+    rot_max(.0), rot_step(.0), centerx(.0), centery(.0),
+    logo_set_count(0), total_contour_length(0)
+{
+}
+
+// kind specific parameter block of the contour cache
+struct LogoCacheParams
+{
+  uint32_t max_features;
+  uint32_t tolerance;
+  uint32_t shift;
+  uint32_t logo_set_count;
+  uint32_t set_count;
+  uint32_t total_contour_length;
+  double rot_max;
+  double rot_step;
+  double centerx;
+  double centery;
+  uint64_t origin;
+};
+
+bool LogoRepresentation::Save(const std::string& filename) const
+{
+  LogoCacheParams params;
+  memset(&params, 0, sizeof(params));
+  params.max_features=max_features;
+  params.tolerance=tolerance;
+  params.shift=shift;
+  params.logo_set_count=logo_set_count;
+  params.set_count=logo_sets.size();
+  params.total_contour_length=total_contour_length;
+  params.rot_max=rot_max;
+  params.rot_step=rot_step;
+  params.centerx=centerx;
+  params.centery=centery;
+  params.origin=origin;
+
+  // the used logo contours (in feature order) followed by the reduced sets
+  std::vector <const Contours::Contour*> contours;
+  std::vector <std::pair<double, double> > centroids;
+  for (unsigned int i=0; i<logo_set_count; i++) {
+    contours.push_back(source->contours[logo_set_map[i]]);
+    centroids.push_back(std::pair<double, double>(.0, .0));
+  }
+  for (unsigned int s=0; s<logo_sets.size(); s++)
+    for (unsigned int i=0; i<logo_set_count; i++) {
+      contours.push_back(logo_sets[s][i].contour);
+      centroids.push_back(std::pair<double, double>(logo_sets[s][i].rx,
+						    logo_sets[s][i].ry));
+    }
+
+  FILE* f=fopen(filename.c_str(), "wb");
+  if (!f)
+    return false;
+  bool ret=WriteContourCache(f, ContourCacheLogo, &params, sizeof(params),
+			     contours, centroids);
+  if (fclose(f) != 0)
+    ret=false;
+  if (!ret)
+    remove(filename.c_str());
+  return ret;
+}
+
+LogoRepresentation* LogoRepresentation::Load(const std::string& filename)
+{
+  Utility::MappedFile file(filename);
+  const void* p=0;
+  uint32_t count=0;
+  const ContourCacheRecord* table=MapContourCache(file.Data(), file.Size(),
+						  ContourCacheLogo, sizeof(LogoCacheParams),
+						  p, count);
+  if (!table)
+    return 0;
+
+  const LogoCacheParams& params=*(const LogoCacheParams*)p;
+  if ((uint64_t)params.logo_set_count * (1 + params.set_count) != count)
+    return 0;
+
+  LogoRepresentation* rep=new LogoRepresentation();
+  rep->max_features=params.max_features;
+  rep->tolerance=params.tolerance;
+  rep->shift=params.shift;
+  rep->rot_max=params.rot_max;
+  rep->rot_step=params.rot_step;
+  rep->centerx=params.centerx;
+  rep->centery=params.centery;
+  rep->origin=params.origin;
+  rep->logo_set_count=params.logo_set_count;
+  rep->total_contour_length=params.total_contour_length;
+
+  rep->owned_source=rep->source=new Contours();
+  rep->logo_set_map.resize(rep->logo_set_count);
+  unsigned int r=0;
+  for (unsigned int i=0; i<rep->logo_set_count; i++, r++) {
+    rep->source->contours.push_back(new Contours::Contour());
+    LoadContourCacheRecord(file.Data(), table[r], *rep->source->contours.back());
+    rep->logo_set_map[i]=i;
+  }
+
+  rep->logo_sets.resize(params.set_count);
+  for (unsigned int s=0; s<params.set_count; s++) {
+    rep->logo_sets[s].resize(rep->logo_set_count);
+    for (unsigned int i=0; i<rep->logo_set_count; i++, r++) {
+      LogoContourData& data=rep->logo_sets[s][i];
+      data.contour=new Contours::Contour();
+      LoadContourCacheRecord(file.Data(), table[r], *data.contour);
+      data.rx=table[r].rx;
+      data.ry=table[r].ry;
+      data.n_to_n_match_index=0;
+    }
+  }
+
+  return rep;
+}
+
+bool LogoRepresentation::Matches(unsigned int max_feature_no,
+				 unsigned int max_avg_tolerance,
+				 unsigned int reduction_shift,
+				 double maximum_angle,
+				 double angle_step) const
+{
+  // normalized the same way as in the constructor
+  return max_features == max_feature_no &&
+    tolerance == max_avg_tolerance &&
+    shift == reduction_shift &&
+    rot_max == std::min(359.9, fabs(maximum_angle)) &&
+    rot_step == std::max(angle_step, 0.5);
 }
 
 double LogoRepresentation::Score(Contours* image)
 {
+  Profile::Scope profile ("contour matching");
   unsigned int image_set_count=image -> contours.size();
 
   if (image_set_count==0 || logo_set_count==0) {
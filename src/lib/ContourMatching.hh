@@ -14,8 +14,24 @@ public:
 
   ~LogoRepresentation();
 
+  // binary cache of the preprocessed (reduced and rotated) logo data,
+  // Load returns 0 if the file is missing, outdated or otherwise invalid
+  bool Save(const std::string& filename) const;
+  static LogoRepresentation* Load(const std::string& filename);
+  // whether a (loaded) representation was built with these parameters
+  bool Matches(unsigned int max_feature_no,
+	       unsigned int max_avg_tolerance,
+	       unsigned int reduction_shift,
+	       double maximum_angle,
+	       double angle_step) const;
+
   double Score(Contours* image);
 
+  // identifies the logo the contours were extracted from, and how (e.g.
+  // a hash of the file, its modification time and the thresholds), 0 if
+  // unknown - stored in the cache to tell whether it is still current
+  uint64_t origin;
+
   // updated after call to score
   std::pair<int, int> logo_translation;
   double rot_angle;
@@ -28,6 +44,8 @@ public:
 protected:
   friend class MatchSorter;
 
+  LogoRepresentation(); // for Load
+
   double N_M_Match(unsigned int set, unsigned int& pivot);
   double PrecisionScore();
 
@@ -38,6 +56,8 @@ protected:
   bool Optimize(double& score);
 
   Contours* source;
+  Contours* owned_source; // the logo contours restored from a cache
+  unsigned int max_features;
   unsigned int tolerance;
   unsigned int shift;
   double rot_max;
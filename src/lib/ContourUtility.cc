@@ -4,6 +4,9 @@
 //#include <iostream>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "MappedFile.hh"
 
 void CenterAndReduce(const Contours::Contour& source,
 		     Contours::Contour& dest,
@@ -384,3 +387,145 @@ bool ReadContourArray(FILE* f, std::vector <Contours::Contour*>& contours)
   }
   return true;
 }
+
+
+static const char contour_cache_magic[8] = {'E', 'I', 'C', 'N', 'T', 'R', 'S', 0};
+
+static inline uint64_t align8(uint64_t n)
+{
+  return (n + 7) & ~(uint64_t)7;
+}
+
+bool WriteContourCache(FILE* f, uint32_t kind,
+		       const void* params, uint32_t params_size,
+		       const std::vector <const Contours::Contour*>& contours,
+		       const std::vector <std::pair<double, double> >& centroids)
+{
+  const uint32_t n = contours.size();
+  const uint64_t params_offset = sizeof(ContourCacheHeader);
+  const uint64_t table_offset = params_offset + align8(params_size);
+  uint64_t data_offset = table_offset + (uint64_t)n * sizeof(ContourCacheRecord);
+
+  std::vector <ContourCacheRecord> table(n);
+  for (unsigned int i=0; i<n; i++) {
+    memset(&table[i], 0, sizeof(ContourCacheRecord));
+    table[i].offset=data_offset;
+    table[i].length=contours[i]->size();
+    if (i < centroids.size()) {
+      table[i].rx=centroids[i].first;
+      table[i].ry=centroids[i].second;
+    }
+    data_offset+=(uint64_t)table[i].length * 2 * sizeof(uint32_t);
+  }
+
+  ContourCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, contour_cache_magic, sizeof(header.magic));
+  header.version=ContourCacheVersion;
+  header.byte_order=0x01020304;
+  header.kind=kind;
+  header.params_size=params_size;
+  header.count=n;
+  header.size=data_offset;
+
+  static const char pad[8] = {0};
+  if (fwrite(&header, sizeof(header), 1, f) != 1)
+    return false;
+  if (params_size > 0) {
+    if (fwrite(params, params_size, 1, f) != 1)
+      return false;
+    if (align8(params_size) != params_size &&
+	fwrite(pad, align8(params_size) - params_size, 1, f) != 1)
+      return false;
+  }
+  if (n > 0 && fwrite(&table[0], sizeof(ContourCacheRecord), n, f) != n)
+    return false;
+
+  // points in bulk, one contour at a time
+  std::vector <uint32_t> points;
+  for (unsigned int i=0; i<n; i++) {
+    const Contours::Contour& c=*contours[i];
+    points.resize(2 * c.size());
+    for (unsigned int j=0; j<c.size(); j++) {
+      points[2*j]=c[j].first;
+      points[2*j+1]=c[j].second;
+    }
+    if (!points.empty() &&
+	fwrite(&points[0], sizeof(uint32_t), points.size(), f) != points.size())
+      return false;
+  }
+
+  return true;
+}
+
+const ContourCacheRecord* MapContourCache(const uint8_t* data, size_t size,
+					  uint32_t kind, uint32_t params_size,
+					  const void*& params, uint32_t& count)
+{
+  if (!data || size < sizeof(ContourCacheHeader))
+    return 0;
+
+  const ContourCacheHeader* header=(const ContourCacheHeader*)data;
+  if (memcmp(header->magic, contour_cache_magic, sizeof(header->magic)) != 0 ||
+      header->version != ContourCacheVersion ||
+      header->byte_order != 0x01020304 ||
+      header->kind != kind ||
+      header->params_size != params_size ||
+      header->size != size)
+    return 0;
+
+  // the file might be corrupt: compare without overflowing
+  const uint64_t table_offset=sizeof(ContourCacheHeader) + align8(params_size);
+  if (table_offset > size ||
+      header->count > (size - table_offset) / sizeof(ContourCacheRecord))
+    return 0;
+  const uint64_t table_end=table_offset +
+    (uint64_t)header->count * sizeof(ContourCacheRecord);
+
+  // the point data follows the table, 8 byte aligned
+  const ContourCacheRecord* table=(const ContourCacheRecord*)(data + table_offset);
+  for (unsigned int i=0; i<header->count; i++) {
+    const uint64_t offset=table[i].offset;
+    if (offset < table_end || offset > size || offset % 8 != 0 ||
+	table[i].length > (size - offset) / (2 * sizeof(uint32_t)))
+      return 0;
+  }
+
+  params=data + sizeof(ContourCacheHeader);
+  count=header->count;
+  return table;
+}
+
+void LoadContourCacheRecord(const uint8_t* data, const ContourCacheRecord& record,
+			    Contours::Contour& dest)
+{
+  // std::pair<unsigned int, unsigned int> is a plain pair of 32 bit values
+  typedef Contours::Contour::value_type point;
+  const point* p=(const point*)(data + record.offset);
+  dest.assign(p, p + record.length);
+}
+
+bool WriteContourArrayBinary(FILE* f, const std::vector <Contours::Contour*>& contours)
+{
+  std::vector <const Contours::Contour*> c(contours.begin(), contours.end());
+  return WriteContourCache(f, ContourCacheArray, 0, 0, c,
+			   std::vector <std::pair<double, double> >());
+}
+
+bool ReadContourArrayBinary(const std::string& filename, std::vector <Contours::Contour*>& contours)
+{
+  Utility::MappedFile file(filename);
+  const void* params=0;
+  uint32_t n=0;
+  const ContourCacheRecord* table=MapContourCache(file.Data(), file.Size(),
+						  ContourCacheArray, 0, params, n);
+  if (!table)
+    return false;
+
+  contours.resize(n);
+  for (unsigned int i=0; i<n; i++) {
+    contours[i]=new Contours::Contour;
+    LoadContourCacheRecord(file.Data(), table[i], *contours[i]);
+  }
+  return true;
+}
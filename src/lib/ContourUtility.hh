@@ -1,3 +1,7 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <string>
+
 #include "Contours.hh"
 
 void CenterAndReduce(const Contours::Contour& source,
@@ -45,3 +49,52 @@ bool ReadContour(FILE* f, Contours::Contour& dest);
 bool WriteContourArray(FILE* f, const std::vector <Contours::Contour*>& contours);
 bool ReadContourArray(FILE* f, std::vector <Contours::Contour*>& contours);
 
+
+// binary, memory mappable contour cache, loaded without parsing:
+//   header | kind specific parameters | record table | point data
+// points are stored as (uint32 x, uint32 y) pairs in host byte order,
+// all sections 8 byte aligned
+const uint32_t ContourCacheVersion = 2;
+
+enum {
+  ContourCacheArray = 1,
+  ContourCacheLogo = 2
+};
+
+struct ContourCacheHeader
+{
+  char magic[8]; // "EICNTRS\0"
+  uint32_t version;
+  uint32_t byte_order; // 0x01020304 as written by the host
+  uint32_t kind;
+  uint32_t params_size; // size of the kind specific parameter block
+  uint32_t count; // number of records
+  uint32_t reserved;
+  uint64_t size; // total file size, for sanity checking
+};
+
+struct ContourCacheRecord
+{
+  uint64_t offset; // of the point data, from the start of the file
+  uint32_t length; // in points
+  uint32_t reserved;
+  double rx; // centroid, if precomputed
+  double ry;
+};
+
+bool WriteContourCache(FILE* f, uint32_t kind,
+		       const void* params, uint32_t params_size,
+		       const std::vector <const Contours::Contour*>& contours,
+		       const std::vector <std::pair<double, double> >& centroids);
+
+// validates the mapped data and returns the record table, or 0
+const ContourCacheRecord* MapContourCache(const uint8_t* data, size_t size,
+					  uint32_t kind, uint32_t params_size,
+					  const void*& params, uint32_t& count);
+
+// a single bulk copy out of the mapped cache
+void LoadContourCacheRecord(const uint8_t* data, const ContourCacheRecord& record,
+			    Contours::Contour& dest);
+
+bool WriteContourArrayBinary(FILE* f, const std::vector <Contours::Contour*>& contours);
+bool ReadContourArrayBinary(const std::string& filename, std::vector <Contours::Contour*>& contours);
@@ -17,19 +17,58 @@
  */
  
 #include <string.h> // memcpy
+#include <stdlib.h>
+#include <assert.h>
 #include <iostream>
+#include <algorithm>
 
 #define DEPRECATED
 #include "Image.hh"
 #include "Codecs.hh"
+#include "BufferPool.hh"
+#include "Colorspace.hh"
+
+// the reference count might be touched by images in different threads
+static inline int atomic_add (volatile int* v, int d)
+{
+#if defined(__GNUC__)
+  return __sync_add_and_fetch (v, d);
+#else
+  return *v += d;
+#endif
+}
+
+// the reference count of the data, created by the first copy - which
+// might happen in several threads copying the same (const) image at once
+Image::shared_data* Image::share () const
+{
+  shared_data* s = shared;
+  if (s)
+    return s;
+  
+  s = new shared_data;
+  s->refs = 1;
+  s->base = data;
+  s->size = stride() * h;
+#if defined(__GNUC__)
+  if (!__sync_bool_compare_and_swap (&const_cast<Image*>(this)->shared,
+				     (shared_data*)0, s)) {
+    delete s; // another thread was first
+    s = shared;
+  }
+#else
+  const_cast<Image*>(this)->shared = s;
+#endif
+  return s;
+}
 
 Image::Image ()
-  : modified(false), meta_modified(false), xres(0), yres(0), codec(0), data(0), w(0), h(0), bps(0), spp(0)
+  : modified(false), meta_modified(false), xres(0), yres(0), codec(0), data(0), shared(0), rowstride(0), bitoffset(0), w(0), h(0), bps(0), spp(0)
 {
 }
 
 Image::Image (Image& other)
-  : modified(false), meta_modified(false), xres(0), yres(0), codec(0), data(0), w(0), h(0), bps(0), spp(0)
+  : modified(false), meta_modified(false), xres(0), yres(0), codec(0), data(0), shared(0), rowstride(0), bitoffset(0), w(0), h(0), bps(0), spp(0)
 {
   operator= (other);
 }
@@ -40,8 +79,68 @@ Image::~Image () {
     delete (codec); codec = 0;
       
   // release POD
-  if (data)
-    free (data); data = 0;
+  releaseData ();
+}
+
+void Image::releaseData ()
+{
+  if (shared) {
+    if (atomic_add (&shared->refs, -1) == 0) {
+      BufferPool::Release (shared->base);
+      delete shared;
+    }
+    shared = 0;
+  }
+  else if (data)
+    BufferPool::Release (data);
+  data = 0;
+  rowstride = bitoffset = 0;
+}
+
+// copy the (sub-image) rows into a new, packed buffer
+static uint8_t* packRows (const uint8_t* src, int src_stride, int bitoffset,
+			  int row_bits, int h)
+{
+  const int stride = (row_bits + 7) / 8;
+  // do not read beyond the last byte of a row (and thus the buffer)
+  const int src_bytes = (bitoffset + row_bits + 7) / 8;
+  uint8_t* dst = (uint8_t*) BufferPool::Allocate (stride * h);
+  for (int y = 0; y < h; ++y, src += src_stride) {
+    uint8_t* d = dst + y * stride;
+    if (!bitoffset)
+      memcpy (d, src, stride);
+    else
+      for (int i = 0; i < stride; ++i) {
+	uint8_t v = src[i] << bitoffset;
+	if (i + 1 < src_bytes)
+	  v |= src[i + 1] >> (8 - bitoffset);
+	d[i] = v;
+      }
+  }
+  return dst;
+}
+
+void Image::unshare ()
+{
+  if (!shared)
+    return;
+  
+  if (isView ()) {
+    // only the region of the view, packed
+    uint8_t* copy = packRows (data, stride (), bitoffset, w * spp * bps, h);
+    releaseData ();
+    data = copy;
+  }
+  else if (shared->refs > 1) {
+    uint8_t* copy = (uint8_t*) BufferPool::Allocate (shared->size);
+    memcpy (copy, data, shared->size);
+    releaseData ();
+    data = copy;
+  }
+  else { // the last one holding it
+    delete shared;
+    shared = 0;
+  }
 }
 
 void Image::copyMeta (const Image& other)
@@ -52,47 +151,157 @@ void Image::copyMeta (const Image& other)
   spp = other.spp;
   xres = other.xres;
   yres = other.yres;
+  palette = other.palette;
+}
+
+void Image::setPalette (int entries, const uint16_t* r,
+			const uint16_t* g, const uint16_t* b)
+{
+  palette.resize (3 * entries);
+  std::copy (r, r + entries, palette.begin());
+  std::copy (g, g + entries, palette.begin() + entries);
+  std::copy (b, b + entries, palette.begin() + 2 * entries);
+  setRawData ();
+}
+
+Image* Image::iteratorImage (Image* image)
+{
+  if (image->isIndexed ())
+    colorspace_de_palette (*image);
+  // unshare (and pack views) now, before the iterator takes the stride
+  image->getRawData ();
+  return image;
+}
+
+const Image* Image::iteratorImage (const Image* image)
+{
+  // must not change the caller's image, which might also be read by
+  // other threads: expand it first, or use a non-const iterator
+  assert (!image->isIndexed ());
+  return image;
 }
 
 Image& Image::operator= (const Image& other)
 {
+  if (&other == this)
+    return *this;
+  
   copyMeta (other);
   
-  uint8_t* d = other.getRawData();
+  uint8_t* d = const_cast<uint8_t*> (other.getConstRawData());
   if (d) {
-    resize (w, h);
-    memcpy (data, d, stride() * h);
-  }
-  else {
-    setRawData();
+    if (d != data) {
+      // share the data, copy on write
+      shared_data* s = other.share ();
+      atomic_add (&s->refs, 1);
+      
+      releaseData ();
+      data = d;
+      shared = s;
+    }
+    rowstride = other.rowstride;
+    bitoffset = other.bitoffset;
   }
+  setRawData();
   
   return *this;
 }
 
+void Image::subImage (const Image& other, int x, int y, unsigned int _w, unsigned int _h)
+{
+  // limit to valid boundaries
+  if (x < 0) { _w += x; x = 0; }
+  if (y < 0) { _h += y; y = 0; }
+  x = std::min (x, other.w);
+  y = std::min (y, other.h);
+  _w = std::min (_w, (unsigned int)(other.w - x));
+  _h = std::min (_h, (unsigned int)(other.h - y));
+  
+  if (&other != this)
+    operator= (other); // share
+  if (!data)
+    return;
+  
+  // the view's data points into the allocation, track it
+  share ();
+  
+  const int bits = bitoffset + x * spp * bps;
+  const int stride = this->stride ();
+  
+  data += y * stride + bits / 8;
+  bitoffset = bits % 8;
+  rowstride = stride;
+  w = _w;
+  h = _h;
+  
+  // packed rows need no row stride, still a view unless at the start
+  if (!bitoffset && rowstride == packedStride ())
+    rowstride = 0;
+  
+  setRawData ();
+}
+
 void Image::copyTransferOwnership (Image& other)
 {
   copyMeta (other);
-
-  uint8_t* d = other.getRawData();
-  other.setRawDataWithoutDelete (0);
-  setRawData (d);
+  if (&other == this)
+    return;
+  
+  // pass the (maybe shared) data on as is
+  uint8_t* d = const_cast<uint8_t*> (other.getConstRawData());
+  shared_data* s = other.shared;
+  const int _rowstride = other.rowstride, _bitoffset = other.bitoffset;
+  other.data = 0;
+  other.shared = 0;
+  other.rowstride = other.bitoffset = 0;
+  other.setRawData ();
+  
+  releaseData ();
+  data = d;
+  shared = s;
+  rowstride = _rowstride;
+  bitoffset = _bitoffset;
+  setRawData ();
 }
 
 uint8_t* Image::getRawData () const {
+  Image* image = const_cast<Image*>(this);
   // ask codec about it
   if (!data && codec) {
-    Image* image = const_cast<Image*>(this);
     codec->decodeNow (image);
     if (data) // if data was added
       image->modified = false;
   }
+  // about to be written, copy on write
+  if (shared)
+    image->unshare ();
   return data;
 }
 
 uint8_t* Image::getRawDataEnd () const {
   // we call getRawData as it might have to query the codec to actually load it
-  return getRawData() + h * stride();
+  uint8_t* d = getRawData(); // packs views, before the stride is taken
+  return d + h * stride();
+}
+
+const uint8_t* Image::getConstRawData () const {
+  if (!data && codec) {
+    Image* image = const_cast<Image*>(this);
+    codec->decodeNow (image);
+    if (data)
+      image->modified = false;
+  }
+  return data;
+}
+
+const uint8_t* Image::getConstRawDataEnd () const {
+  return getConstRawData() + h * stride();
+}
+
+const uint8_t* Image::getConstAlignedRawData () const {
+  if (bitoffset)
+    return getRawData ();
+  return getConstRawData ();
 }
 
 void Image::setRawData () {
@@ -104,16 +313,25 @@ void Image::setRawData () {
 }
 
 void Image::setRawData (uint8_t* _data) {
-  if (_data != data && data) {
-    free (data);
-    data = 0;
-  }
+  if (_data != data && data)
+    releaseData ();
 
   // reuse:
   setRawDataWithoutDelete (_data);
 }
 
 void Image::setRawDataWithoutDelete (uint8_t* _data) {
+  // give up our reference, the caller took over the ownership
+  if (_data != data && shared) {
+    if (atomic_add (&shared->refs, -1) == 0) {
+      if (data != shared->base) // a view, nobody else could own it
+	BufferPool::Release (shared->base);
+      delete shared;
+    }
+    shared = 0;
+  }
+  if (_data != data)
+    rowstride = bitoffset = 0;
   data = _data;
   
   // reuse
@@ -121,10 +339,23 @@ void Image::setRawDataWithoutDelete (uint8_t* _data) {
 }
 
 void Image::resize (int _w, int _h) {
+  // views can not be extended in-place
+  if (isView ())
+    unshare ();
+  
   w = _w;
   h = _h;
   
-  setRawDataWithoutDelete((uint8_t*)::realloc(data, stride() * h));
+  if (shared) {
+    // leave the shared data alone, just take over what still fits
+    const size_t size = stride() * h;
+    uint8_t* d = (uint8_t*) BufferPool::Allocate (size);
+    memcpy (d, data, std::min (size, shared->size));
+    setRawData (d);
+    return;
+  }
+  
+  setRawDataWithoutDelete((uint8_t*)BufferPool::Reallocate(data, stride() * h));
 }
 
 void Image::realloc () {
@@ -135,7 +366,7 @@ void Image::realloc () {
   resize(w, h); // realloc, supposed to shrink
 #else
   // the OS allocator may not shrink the buffer, though that may be important for the application, ...
-  uint8_t* newdata = (uint8_t*)malloc(stride() * h);
+  uint8_t* newdata = (uint8_t*)BufferPool::Allocate(stride() * h);
   if (newdata) {
     memcpy(newdata, data, stride() * h);
     setRawData(newdata);
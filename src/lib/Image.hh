@@ -65,10 +65,28 @@
  *       just copy existing compressed data (e.g. DCT)
  *     end
  *
- * The operator= create a complete clone of the image, the image
- * buffers are not shared (anymore, formerly ownership was passed and
- * we had a seperate Clone() method). The attached codec is not
- * copied.
+ * The operator= creates a cheap copy of the image: the pixel buffer
+ * is reference counted and shared until one of the images asks for
+ * write access via getRawData(), which then duplicates the data
+ * (copy on write). Pure readers should use getConstRawData() which
+ * never copies. The attached codec is not copied. Threads may copy the
+ * same (const) image at the same time.
+ *
+ * Attention: the pointer returned by getConstRawData() may be shared
+ * with other images, it must not be written to or passed to free().
+ *
+ * subImage() makes an image a view into a region of another image's
+ * pixel data, without copying: the rows are then stride() apart and
+ * sub-byte pixel rows might start at a bitOffset(). Read-only users
+ * must honor both, write access via getRawData() transparently copies
+ * the region into a packed buffer of its own first.
+ *
+ * Indexed (palette) images keep their 1, 2, 4 or 8 bit samples as
+ * indices into the attached palette. Only the palette aware algorithms
+ * (crop, flip, rotation by multiples of 90 degree, nearest scaling)
+ * and codecs work on them directly, colorspace_de_palette() expands
+ * them to gray or RGB for all others. The (non-const) iterators do so
+ * implicitly, const iterators require an expanded image.
  */
 
 #ifndef IMAGE_HH
@@ -76,6 +94,7 @@
 
 #include <inttypes.h>
 #include <string>
+#include <vector>
 #include <math.h> // for floor
 
 #include <iostream>
@@ -105,11 +124,45 @@ protected:
   
   uint8_t* data;
 
+  // reference count of copy-on-write shared pixel data, 0 if exclusive
+  struct shared_data {
+    volatile int refs;
+    uint8_t* base; // allocation, data may point into it (sub-image)
+    size_t size;
+  };
+  shared_data* shared;
+  
+  // sub-image view layout, 0 for ordinary, packed data
+  int rowstride, bitoffset;
+  
+  // color map of indexed images: red, green and blue planes
+  std::vector<uint16_t> palette;
+
+  shared_data* share () const;
+  void unshare ();
+  void releaseData ();
+
 public:
   
+  // write access, duplicates the pixel data if it is shared
   uint8_t* getRawData () const;
   uint8_t* getRawDataEnd () const;
 
+  // read-only access, never copies
+  const uint8_t* getConstRawData () const;
+  const uint8_t* getConstRawDataEnd () const;
+  // read-only, but with byte aligned rows - only copies views with a bitOffset()
+  const uint8_t* getConstAlignedRawData () const;
+
+  bool isShared () const { return shared && shared->refs > 1; }
+  // also packed regions, e.g. just the height cut, not at the allocation start
+  bool isView () const {
+    return rowstride || bitoffset || (shared && data != shared->base);
+  }
+  
+  // zero-copy view into the region of the other image (clipped to it)
+  void subImage (const Image& other, int x, int y, unsigned int w, unsigned int h);
+
   void setRawData (); // just mark modified
   void setRawData (uint8_t* _data);
   void setRawDataWithoutDelete (uint8_t* _data);
@@ -206,9 +259,15 @@ public:
   int height () const { return h; }
   
   int stride () const {
-    return (w * spp * bps + 7) / 8;
+    return rowstride ? rowstride : packedStride ();
   }
   
+  // of the data once unshared, views are then packed
+  int packedStride () const { return (w * spp * bps + 7) / 8; }
+  
+  // of the first pixel in each row, for sub-byte views
+  int bitOffset () const { return bitoffset; }
+  
   int Stride () const DEPRECATED {
     return stride ();
   }
@@ -234,6 +293,19 @@ public:
   }
   void setResolutionX (int _xres) { setResolution(_xres, yres); }
   void setResolutionY (int _yres) { setResolution(xres, _yres); }
+  
+  // 16 bit per channel entries, as in TIFF's ColorMap
+  bool isIndexed () const {
+    return !palette.empty() && spp == 1 && bps <= 8;
+  }
+  int paletteSize () const { return palette.size() / 3; }
+  const uint16_t* paletteRed () const { return &palette[0]; }
+  const uint16_t* paletteGreen () const { return &palette[paletteSize()]; }
+  const uint16_t* paletteBlue () const { return &palette[2 * paletteSize()]; }
+  
+  void setPalette (int entries, const uint16_t* r,
+		   const uint16_t* g, const uint16_t* b);
+  void clearPalette () { palette.clear (); }
 
   /* TODO: should be unsigned */
   int w DEPRECATED, h DEPRECATED, bps DEPRECATED, spp DEPRECATED;
@@ -264,6 +336,18 @@ public:
     }
   }
 
+  // the iterators only need write access if they are not const
+  static uint8_t* iteratorData (Image* image) {
+    return image->getRawData ();
+  }
+  static uint8_t* iteratorData (const Image* image) {
+    return const_cast<uint8_t*> (image->getConstRawData ());
+  }
+  // the iterators only know direct colors: expands indexed images, the
+  // const ones can not and must not be used on them
+  static Image* iteratorImage (Image* image);
+  static const Image* iteratorImage (const Image* image);
+
 #define CONST const
 #include "ImageIterator.hh"
 #include "ImageIterator.hh"
@@ -17,21 +17,27 @@
     value_t* ptr;
     signed int bitpos; // for 1bps sub-position
     
+    // sub-image views: bytes to skip at the end of each row and the
+    // bitpos of the first pixel of a row
+    int pad, bit0;
+    
     // for seperate use, e.g. to accumulate
     iterator ()
     {};
     
     iterator (CONST Image* _image, bool end)
-      : image (_image), type (_image->Type()),
-	stride (_image->stride()), width (image->w)
+      : image (iteratorImage (_image)), type (_image->Type()),
+	stride (_image->stride()), width (image->w),
+	pad (stride - (_image->bitOffset() + width * _image->bitsPerPixel() + 7) / 8),
+	bit0 (7 - _image->bitOffset())
     {
       if (!end) {
-	ptr = (value_t*) image->getRawData();
+	ptr = (value_t*) iteratorData(image);
 	_x = 0;
-	bitpos = 7;
+	bitpos = bit0;
       }
       else {
-	ptr = (value_t*) image->getRawDataEnd();
+	ptr = (value_t*) (iteratorData(image) + stride * image->h);
 	_x = width;
 	// TODO: bitpos= ...
       }
@@ -39,7 +45,7 @@
 
     value_t* end_ptr() const
     {
-        return (value_t*) image->getRawDataEnd();
+        return (value_t*) (image->data + stride * image->h);
     }
 
     inline void clear () {
@@ -70,22 +76,17 @@
     
     inline iterator at (int x, int y) {
       iterator tmp = *this;
+      tmp._x = x;
       
       switch (type) {
       case GRAY1:
-	tmp.ptr = (value_t*) (image->data + stride * y + x / 8);
-	tmp.bitpos = 7 - x % 8;
-	tmp._x = x;
-	break;
       case GRAY2:
-	tmp.ptr = (value_t*) (image->data + stride * y + x / 4);
-	tmp.bitpos = 7 - (x % 4) * 2;
-	tmp._x = x;
-	break;
       case GRAY4:
-	tmp.ptr = (value_t*) (image->data + stride * y + x / 2);
-	tmp.bitpos = 7 - (x % 2) * 4;
-	tmp._x = x;
+	{
+	  const int bit = 7 - bit0 + x * image->bps;
+	  tmp.ptr = (value_t*) (image->data + stride * y + bit / 8);
+	  tmp.bitpos = 7 - bit % 8;
+	}
 	break;
       case GRAY8:
 	tmp.ptr = (value_t*) (image->data + stride * y + x);
@@ -282,7 +283,7 @@
       return *this;
     }
     
-    inline iterator& operator- (const iterator& other) const {
+    inline iterator operator- (const iterator& other) const {
       iterator tmp = *this;
       return tmp -= other;
     }
@@ -368,7 +369,7 @@
       return *this;
     }
 
-    inline iterator& operator/ (const int v) const {
+    inline iterator operator/ (const int v) const {
       iterator tmp = *this;
       return tmp /= v;
     }
@@ -421,28 +422,40 @@
       case GRAY1:
 	--bitpos; ++_x;
 	if (bitpos < 0 || _x == width) {
-	  bitpos = 7;
-	  if (_x == width)
-	    _x = 0;
 	  ptr = (value_t*) ((uint8_t*) ptr + 1);
+	  if (_x == width) {
+	    _x = 0;
+	    ptr = (value_t*) ((uint8_t*) ptr + pad);
+	    bitpos = bit0;
+	  }
+	  else
+	    bitpos = 7;
 	}
 	break;
       case GRAY2:
 	bitpos -= 2; ++_x;
 	if (bitpos < 0 || _x == width) {
-	  bitpos = 7;
-	  if (_x == width)
-	    _x = 0;
 	  ptr = (value_t*) ((uint8_t*) ptr + 1);
+	  if (_x == width) {
+	    _x = 0;
+	    ptr = (value_t*) ((uint8_t*) ptr + pad);
+	    bitpos = bit0;
+	  }
+	  else
+	    bitpos = 7;
 	}
 	break;
       case GRAY4:
 	bitpos -= 4; ++_x;
 	if (bitpos < 0 || _x == width) {
-	  bitpos = 7;
-	  if (_x == width)
-	    _x = 0;
 	  ptr = (value_t*) ((uint8_t*) ptr + 1);
+	  if (_x == width) {
+	    _x = 0;
+	    ptr = (value_t*) ((uint8_t*) ptr + pad);
+	    bitpos = bit0;
+	  }
+	  else
+	    bitpos = 7;
 	}
 	break;
       case GRAY8:
@@ -462,6 +475,11 @@
       default:
 	WARN_UNHANDLED;
       }
+      // padded rows of sub-image views
+      if (pad && type > GRAY4 && ++_x == width) {
+	_x = 0;
+	ptr = (value_t*) ((uint8_t*) ptr + pad);
+      }
       return *this;
     }
     
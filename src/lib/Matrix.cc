@@ -21,6 +21,8 @@
 
 #include "Matrix.hh"
 #include "Codecs.hh"
+#include "BufferPool.hh"
+#include "Profile.hh"
 
 #include "ImageIterator2.hh"
 
@@ -114,6 +116,7 @@ struct convolution_matrix_template
 void convolution_matrix (Image& image, const matrix_type* m, int xw, int yw,
 			 matrix_type divisor)
 {
+  Profile::Scope profile ("convolution", (uint64_t)image.stride() * image.h);
   codegen<convolution_matrix_template> (image, m, xw, yw, divisor);
 }
 
@@ -122,9 +125,9 @@ void decomposable_sym_convolution_matrix (Image& image,
 					  const matrix_type* h_matrix, const matrix_type* v_matrix,
 					  int xw, int yw, matrix_type src_add)
 {
+  Profile::Scope profile ("convolution decomposable", (uint64_t)image.stride() * image.h);
   int bps = image.bitsPerSample();
   int spp = image.samplesPerPixel();
-  int stride = image.stride();
   int height = image.height();
 
   // TODO: support for 16 bit
@@ -134,9 +137,10 @@ void decomposable_sym_convolution_matrix (Image& image,
   }
 
   uint8_t* data = image.getRawData();
+  int stride = image.stride();
 
-  matrix_type* tmp_data = (matrix_type*)malloc (stride * (1+(2*yw)) * sizeof(matrix_type));
-  matrix_type* line_data = (matrix_type*)malloc (std::max(stride, height) * sizeof(matrix_type));
+  matrix_type* tmp_data = (matrix_type*)BufferPool::Allocate (stride * (1+(2*yw)) * sizeof(matrix_type));
+  matrix_type* line_data = (matrix_type*)BufferPool::Allocate (std::max(stride, height) * sizeof(matrix_type));
 
   uint8_t* src_ptr;
   matrix_type* tmp_ptr;
@@ -219,8 +223,8 @@ void decomposable_sym_convolution_matrix (Image& image,
   }
 
   image.setRawData(); // invalidate as altered
-  free(tmp_data);
-  free(line_data);
+  BufferPool::Release (tmp_data);
+  BufferPool::Release (line_data);
 }
 
 
@@ -229,8 +233,9 @@ void decomposable_convolution_matrix (Image& image,
 				      int xw, int yw,
 				      matrix_type src_add)
 {
+  Profile::Scope profile ("convolution decomposable", (uint64_t)image.stride() * image.h);
   uint8_t* data = image.getRawData();
-  matrix_type* tmp_data = (matrix_type*) malloc (image.w * image.h * sizeof(matrix_type));
+  matrix_type* tmp_data = (matrix_type*) BufferPool::Allocate (image.w * image.h * sizeof(matrix_type));
   
   const int xr = xw / 2;
   const int yr = yw / 2;
@@ -274,5 +279,5 @@ void decomposable_convolution_matrix (Image& image,
   }
 
   image.setRawData(); // invalidate as altered
-  free (tmp_data);
+  BufferPool::Release (tmp_data);
 }
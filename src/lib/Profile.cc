@@ -0,0 +1,217 @@
+/*
+ * Per stage profiling of the library operations.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+#include <time.h>
+#include <pthread.h>
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+
+#include "Profile.hh"
+#include "BufferPool.hh"
+#include "Timer.hh"
+
+volatile bool Profile::enabled = false;
+
+namespace {
+
+  struct Event
+  {
+    std::string name;
+    int thread;
+    uint64_t start, wall, cpu, bytes, allocations;
+  };
+
+  struct Stage
+  {
+    Stage () : calls (0), wall (0), cpu (0), bytes (0), allocations (0) {}
+    uint64_t calls, wall, cpu, bytes, allocations;
+  };
+
+  pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  struct Lock {
+    Lock () { pthread_mutex_lock (&profile_mutex); }
+    ~Lock () { pthread_mutex_unlock (&profile_mutex); }
+  };
+
+  // never destructed, images might be written in static destructors
+  std::vector<Event>& events ()
+  {
+    static std::vector<Event>* e = new std::vector<Event>;
+    return *e;
+  }
+
+  // numbered in order of appearance, for the trace
+  std::vector<pthread_t>& threads ()
+  {
+    static std::vector<pthread_t>* t = new std::vector<pthread_t>;
+    return *t;
+  }
+
+  Utility::Timer& clock_base ()
+  {
+    static Utility::Timer* t = new Utility::Timer;
+    return *t;
+  }
+
+  uint64_t cpu_time ()
+  {
+    return (uint64_t)clock () * 1000000 / CLOCKS_PER_SEC;
+  }
+
+  uint64_t buffer_allocations ()
+  {
+    const BufferPool::Stats s = BufferPool::GetStats ();
+    return s.hits + s.misses;
+  }
+
+  std::string json_string (const std::string& s)
+  {
+    std::string r = "\"";
+    for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
+      if (*it == '"' || *it == '\\')
+	r += '\\';
+      if ((unsigned char)*it >= ' ')
+	r += *it;
+    }
+    return r + "\"";
+  }
+}
+
+void Profile::Enable (bool enable)
+{
+  if (enable && !enabled)
+    clock_base ();
+  enabled = enable;
+}
+
+void Profile::Reset ()
+{
+  Lock lock;
+  events().clear ();
+}
+
+Profile::Scope::Scope (const char* _name, uint64_t _bytes)
+  : active (enabled), name (_name), bytes (_bytes)
+{
+  if (!active)
+    return;
+  allocations = buffer_allocations ();
+  cpu = cpu_time ();
+  wall = clock_base().Delta ();
+}
+
+Profile::Scope::~Scope ()
+{
+  if (!active)
+    return;
+
+  Event e;
+  e.start = wall;
+  e.wall = clock_base().Delta () - wall;
+  e.cpu = cpu_time () - cpu;
+  e.allocations = buffer_allocations () - allocations;
+  e.bytes = bytes;
+  e.name = name;
+  if (!detail.empty())
+    e.name += " " + detail;
+
+  const pthread_t self = pthread_self ();
+  Lock lock;
+  std::vector<pthread_t>& t = threads ();
+  for (e.thread = 0; e.thread < (int)t.size(); ++e.thread)
+    if (pthread_equal (t[e.thread], self))
+      break;
+  if (e.thread == (int)t.size())
+    t.push_back (self);
+  events().push_back (e);
+}
+
+bool Profile::WriteTrace (std::ostream& os)
+{
+  Lock lock;
+  const std::vector<Event>& e = events ();
+
+  os << "{\"traceEvents\":[";
+  for (unsigned i = 0; i < e.size(); ++i)
+    os << (i ? ",\n" : "\n")
+       << "{\"name\":" << json_string (e[i].name)
+       << ",\"cat\":\"exactimage\",\"ph\":\"X\",\"pid\":1"
+       << ",\"tid\":" << e[i].thread
+       << ",\"ts\":" << e[i].start << ",\"dur\":" << e[i].wall
+       << ",\"args\":{\"cpu_us\":" << e[i].cpu
+       << ",\"bytes\":" << e[i].bytes
+       << ",\"allocations\":" << e[i].allocations << "}}";
+  os << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+  return os.good ();
+}
+
+bool Profile::WriteTrace (const std::string& filename)
+{
+  std::ofstream os (filename.c_str());
+  return os && WriteTrace (os);
+}
+
+void Profile::PrintSummary (std::ostream& os)
+{
+  std::map<std::string, Stage> stages;
+  {
+    Lock lock;
+    const std::vector<Event>& e = events ();
+    for (unsigned i = 0; i < e.size(); ++i) {
+      Stage& s = stages[e[i].name];
+      ++s.calls;
+      s.wall += e[i].wall;
+      s.cpu += e[i].cpu;
+      s.bytes += e[i].bytes;
+      s.allocations += e[i].allocations;
+    }
+  }
+
+  // most expensive first
+  std::vector<std::pair<uint64_t, std::string> > order;
+  for (std::map<std::string, Stage>::const_iterator it = stages.begin();
+       it != stages.end(); ++it)
+    order.push_back (std::make_pair (it->second.wall, it->first));
+  std::sort (order.rbegin(), order.rend());
+
+  const std::ios::fmtflags flags = os.flags ();
+  const std::streamsize precision = os.precision ();
+  os << std::left << std::setw (24) << "stage" << std::right
+     << std::setw (8) << "calls" << std::setw (12) << "wall ms"
+     << std::setw (12) << "cpu ms" << std::setw (10) << "MB"
+     << std::setw (10) << "MB/s" << std::setw (8) << "allocs" << std::endl;
+  os << std::fixed << std::setprecision (1);
+  for (unsigned i = 0; i < order.size(); ++i) {
+    const Stage& s = stages[order[i].second];
+    const double mb = s.bytes / 1e6;
+    os << std::left << std::setw (24) << order[i].second << std::right
+       << std::setw (8) << s.calls
+       << std::setw (12) << s.wall / 1e3 << std::setw (12) << s.cpu / 1e3
+       << std::setw (10) << mb
+       << std::setw (10) << (s.wall ? mb * 1e6 / s.wall : 0.0)
+       << std::setw (8) << s.allocations << std::endl;
+  }
+  os.flags (flags);
+  os.precision (precision);
+}
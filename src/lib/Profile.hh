@@ -0,0 +1,75 @@
+/*
+ * Per stage profiling of the library operations.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* The codecs and the larger image operations mark their work with a
+ * Profile::Scope. Always compiled in, but disabled by default, when
+ * disabled a scope only costs a branch.
+ *
+ * When enabled each scope records its wall time, the process CPU time
+ * (including all threads, e.g. of OpenMP loops), the bytes of pixel
+ * data it touched and the BufferPool allocations while it ran. Nested
+ * scopes are reported inclusive. The events can be written as Chrome
+ * trace (for chrome://tracing or Perfetto) and summarized per stage.
+ */
+
+#ifndef PROFILE_HH
+#define PROFILE_HH
+
+#include <inttypes.h>
+
+#include <string>
+#include <iosfwd>
+
+class Profile
+{
+public:
+  static void Enable (bool enable = true);
+  static bool Enabled () { return enabled; }
+  // drop the events recorded so far
+  static void Reset ();
+
+  class Scope
+  {
+  public:
+    Scope (const char* name, uint64_t bytes = 0);
+    ~Scope ();
+
+    // if only known at the end, e.g. after decoding
+    void Bytes (uint64_t bytes) { this->bytes = bytes; }
+    // appended to the name, e.g. the codec
+    void Detail (const std::string& detail) { if (active) this->detail = detail; }
+
+  private:
+    bool active;
+    const char* name;
+    std::string detail;
+    uint64_t bytes;
+    uint64_t wall, cpu, allocations;
+  };
+
+  // Chrome trace event format (JSON)
+  static bool WriteTrace (std::ostream& os);
+  static bool WriteTrace (const std::string& filename);
+  // calls, wall and CPU time, MB and MB/s, allocations per stage
+  static void PrintSummary (std::ostream& os);
+
+private:
+  static volatile bool enabled;
+};
+
+#endif
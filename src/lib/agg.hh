@@ -16,6 +16,10 @@
  * copyright holder ExactCODE GmbH Germany.
  */
 
+#include <string.h>
+
+#include <algorithm>
+
 #include <agg_pixfmt_rgb.h>
 
 #include <agg_rendering_buffer.h>
@@ -103,7 +107,18 @@ public:
   unsigned height() const { return m_img->h; }
   
   //--------------------------------------------------------------------
-  bool clip_box(int x1, int y1, int x2, int y2);
+  bool clip_box(int x1, int y1, int x2, int y2)
+  {
+    rect_i cb (x1, y1, x2, y2);
+    cb.normalize ();
+    if (cb.clip (rect_i (0, 0, width() - 1, height() - 1)))
+      {
+	m_clip_box = cb;
+	return true;
+      }
+    m_clip_box = rect_i (1, 1, 0, 0);
+    return false;
+  }
   
   //--------------------------------------------------------------------
   void reset_clipping(bool visibility);
@@ -145,6 +160,9 @@ public:
   void blend_pixel(int x, int y, const color_type& c, cover_type cover)
   {
     // used in solid, primitive lines
+    if (blend_span (x, y, 1, c, c.a, 0))
+      return;
+    
     Image::iterator it = m_img->begin();
     it = it.at (x, y);
     
@@ -155,7 +173,33 @@ public:
   color_type pixel(int x, int y) const;
 
   //--------------------------------------------------------------------
-  void copy_hline(int x1, int y, int x2, const color_type& c);
+  void copy_hline(int x1, int y, int x2, const color_type& c)
+  {
+    if(x1 > x2) { int t = x2; x2 = x1; x1 = t; }
+    if(y  > ymax()) return;
+    if(y  < ymin()) return;
+    if(x1 > xmax()) return;
+    if(x2 < xmin()) return;
+    
+    if(x1 < xmin()) x1 = xmin();
+    if(x2 > xmax()) x2 = xmax();
+    
+    int len = x2 - x1 + 1;
+    // only differs from an opaque blend in storing the alpha as is
+    if (!(m_img->spp == 4 && c.a != color_type::base_mask) &&
+	blend_span (x1, y, len, c, color_type::base_mask, 0))
+      return;
+    
+    Image::iterator it = m_img->begin();
+    it = it.at (x1, y);
+    it.setRGBA ((uint16_t)c.r, (uint16_t)c.g, (uint16_t)c.b, (uint16_t)c.a);
+    do
+      {
+	it.set(it);
+	++it;
+      }
+    while(--len);
+  }
 
   //--------------------------------------------------------------------
   void copy_vline(int x, int y1, int y2, const color_type& c);
@@ -179,10 +223,13 @@ public:
       {
 	typedef color_type::calc_type calc_type;
 	
+	calc_type alpha = (calc_type(c.a) * (cover + 1)) >> 8;
+	if (blend_span (x1, y, len, c, alpha, 0))
+	  return;
+	
 	Image::iterator it = m_img->begin();
 	it = it.at (x1, y);
 	
-	calc_type alpha = (calc_type(c.a) * (cover + 1)) >> 8;
 	if(alpha == color_type::base_mask)
 	  {
 	    // ((value_type*)&v)[order_type::A] = c.a;
@@ -255,6 +302,9 @@ public:
       {
 	typedef color_type::calc_type calc_type;
 	
+	if (blend_span (x, y, len, c, c.a, covers))
+	  return;
+	
 	Image::iterator it = m_img->begin();
 	it = it.at (x, y);
 	do 
@@ -302,6 +352,13 @@ public:
       {
 	typedef color_type::calc_type calc_type;
 	
+	if (blend_span (x, y, 1, c, c.a, covers))
+	  {
+	    while (--len)
+	      blend_span (x, ++y, 1, c, c.a, ++covers);
+	    return;
+	  }
+	
 	Image::iterator it = m_img->begin();
 	
 	do 
@@ -379,7 +436,111 @@ public:
 		      cover_type cover = agg::cover_full);
 
 private:
-  
+
+  // Direct raster span blending for the common gray1, gray8, rgb8 and
+  // rgba8 layouts, with the same arithmetic as blend_pix and the
+  // iterator's gray conversion. The per pixel alpha is (alpha * (cover + 1)) >> 8 with covers,
+  // or alpha for the whole span without. Returns false for all other
+  // layouts, which need the generic Image::iterator.
+  bool blend_span (int x, int y, int len, const color_type& c,
+		   unsigned alpha, const cover_type* covers)
+  {
+    if (m_img->isIndexed ())
+      return false;
+
+    const int spp = m_img->spp, bps = m_img->bps;
+    if (!((spp == 1 && (bps == 1 || bps == 8)) ||
+	  ((spp == 3 || spp == 4) && bps == 8)))
+      return false;
+
+    // the write access may pack a view, only then the stride is final
+    uint8_t* data = m_img->getRawData ();
+    uint8_t* row = data + y * m_img->stride ();
+    const bool solid = !covers && alpha == color_type::base_mask;
+
+    if (spp == 1)
+      {
+	const unsigned l = (unsigned)(.21267 * c.r + .71516 * c.g + .07217 * c.b);
+
+	if (bps == 8)
+	  {
+	    uint8_t* p = row + x;
+	    if (solid)
+	      memset (p, l, len);
+	    else
+	      for (int i = 0; i < len; ++i) {
+		const unsigned a = covers ? (alpha * (covers[i] + 1)) >> 8 : alpha;
+		p[i] = blend_gray (p[i], c, a);
+	      }
+	    return true;
+	  }
+
+	// gray1, thresholded as set() does
+	int bit = m_img->bitOffset () + x;
+	if (solid)
+	  {
+	    const uint8_t v = (l >> 7) ? 0xff : 0x00;
+	    for (; len && (bit & 7); --len, ++bit)
+	      row[bit >> 3] = (row[bit >> 3] & ~(0x80 >> (bit & 7))) |
+		(v & (0x80 >> (bit & 7)));
+	    memset (row + (bit >> 3), v, len >> 3);
+	    bit += len & ~7; len &= 7;
+	    for (; len; --len, ++bit)
+	      row[bit >> 3] = (row[bit >> 3] & ~(0x80 >> (bit & 7))) |
+		(v & (0x80 >> (bit & 7)));
+	    return true;
+	  }
+
+	for (int i = 0; i < len; ++i, ++bit) {
+	  const unsigned a = covers ? (alpha * (covers[i] + 1)) >> 8 : alpha;
+	  uint8_t& byte = row[bit >> 3];
+	  const uint8_t mask = 0x80 >> (bit & 7);
+	  const unsigned v = blend_gray ((byte & mask) ? 0xff : 0x00, c, a);
+	  byte = (v >> 7) ? byte | mask : byte & ~mask;
+	}
+	return true;
+      }
+
+    uint8_t* p = row + x * spp;
+    if (solid)
+      {
+	// fill one pixel, then replicate it doubling the copied block,
+	// memcpy moves the large blocks vectorized
+	p[0] = c.r; p[1] = c.g; p[2] = c.b;
+	if (spp == 4) p[3] = color_type::base_mask;
+	const int bytes = len * spp;
+	for (int filled = spp; filled < bytes;) {
+	  const int n = std::min (filled, bytes - filled);
+	  memcpy (p + filled, p, n);
+	  filled += n;
+	}
+	return true;
+      }
+
+    for (int i = 0; i < len; ++i, p += spp) {
+      const unsigned a = covers ? (alpha * (covers[i] + 1)) >> 8 : alpha;
+      p[0] = blend_value (p[0], c.r, a);
+      p[1] = blend_value (p[1], c.g, a);
+      p[2] = blend_value (p[2], c.b, a);
+      if (spp == 4)
+	p[3] = (a + p[3]) - ((a * p[3] + color_type::base_mask) >> color_type::base_shift);
+    }
+    return true;
+  }
+
+  static inline uint8_t blend_value (int v, int c, int alpha)
+  {
+    return ((c - v) * alpha + (v << color_type::base_shift)) >> color_type::base_shift;
+  }
+
+  // the gray value blended as RGB, converted back as setRGB does
+  static inline uint8_t blend_gray (int v, const color_type& c, int alpha)
+  {
+    return (int)(.21267 * blend_value (v, c.r, alpha) +
+		 .71516 * blend_value (v, c.g, alpha) +
+		 .07217 * blend_value (v, c.b, alpha));
+  }
+
   Image* m_img;
   rect_i m_clip_box;
 };
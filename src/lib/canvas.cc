@@ -36,7 +36,7 @@ void append (Image& image, Image& other)
   image.resize(image.w, image.h + other.h);
   
   // copy raw content
+  const uint8_t* src = other.getRawData(); // packed rows
   memcpy(image.getRawData() + image.stride() * old_height,
-	 other.getRawData(),
-	 other.stride() * other.h);
+	 src, other.stride() * other.h);
 }
@@ -59,54 +59,24 @@ void crop (Image& image, int x, int y, unsigned int w, unsigned int h)
     return;
   }
   
-  // bit shifting is too expensive, crop at least byte-wide
-  int orig_bps = image.bps;
-  if (orig_bps < 8)
-    colorspace_grayX_to_gray8 (image);
-  
-  int stride = image.stride();
-  int cut_stride = stride * w / image.w;
-  
-  uint8_t* dst = image.getRawData ();
-  uint8_t* src = dst + stride * y + (stride * x / image.w);
-  
-  for (unsigned int i = 0; i < h; ++i) {
-    memmove (dst, src, cut_stride);
-    dst += cut_stride;
-    src += stride;
-  }
-  
-  image.setRawData (); // invalidate
-  image.w = w;
-  image.h = h;
- 
-  switch (orig_bps) {
-  case 1:
-    colorspace_gray8_to_gray1 (image);
-    break;
-  case 2:
-    colorspace_gray8_to_gray2 (image);
-    break;
-  case 4:
-    colorspace_gray8_to_gray4 (image);
-    break;
-  default:
-    ;
-  }
+  // zero-copy, just a view into the existing pixel data - the rows are
+  // only packed (copied) once somebody requests write access
+  image.subImage (image, x, y, w, h);
 }
 
 // auto crop just the bottom of an image filled in the same, solid color
 // optimization: for sub-byte depth we compare a 8bit pattern unit at-a-time
 void fastAutoCrop (Image& image)
 {
-  if (!image.getRawData())
+  if (!image.getConstAlignedRawData())
     return;
   
   const int stride = image.stride();
+  const int row_bytes = (image.w * image.spp * image.bps + 7) / 8;
   const unsigned int bytes = (image.spp * image.bps + 7) / 8;
   
   int h = image.h - 1;
-  uint8_t* data = image.getRawData() + stride * h;
+  const uint8_t* data = image.getConstAlignedRawData() + stride * h;
   
   // which value to compare against, first pixel of the last line
 #ifndef _MSC_VER
@@ -119,7 +89,7 @@ void fastAutoCrop (Image& image)
   for (; h >= 0; --h, data -= stride) {
     // data row
     int i = 0;
-    for (; i < stride; i += bytes)
+    for (; i < row_bytes; i += bytes)
       {
 	if (data[i] != v[0] ||
 	    (bytes > 1 && memcmp(&data[i+1], &v[1], bytes - 1) != 0)) {
@@ -127,7 +97,7 @@ void fastAutoCrop (Image& image)
 	}
       }
     
-    if (i != stride)
+    if (i < row_bytes)
       break; // non-solid line, break out
   }
   ++h; // we are at the line that differs
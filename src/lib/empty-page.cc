@@ -37,7 +37,7 @@ bool detect_empty_page (Image& im, double percent, int margin,
   if (margin % 8 != 0)
     margin -= margin % 8;
   
-  // TODO: optimize not to copy the pixel data on colorspace conversion
+  // cheap, copy on write - the conversions only allocate the reduced data
   Image image;
   image = im;
   
@@ -69,13 +69,15 @@ bool detect_empty_page (Image& im, double percent, int margin,
     bits_set[i] = bits;
   }
   
-  int stride = (image.w * image.bps * image.spp + 7) / 8;
-  
   // count pixels by table lookup
+  const uint8_t* data = image.getConstAlignedRawData();
+  // rows of sub-image views are further apart, after any alignment
+  const int stride = image.stride();
+  const int row_bytes = (image.w * image.bps * image.spp + 7) / 8;
+  
   int pixels = 0;
-  uint8_t* data = image.getRawData();
   for (int row = margin; row < image.h-margin; row++) {
-    for (int x = margin/8; x < stride - margin/8; x++) {
+    for (int x = margin/8; x < row_bytes - margin/8; x++) {
       int b = bits_set [ data[stride*row + x] ];
       // it is a bits_set table - and we want the zeros ...
       pixels += 8-b;
@@ -23,16 +23,17 @@
 
 void deinterlace (Image& image)
 {
+  uint8_t* data = image.getRawData();
   const int stride = image.stride();
   const int height = image.height();
-  uint8_t* deinterlaced = (uint8_t*) malloc(image.stride() * height);
+  uint8_t* deinterlaced = (uint8_t*) malloc(stride * height);
   
   for (int i = 0; i < height; ++i)
     {
       const int dst_i = i / 2 + (i % 2) * (height / 2);
       std::cerr << i << " - " << dst_i << std::endl;
       uint8_t* dst = deinterlaced + stride * dst_i;
-      uint8_t* src = image.getRawData() + stride * i;
+      uint8_t* src = data + stride * i;
       
       memcpy(dst, src, stride);
     }
@@ -44,6 +44,7 @@
 
 #include "Colorspace.hh"
 #include "Matrix.hh"
+#include "Profile.hh"
 
 #include "optimize2bw.hh"
 
@@ -53,6 +54,7 @@ void optimize2bw (Image& image, int low, int high, int threshold,
 		  int sloppy_threshold,
 		  int radius, double standard_deviation)
 {
+  Profile::Scope profile ("optimize2bw", (uint64_t)image.stride() * image.h);
   // do nothing if already at s/w, ...
   if (image.spp == 1 && image.bps == 1)
     return;
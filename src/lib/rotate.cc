@@ -24,18 +24,22 @@
 #include "Image.hh"
 #include "ImageIterator2.hh"
 #include "Codecs.hh"
+#include "BufferPool.hh"
+#include "Colorspace.hh"
+#include "Profile.hh"
 
 #include "rotate.hh"
 
 void flipX (Image& image)
 {
+  Profile::Scope profile ("flip x", (uint64_t)image.stride() * image.h);
   // thru the codec?
   if (!image.isModified() && image.getCodec())
     if (image.getCodec()->flipX(image))
       return;
   
-  const int stride = image.stride();
   uint8_t* data = image.getRawData();
+  const int stride = image.stride(); // packed by getRawData()
   switch (image.spp * image.bps)
     {
     case 1:
@@ -99,13 +103,14 @@ void flipX (Image& image)
 
 void flipY (Image& image)
 {
+  Profile::Scope profile ("flip y", (uint64_t)image.stride() * image.h);
   // thru the codec?
   if (!image.isModified() && image.getCodec())
     if (image.getCodec()->flipY(image))
       return;
   
-  const unsigned int bytes = image.stride();
   uint8_t* data = image.getRawData();
+  const unsigned int bytes = image.stride();
   for (int y = 0; y < image.h / 2; ++y)
     {
       int y2 = image.h - y - 1;
@@ -132,7 +137,7 @@ void rot90 (Image& image, int angle)
   int rot_stride = (image.h * image.spp * image.bps + 7) / 8;
    
   uint8_t* data = image.getRawData();
-  uint8_t* rot_data = (uint8_t*) malloc(rot_stride * image.w);
+  uint8_t* rot_data = (uint8_t*) BufferPool::Allocate(rot_stride * image.w);
   
   switch (image.spp * image.bps)
     {
@@ -213,7 +218,7 @@ void rot90 (Image& image, int angle)
     default:
       std::cerr << "rot90: unsupported depth. spp: "
 		<< image.spp << ", bpp:" << image.bps << std::endl;
-      free (rot_data);
+      BufferPool::Release (rot_data);
       return;
     }
   
@@ -244,6 +249,8 @@ struct rotate_template
     const float cached_sin = sin (angle);
     const float cached_cos = cos (angle);
   
+    // the per thread iterators must not copy on write concurrently
+    orig_image.getRawData ();
     #pragma omp parallel for schedule (dynamic, 16)
     for (int y = 0; y < image.h; ++y)
     {
@@ -290,6 +297,7 @@ struct rotate_template
 
 void rotate (Image& image, double angle, const Image::iterator& background)
 {
+  Profile::Scope profile ("rotate", (uint64_t)image.stride() * image.h);
   angle = fmod (angle, 360);
   if (angle < 0)
     angle += 360;
@@ -318,6 +326,8 @@ void rotate (Image& image, double angle, const Image::iterator& background)
     return;
   }
 
+  // interpolated, needs the actual colors
+  colorspace_de_palette (image);
   codegen<rotate_template> (image, angle, background);
 }
 
@@ -372,6 +382,8 @@ struct copy_crop_rotate_template
     const float cached_sin = sin (angle);
     const float cached_cos = cos (angle);
 
+    // the per thread iterators must not copy on write concurrently
+    image.getRawData ();
     #pragma omp parallel for schedule (dynamic, 16)
     for (unsigned int y = 0; y < h; ++y)
     {
@@ -423,6 +435,7 @@ Image* copy_crop_rotate (Image& image, int x_start, int y_start,
 			 unsigned int w, unsigned int h,
 			 double angle, const Image::iterator& background)
 {
+  colorspace_de_palette (image); // interpolated, and the background is a color
   return codegen_return<Image*, copy_crop_rotate_template> (image, x_start, y_start,
 							    w, h, angle, background);
 }
@@ -449,6 +462,8 @@ struct copy_crop_rotate_nn_template
     const float cached_sin = sin (angle);
     const float cached_cos = cos (angle);
 
+    // the per thread iterators must not copy on write concurrently
+    image.getRawData ();
     #pragma omp parallel for schedule (dynamic, 16)
     for (unsigned int y = 0; y < h; ++y)
     {
@@ -482,6 +497,7 @@ Image* copy_crop_rotate_nn (Image& image, int x_start, int y_start,
 			    unsigned int w, unsigned int h,
 			    double angle, const Image::iterator& background)
 {
+  colorspace_de_palette (image); // the background is a color
   return codegen_return<Image*, copy_crop_rotate_nn_template> (image, x_start, y_start,
 							       w, h, angle, background);
 }
\ No newline at end of file
@@ -28,11 +28,13 @@
 #include "Codecs.hh"
 
 #include "Colorspace.hh"
+#include "Profile.hh"
 
 #include "scale.hh"
 
 void scale (Image& image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale", (uint64_t)image.stride() * image.h);
   if (scalex == 1.0 && scaley == 1.0)
     return;
   
@@ -41,6 +43,9 @@ void scale (Image& image, double scalex, double scaley)
     if (image.getCodec()->scale(image, scalex, scaley))
       return;
   
+  // the interpolating scalers need the actual colors
+  colorspace_de_palette (image);
+  
   if (scalex <= 0.5)
     box_scale (image, scalex, scaley);
   else
@@ -60,6 +65,8 @@ struct nearest_scale_template
     new_image.setResolution (scalex * image.resolutionX(),
 			     scaley * image.resolutionY());
     
+    // the per thread iterators must not copy on write concurrently
+    image.getRawData ();
     #pragma omp parallel for schedule (dynamic, 16)
     for (int y = 0; y < new_image.h; ++y)
     {
@@ -82,6 +89,7 @@ struct nearest_scale_template
 
 void nearest_scale (Image& image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale nearest", (uint64_t)image.stride() * image.h);
   if (scalex == 1.0 && scaley == 1.0)
     return;
   codegen<nearest_scale_template> (image, scalex, scaley);
@@ -111,6 +119,8 @@ struct bilinear_scale_template
       sxxmap[x] = sxmap[x] == (image.w - 1) ? sxmap[x] : sxmap[x] + 1;
     }
     
+    // the per thread iterators must not copy on write concurrently
+    image.getRawData ();
     #pragma omp parallel for schedule (dynamic, 16)
     for (int y = 0; y < new_image.h; ++y)
     {
@@ -151,8 +161,10 @@ struct bilinear_scale_template
 
 void bilinear_scale (Image& image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale bilinear", (uint64_t)image.stride() * image.h);
   if (scalex == 1.0 && scaley == 1.0)
     return;
+  colorspace_de_palette (image);
   codegen<bilinear_scale_template> (image, scalex, scaley);
 }
 
@@ -220,8 +232,10 @@ struct box_scale_template
 
 void box_scale (Image& image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale box", (uint64_t)image.stride() * image.h);
   if (scalex == 1.0 && scaley == 1.0)
     return;
+  colorspace_de_palette (image);
   codegen<box_scale_template> (image, scalex, scaley);
 }
 
@@ -246,8 +260,10 @@ inline Image::iterator CubicConvolution (int distance,
 
 void bicubic_scale (Image& new_image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale bicubic", (uint64_t)new_image.stride() * new_image.h);
   if (scalex == 1.0 && scaley == 1.0)
     return;
+  colorspace_de_palette (new_image);
 
   Image image;
   image.copyTransferOwnership (new_image);
@@ -447,8 +463,10 @@ struct ddt_scale_template
   
 void ddt_scale (Image& image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale ddt", (uint64_t)image.stride() * image.h);
   if (scalex == 1.0 && scaley == 1.0)
     return;
+  colorspace_de_palette (image);
   codegen<ddt_scale_template> (image, scalex, scaley);
 }
 
@@ -456,6 +474,7 @@ void ddt_scale (Image& image, double scalex, double scaley)
 
 void box_scale_grayX_to_gray8 (Image& new_image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale box gray8", (uint64_t)new_image.stride() * new_image.h);
   if (scalex == 1.0 && scaley == 1.0)
     return;
   
@@ -534,6 +553,7 @@ void box_scale_grayX_to_gray8 (Image& new_image, double scalex, double scaley)
 
 void thumbnail_scale (Image& image, double scalex, double scaley)
 {
+  Profile::Scope profile ("scale thumbnail", (uint64_t)image.stride() * image.h);
   // only optimize the regular thumbnail down-scaling
   if (scalex > 1 || scaley > 1)
     return scale(image, scalex, scaley);
@@ -543,6 +563,8 @@ void thumbnail_scale (Image& image, double scalex, double scaley)
     if (image.getCodec()->scale(image, scalex, scaley))
       return;
   
+  colorspace_de_palette (image);
+  
   // quick sub byte scaling
   if (image.bps <= 8 && image.spp == 1) {
     box_scale_grayX_to_gray8(image, scalex, scaley);
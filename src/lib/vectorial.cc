@@ -40,6 +40,11 @@
 #include "agg_bounding_rect.h"
 
 #if WITHFREETYPE == 1
+#include <pthread.h>
+
+#include <list>
+#include <sstream>
+
 #include "agg_font_freetype.h"
 #endif
 
@@ -259,6 +264,103 @@ static bool load_font(font_engine_type& m_feng, const char* fontfile)
   return false;
 }
 
+namespace {
+  // A loaded face with its rendered glyphs. The engine and cache manager
+  // are not reentrant, the user holds the entry's mutex while drawing.
+  struct FontEntry
+  {
+    FontEntry () : fman (feng), users (0) { pthread_mutex_init (&mutex, 0); }
+    ~FontEntry () { pthread_mutex_destroy (&mutex); }
+    
+    font_engine_type feng;
+    font_manager_type fman;
+    pthread_mutex_t mutex;
+    int users; // guarded by font_mutex, not evicted while in use
+  };
+  
+  // Process-wide cache keyed by font file, height and hinting, most
+  // recently used first, so repeated text runs load the face and
+  // rasterize the glyph outlines only once.
+  typedef std::list<std::pair<std::string, FontEntry*> > font_list;
+  const unsigned font_limit = 16;
+  
+  pthread_mutex_t font_mutex = PTHREAD_MUTEX_INITIALIZER;
+  
+  // never destructed, text might be drawn in static destructors
+  font_list& fonts_cached ()
+  {
+    static font_list* l = new font_list;
+    return *l;
+  }
+  
+  // Scoped, exclusive use of a cached font, 0 if it can not be loaded.
+  class FontRef
+  {
+  public:
+    FontRef (const char* fontfile, double height)
+      : entry (0)
+    {
+      std::stringstream key;
+      key << (fontfile ? fontfile : "") << "|" << height << "|" << hinting;
+      
+      pthread_mutex_lock (&font_mutex);
+      font_list& l = fonts_cached ();
+      for (font_list::iterator it = l.begin(); it != l.end(); ++it)
+	if (it->first == key.str()) {
+	  entry = it->second;
+	  l.splice (l.begin(), l, it);
+	  break;
+	}
+      
+      if (!entry) {
+	entry = new FontEntry;
+	entry->feng.height (height);
+	if (!load_font (entry->feng, fontfile)) {
+	  delete entry;
+	  entry = 0;
+	  pthread_mutex_unlock (&font_mutex);
+	  return;
+	}
+	entry->feng.hinting (hinting);
+	entry->feng.height (height);
+	entry->feng.flip_y (true);
+	l.push_front (std::make_pair (key.str(), entry));
+      }
+      ++entry->users;
+      
+      // evict the least recently used, idle fonts
+      for (font_list::iterator it = l.end(); l.size() > font_limit &&
+	     it != l.begin();) {
+	--it;
+	if (it->second->users == 0) {
+	  delete it->second;
+	  it = l.erase (it);
+	}
+      }
+      pthread_mutex_unlock (&font_mutex);
+      
+      pthread_mutex_lock (&entry->mutex);
+      entry->fman.reset_last_glyph (); // no kerning across text runs
+    }
+    
+    ~FontRef ()
+    {
+      if (!entry)
+	return;
+      pthread_mutex_unlock (&entry->mutex);
+      pthread_mutex_lock (&font_mutex);
+      --entry->users;
+      pthread_mutex_unlock (&font_mutex);
+    }
+    
+    operator bool () const { return entry != 0; }
+    FontEntry* operator-> () const { return entry; }
+    
+  private:
+    FontEntry* entry;
+  };
+}
+
 bool Path::drawText (Image& image, const char* text, double height,
 		     const char* fontfile, agg::trans_affine mtx,
 		     filling_rule_t fill,
@@ -276,8 +378,10 @@ bool Path::drawText (Image& image, const char* text, double height,
   renderer_bin ren_bin (ren_base);
   ren_bin.color (agg::rgba (r, g, b, a));
   
-  font_engine_type m_feng;
-  font_manager_type m_fman (m_feng);
+  FontRef font (fontfile, height);
+  if (!font)
+    return false;
+  font_manager_type& m_fman = font->fman;
  
   mtx *= agg::trans_affine_translation(path.last_x(), path.last_y());
   
@@ -292,15 +396,6 @@ bool Path::drawText (Image& image, const char* text, double height,
   m_stroke.width(line_width);
   agg::conv_transform<agg::conv_stroke<agg::conv_curve<font_manager_type::path_adaptor_type> > >
     m_stroke_mtx(m_stroke, mtx);
- 
-  m_feng.height (height);
-  if (!load_font(m_feng, fontfile))
-    return false;
-  
-  m_feng.hinting (hinting);
-  m_feng.height (height);
-  m_feng.flip_y (true);
-  
   
   agg::rect_d bbox(0, 0, -1, -1);
   
@@ -424,15 +519,10 @@ bool Path::drawTextOnPath (Image& image, const char* text, double height,
   tcurve.add_path (smooth);
   // tcurve.preserve_x_scale(m_preserve_x_scale.status());
   
-  font_engine_type m_feng;
-  font_manager_type m_fman (m_feng);
-  
-  // Pipeline to process the vectors glyph paths
-  agg::conv_curve<font_manager_type::path_adaptor_type> m_curves (m_fman.path_adaptor());
-  
-  m_feng.height (height);
-  if (!load_font(m_feng, fontfile))
-      return false;
+  FontRef font (fontfile, height);
+  if (!font)
+    return false;
+  font_manager_type& m_fman = font->fman;
   
   // Transform pipeline
   typedef agg::conv_curve<font_manager_type::path_adaptor_type> conv_font_curve_type;
@@ -445,10 +535,6 @@ bool Path::drawTextOnPath (Image& image, const char* text, double height,
   fsegm.approximation_scale (3.0);
   fcurves.approximation_scale (2.0);
   
-  m_feng.hinting (hinting);
-  m_feng.height (height);
-  m_feng.flip_y (true);
-  
   ras.reset ();
   
   double x = 0, y = 0;
@@ -0,0 +1,125 @@
+/*
+ * Regression tests of the zero-copy sub-image views.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Short Description:
+ *   Crops (views) of shared and exclusive pixel data, written to
+ *   afterwards. Returns non-zero on failure, best run under a memory
+ *   checker such as valgrind or with -fsanitize=address.
+ */
+
+#include <iostream>
+
+#include "Image.hh"
+#include "crop.hh"
+
+static int failures = 0;
+
+#define CHECK(expr) \
+  if (!(expr)) { \
+    std::cerr << __FILE__ << ":" << __LINE__ << ": " << #expr << " failed" << std::endl; \
+    ++failures; \
+  }
+
+// gray8 test page, each pixel is its row plus column
+static void fill (Image& image, int w, int h)
+{
+  image.spp = 1; image.bps = 8;
+  image.resize (w, h);
+  uint8_t* data = image.getRawData ();
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      data[y * w + x] = y + x;
+  image.setRawData ();
+}
+
+static bool matches (const Image& image, int x0, int y0)
+{
+  const uint8_t* data = image.getConstRawData ();
+  for (int y = 0; y < image.h; ++y)
+    for (int x = 0; x < image.w; ++x)
+      if (data[y * image.stride () + x] != (uint8_t)(y0 + y + x0 + x))
+        return false;
+  return true;
+}
+
+// full-width crop below the first row: packed, but not at the allocation start
+static void testFullWidthCrop (bool shared)
+{
+  Image image, copy;
+  fill (image, 64, 48);
+  if (shared)
+    copy = image;
+  
+  crop (image, 0, 10, image.w, image.h - 10);
+  CHECK (image.isView ());
+  CHECK (matches (image, 0, 10));
+  
+  uint8_t* data = image.getRawData ();
+  CHECK (!image.isView ());
+  data[0] = 0xff;
+  data[image.stride () * image.h - 1] = 0xff;
+  image.setRawData ();
+  
+  if (shared)
+    CHECK (matches (copy, 0, 0));
+}
+
+static void testCropResize ()
+{
+  Image image;
+  fill (image, 64, 48);
+  crop (image, 0, 10, image.w, image.h - 10);
+  image.resize (image.w, image.h + 8);
+  uint8_t* data = image.getRawData ();
+  data[image.stride () * image.h - 1] = 0xff;
+  image.setRawData ();
+}
+
+static void testRegionCrop (bool shared)
+{
+  Image image, copy;
+  fill (image, 64, 48);
+  if (shared)
+    copy = image;
+  
+  crop (image, 5, 7, 20, 30);
+  CHECK (image.isView ());
+  CHECK (matches (image, 5, 7));
+  
+  uint8_t* data = image.getRawData ();
+  CHECK (image.stride () == image.w);
+  CHECK (matches (image, 5, 7));
+  data[image.stride () * image.h - 1] = 0xff;
+  image.setRawData ();
+  
+  if (shared)
+    CHECK (matches (copy, 0, 0));
+}
+
+int main ()
+{
+  testFullWidthCrop (false);
+  testFullWidthCrop (true);
+  testCropResize ();
+  testRegionCrop (false);
+  testRegionCrop (true);
+  
+  if (failures)
+    std::cerr << failures << " check(s) failed" << std::endl;
+  return failures ? 1 : 0;
+}
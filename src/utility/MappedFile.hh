@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Short Description:
+ *   Read-only, memory mapped file access. Falls back to reading the
+ *   whole file into memory where mmap is not available.
+ */
+
+#ifndef UTILITY__MAPPEDFILE_HH__
+#define UTILITY__MAPPEDFILE_HH__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <inttypes.h>
+#include <string>
+
+namespace Utility
+{
+  class MappedFile
+  {
+  public:
+    MappedFile () : m_data (0), m_size (0), m_mapped (false) {}
+    MappedFile (const std::string& filename)
+      : m_data (0), m_size (0), m_mapped (false) { Open (filename); }
+    ~MappedFile () { Close (); }
+
+    bool Open (const std::string& filename)
+    {
+      Close ();
+#ifndef _WIN32
+      int fd = open (filename.c_str(), O_RDONLY);
+      if (fd < 0)
+	return false;
+
+      struct stat st;
+      if (fstat (fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+	close (fd);
+	return false;
+      }
+
+      m_size = st.st_size;
+      if (m_size > 0) {
+	void* p = mmap (0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED) {
+	  m_data = (const uint8_t*)p;
+	  m_mapped = true;
+	}
+      }
+      close (fd);
+      if (m_size == 0 || m_mapped)
+	return true;
+#endif
+      // no mmap, or it failed (e.g. some network filesystems)
+      FILE* f = fopen (filename.c_str(), "rb");
+      if (!f)
+	return false;
+      fseek (f, 0, SEEK_END);
+      m_size = ftell (f);
+      fseek (f, 0, SEEK_SET);
+      uint8_t* buffer = (uint8_t*) malloc (m_size ? m_size : 1);
+      if (!buffer || fread (buffer, 1, m_size, f) != m_size) {
+	free (buffer);
+	fclose (f);
+	m_size = 0;
+	return false;
+      }
+      fclose (f);
+      m_data = buffer;
+      return true;
+    }
+
+    void Close ()
+    {
+      if (m_data) {
+#ifndef _WIN32
+	if (m_mapped)
+	  munmap ((void*)m_data, m_size);
+	else
+#endif
+	  free ((void*)m_data);
+      }
+      m_data = 0;
+      m_size = 0;
+      m_mapped = false;
+    }
+
+    const uint8_t* Data () const { return m_data; }
+    size_t Size () const { return m_size; }
+    bool IsMapped () const { return m_mapped; }
+
+  private:
+    // no copies, the mapping is owned
+    MappedFile (const MappedFile&);
+    MappedFile& operator= (const MappedFile&);
+
+    const uint8_t* m_data;
+    size_t m_size;
+    bool m_mapped;
+  };
+
+} // end namespace utility
+
+#endif // UTILITY__MAPPEDFILE_HH__
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH, Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+#include "Prefetch.hh"
+#include "DirIterator.hh"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// the whole file, false on any error
+static bool readFile (const std::string& file, std::string& data)
+{
+  int fd = open (file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  
+  struct stat st;
+  if (fstat (fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close (fd);
+    return false;
+  }
+  
+  data.resize (st.st_size);
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = read (fd, &data[done], data.size() - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  close (fd);
+  
+  data.resize (done);
+  return done == (size_t)st.st_size;
+}
+
+Utility::Prefetch::Prefetch (const std::vector<std::string>& files, unsigned ahead)
+  : m_files (files), m_slots (files.size()), m_ahead (std::max (ahead, 1u)),
+    m_next_read (0), m_next_get (0), m_stop (false)
+{
+  for (size_t i = 0; i < m_slots.size(); ++i)
+    m_slots[i].done = m_slots[i].ok = false;
+  
+  pthread_mutex_init (&m_mutex, 0);
+  pthread_cond_init (&m_cond, 0);
+  
+  const size_t threads = std::min (m_ahead, m_files.size());
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_t thread;
+    if (pthread_create (&thread, 0, &Worker, this) == 0)
+      m_threads.push_back (thread);
+  }
+}
+
+Utility::Prefetch::~Prefetch ()
+{
+  pthread_mutex_lock (&m_mutex);
+  m_stop = true;
+  pthread_cond_broadcast (&m_cond);
+  pthread_mutex_unlock (&m_mutex);
+  
+  for (size_t i = 0; i < m_threads.size(); ++i)
+    pthread_join (m_threads[i], 0);
+  
+  pthread_cond_destroy (&m_cond);
+  pthread_mutex_destroy (&m_mutex);
+}
+
+void* Utility::Prefetch::Worker (void* arg)
+{
+  Prefetch* self = (Prefetch*) arg;
+  
+  pthread_mutex_lock (&self->m_mutex);
+  while (true) {
+    // stay within the read ahead window
+    while (!self->m_stop && self->m_next_read < self->m_files.size() &&
+	   self->m_next_read >= self->m_next_get + self->m_ahead)
+      pthread_cond_wait (&self->m_cond, &self->m_mutex);
+    
+    if (self->m_stop || self->m_next_read >= self->m_files.size())
+      break;
+    
+    const size_t i = self->m_next_read++;
+    pthread_mutex_unlock (&self->m_mutex);
+    
+    std::string data;
+    bool ok = self->m_files[i] != "-" && readFile (self->m_files[i], data);
+    
+    pthread_mutex_lock (&self->m_mutex);
+    self->m_slots[i].data.swap (data);
+    self->m_slots[i].ok = ok;
+    self->m_slots[i].done = true;
+    pthread_cond_broadcast (&self->m_cond);
+  }
+  pthread_mutex_unlock (&self->m_mutex);
+  
+  return 0;
+}
+
+bool Utility::Prefetch::Next (std::string& file, std::string& data, bool& ok)
+{
+  pthread_mutex_lock (&m_mutex);
+  if (m_next_get >= m_files.size()) {
+    pthread_mutex_unlock (&m_mutex);
+    return false;
+  }
+  
+  const size_t i = m_next_get;
+  // no thread (could be started), read it here
+  if (m_threads.empty() && !m_slots[i].done) {
+    m_slots[i].ok = m_files[i] != "-" && readFile (m_files[i], m_slots[i].data);
+    m_slots[i].done = true;
+  }
+  
+  while (!m_slots[i].done)
+    pthread_cond_wait (&m_cond, &m_mutex);
+  
+  file = m_files[i];
+  data.clear ();
+  data.swap (m_slots[i].data);
+  ok = m_slots[i].ok;
+  
+  ++m_next_get;
+  pthread_cond_broadcast (&m_cond);
+  pthread_mutex_unlock (&m_mutex);
+  
+  return true;
+}
+
+void Utility::Prefetch::ExpandDirectories (std::vector<std::string>& files)
+{
+  std::vector<std::string> expanded;
+  for (size_t i = 0; i < files.size(); ++i)
+    {
+      struct stat st;
+      if (files[i] == "-" || stat (files[i].c_str(), &st) != 0 ||
+	  !S_ISDIR(st.st_mode)) {
+	expanded.push_back (files[i]);
+	continue;
+      }
+      
+      std::vector<std::string> entries;
+      DirList dir (files[i]);
+      for (DirList::Iterator it = dir.Begin(); it != dir.End(); ++it) {
+	const std::string path = files[i] + '/' + *it;
+	FileType type = it.Type();
+	if (type.IsSymlink() || type.IsUnknown())
+	  type = stat (path.c_str(), &st) == 0 ? st.st_mode : 0;
+	if (type.IsFile())
+	  entries.push_back (path);
+      }
+      std::sort (entries.begin(), entries.end());
+      expanded.insert (expanded.end(), entries.begin(), entries.end());
+    }
+  files.swap (expanded);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH, Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Short Description:
+ *   Batch input: reads the next files ahead on background threads,
+ *   so that processing one file does not wait for the (network) file
+ *   system to deliver the next. The data is handed out in the order
+ *   given, e.g. for decoding from a memistream.
+ */
+
+#ifndef UTILITY__PREFETCH_HH__
+#define UTILITY__PREFETCH_HH__
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+namespace Utility
+{
+  class Prefetch
+  {
+  public:
+    // at most ahead files are held in memory, read by as many threads
+    Prefetch (const std::vector<std::string>& files, unsigned ahead = 4);
+    ~Prefetch ();
+    
+    /* The next file, waits until it is read. Returns false at the end.
+       On read errors (or for "-", stdin) ok is false and the caller
+       is expected to open the file itself. */
+    bool Next (std::string& file, std::string& data, bool& ok);
+    
+    // replaces directories by the regular files within, sorted by name
+    static void ExpandDirectories (std::vector<std::string>& files);
+    
+  private:
+    // no copies, the threads refer to it
+    Prefetch (const Prefetch&);
+    Prefetch& operator= (const Prefetch&);
+    
+    static void* Worker (void* arg);
+    
+    struct Slot {
+      std::string data;
+      bool done, ok;
+    };
+    
+    std::vector<std::string> m_files;
+    std::vector<Slot> m_slots;
+    size_t m_ahead, m_next_read, m_next_get;
+    bool m_stop;
+    
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    std::vector<pthread_t> m_threads;
+  };
+  
+} // end namespace utility
+
+#endif // UTILITY__PREFETCH_HH__
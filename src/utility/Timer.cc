@@ -94,8 +94,8 @@ uint64_t Utility::TimebaseTimer::Delta () const
 
 uint64_t Utility::TimebaseTimer::Value () const
 {
-#if defined(__i386__) || defined(_MSC_VER)
-#ifdef _MSC_VER
+#if defined(__i386__) || (defined(_MSC_VER) && !defined(__GNUC__))
+#if defined(_MSC_VER) && !defined(__GNUC__)
   uint32_t lo, hi;
   __asm rdtsc
   __asm mov lo, eax
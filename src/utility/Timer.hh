@@ -61,7 +61,7 @@ namespace Utility
     inline uint64_t PerSecond () const { return 1000000; }
     
     uint64_t Value () const {
-#if !defined(_MSC_VER)
+#ifndef _WIN32
       timeval t_time;
       gettimeofday (&t_time, NULL);
       
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH, Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Short Description:
+ *   Read-only stream over a memory range (e.g. a MappedFile), without
+ *   copying it. Codecs can detect it via the rdbuf() and access the
+ *   bytes directly.
+ *   Write-only stream into a caller provided range or a growing,
+ *   malloc()ed buffer the caller can take over, without the copies of
+ *   a std::ostringstream.
+ */
+
+#ifndef UTILITY__MEMSTREAM_HH__
+#define UTILITY__MEMSTREAM_HH__
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <iostream>
+#include <algorithm>
+
+namespace Utility {
+
+class membuf : public std::streambuf
+{
+public:
+  membuf (const char* data, size_t size) {
+    char* p = const_cast<char*> (data);
+    setg (p, p, p + size);
+  }
+
+  const char* data () const { return eback(); }
+  size_t size () const { return egptr() - eback(); }
+  // the current read position
+  size_t tell () const { return gptr() - eback(); }
+
+  // the memory stream of the stream, if any
+  static membuf* of (std::istream* stream) {
+    return dynamic_cast<membuf*> (stream->rdbuf());
+  }
+
+protected:
+  virtual pos_type seekoff (off_type off, std::ios_base::seekdir dir,
+			    std::ios_base::openmode which = std::ios_base::in) {
+    if (dir == std::ios_base::cur)
+      off += gptr() - eback();
+    else if (dir == std::ios_base::end)
+      off += egptr() - eback();
+    return seekpos (off, which);
+  }
+
+  virtual pos_type seekpos (pos_type pos,
+			    std::ios_base::openmode which = std::ios_base::in) {
+    const off_type off = pos;
+    if (!(which & std::ios_base::in) || off < 0 || off > egptr() - eback())
+      return pos_type (off_type (-1));
+    setg (eback(), eback() + off, egptr());
+    return pos;
+  }
+
+  virtual std::streamsize showmanyc () {
+    return egptr() - gptr();
+  }
+};
+
+class memistream : public std::istream
+{
+public:
+  memistream (const char* data, size_t size)
+  : std::istream(&buf), buf(data, size) {
+  }
+
+protected:
+  membuf buf;
+};
+
+// Into a fixed range the bytes that do not fit are dropped, but still
+// counted, so the caller can retry with size() bytes. Seeking (e.g. by
+// the TIFF and PDF codecs) is supported within what was written.
+class memobuf : public std::streambuf
+{
+public:
+  // fixed, caller provided range
+  memobuf (char* data, size_t size)
+    : growing (false), capacity (size), over (0), written (0) {
+    setp (data, data + size);
+  }
+
+  // growing, malloc()ed buffer
+  memobuf ()
+    : growing (true), capacity (0), over (0), written (0) {
+    setp (0, 0);
+  }
+
+  ~memobuf () {
+    if (growing)
+      free (pbase());
+  }
+
+  char* data () const { return pbase(); }
+  // all bytes written, including the dropped ones
+  size_t size () const { return std::max (written, tell ()); }
+  // whether all the bytes fit the fixed range
+  bool complete () const { return size () <= capacity; }
+
+  // hand the growing buffer over, to be free()d by the caller
+  char* release () {
+    char* p = pbase();
+    if (growing) {
+      setp (0, 0);
+      capacity = over = written = 0;
+    }
+    return p;
+  }
+
+protected:
+  size_t tell () const { return (pptr() - pbase()) + over; }
+
+  // pbump() only takes an int, move beyond 2 GiB in steps
+  void advance (size_t n) {
+    for (; n > (size_t)INT_MAX; n -= INT_MAX)
+      pbump (INT_MAX);
+    pbump ((int)n);
+  }
+
+  // make room for at least n more bytes at the put position
+  bool grow (size_t n) {
+    const size_t pos = tell ();
+    size_t cap = capacity ? capacity : 64 * 1024;
+    while (cap < pos + n)
+      cap *= 2;
+    char* p = (char*) realloc (pbase(), cap);
+    if (!p)
+      return false;
+    setp (p, p + cap);
+    advance (pos);
+    capacity = cap;
+    return true;
+  }
+
+  virtual int_type overflow (int_type c) {
+    if (traits_type::eq_int_type (c, traits_type::eof()))
+      return traits_type::not_eof (c);
+    if (growing) {
+      if (!grow (1))
+	return traits_type::eof();
+      *pptr() = traits_type::to_char_type (c);
+      pbump (1);
+    }
+    else
+      ++over;
+    return c;
+  }
+
+  virtual std::streamsize xsputn (const char* s, std::streamsize n) {
+    std::streamsize room = epptr() - pptr();
+    if (growing && room < n && grow (n))
+      room = n;
+    const std::streamsize fit = std::min (room, n);
+    memcpy (pptr(), s, fit);
+    advance (fit);
+    if (fit < n) {
+      if (growing)
+	return fit;
+      over += n - fit;
+    }
+    return n;
+  }
+
+  virtual pos_type seekoff (off_type off, std::ios_base::seekdir dir,
+			    std::ios_base::openmode which = std::ios_base::out) {
+    if (dir == std::ios_base::cur)
+      off += tell ();
+    else if (dir == std::ios_base::end)
+      off += size ();
+    return seekpos (off, which);
+  }
+
+  virtual pos_type seekpos (pos_type pos,
+			    std::ios_base::openmode which = std::ios_base::out) {
+    const off_type off = pos;
+    if (!(which & std::ios_base::out) || off < 0 || (size_t)off > size ())
+      return pos_type (off_type (-1));
+    written = size ();
+    setp (pbase(), pbase() + capacity);
+    if ((size_t)off <= capacity) {
+      advance (off);
+      over = 0;
+    }
+    else {
+      advance (capacity);
+      over = off - capacity;
+    }
+    return pos;
+  }
+
+  bool growing;
+  size_t capacity, over, written;
+};
+
+class memostream : public std::ostream
+{
+public:
+  memostream ()
+  : std::ostream(&buf) {
+  }
+
+  memostream (char* data, size_t size)
+  : std::ostream(&buf), buf(data, size) {
+  }
+
+  memobuf* rdbuf () { return &buf; }
+
+protected:
+  memobuf buf;
+};
+
+}
+
+#endif
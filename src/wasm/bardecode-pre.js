@@ -0,0 +1,92 @@
+/*
+ * Browser (WebAssembly) interface of the barcode recognition.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Module.decodeBarcodes (data, width, height, options) with data an
+ * encoded (JPEG) image, or with width and height a RGBA frame such as
+ * the ImageData of a canvas the camera video is drawn into. Options are
+ * codes (a bitmask of Module.codes, 0 for all), max_codes to stop after
+ * (0 for all) and threads. Returns [{code, type, x, y, direction}, ...].
+ *
+ * Loaded as worker it answers messages, the data best transferred:
+ *   {cmd: 'decodeBarcodes', id: 1, data: ..., width: w, height: h}
+ * with {id: 1, codes: [...]} or {id: 1, error: '...'}, and it posts
+ * {cmd: 'ready'} once loaded. Threads block, so with threads it must be
+ * used from a worker, and the page must be cross-origin isolated.
+ */
+
+Module['codes'] = {
+  'ean8': 1, 'ean13': 2, 'upca': 4, 'ean': 7, 'upce': 8,
+  'code128': 16, 'gs1_128': 32, 'code39': 64, 'code25i': 512
+};
+
+// the pthread pool size of the build
+Module['threads'] = Math.min (4, (typeof navigator !== 'undefined' &&
+				  navigator['hardwareConcurrency']) || 1);
+
+Module['decodeBarcodes'] = function (data, width, height, options) {
+  options = options || {};
+  var bytes = ArrayBuffer.isView (data) ?
+    new Uint8Array (data.buffer, data.byteOffset, data.byteLength) :
+    new Uint8Array (data);
+  var codes = options['codes'] || 0;
+  var max_codes = options['max_codes'] || 0;
+  var threads = options['threads'] || Module['threads'];
+
+  var json;
+  if (width) {
+    // taken over and converted to gray in place
+    var frame = Module['_barcodeFrame'] (width, height);
+    Module['HEAPU8'].set (bytes.subarray (0, width * height * 4), frame);
+    json = Module['_decodeBarcodesRGBA'] (frame, width, height,
+					  codes, max_codes, threads);
+  }
+  else {
+    var ptr = Module['_malloc'] (bytes.length);
+    Module['HEAPU8'].set (bytes, ptr);
+    json = Module['_decodeBarcodes'] (ptr, bytes.length,
+				      codes, max_codes, threads);
+    Module['_free'] (ptr);
+  }
+
+  if (!json)
+    throw new Error ('unsupported image');
+  var result = JSON.parse (Module['UTF8ToString'] (json));
+  Module['_free'] (json);
+  return result;
+};
+
+// only called in the main instance, not in the pthread workers
+Module['onRuntimeInitialized'] = function () {
+  if (typeof WorkerGlobalScope === 'undefined')
+    return;
+
+  self.addEventListener ('message', function (ev) {
+    var msg = ev.data;
+    if (!msg || msg['cmd'] !== 'decodeBarcodes')
+      return;
+    try {
+      var codes = Module['decodeBarcodes'] (msg['data'], msg['width'],
+					    msg['height'], msg);
+      self.postMessage ({'id': msg['id'], 'codes': codes});
+    }
+    catch (e) {
+      self.postMessage ({'id': msg['id'], 'error': e.toString ()});
+    }
+  });
+  self.postMessage ({'cmd': 'ready'});
+};
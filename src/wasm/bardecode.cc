@@ -0,0 +1,112 @@
+/*
+ * Browser (WebAssembly) entry points of the barcode recognition.
+ * Copyright (C) 2013 René Rebe, ExactCODE GmbH Germany.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2. A copy of the GNU General
+ * Public License can be found in the file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT-
+ * ABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * Alternatively, commercial licensing options are available from the
+ * copyright holder ExactCODE GmbH Germany.
+ */
+
+/* Called by bardecode-pre.js with the image in the module's memory, no
+ * virtual file system involved: either an encoded image, or a RGBA
+ * camera frame (canvas ImageData) in a buffer from barcodeFrame() that
+ * is converted to gray in place. codes is a bitmask of BarDecode::code_t
+ * (0 for all), the scan stops after max_codes (0 for all) and uses as
+ * many threads. The result is a JSON array, to be free()d by the caller:
+ *   [{"code":"...","type":"ean13","x":0,"y":0,"direction":1}, ...]
+ *
+ * Built by "make wasm" in the top-level directory, "make wasm-check"
+ * links the same sources natively.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <sstream>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#include "Image.hh"
+#include "Codecs.hh"
+#include "Colorspace.hh"
+#include "BufferPool.hh"
+#include "memstream.hh"
+
+#include "Decoder.hh"
+
+using namespace BarDecode;
+
+static char* decode (const Image& image, int codes, int max_codes, int threads)
+{
+  Decoder decoder (codes ? (codes_t)codes : ean|code128|gs1_128|code39|code25i,
+		   any_direction, max_codes);
+  decoder.scan (image, threads);
+
+  std::ostringstream json;
+  json << "[";
+  const std::vector<scanner_result_t>& results = decoder.results ();
+  for (unsigned int i = 0; i < results.size(); ++i) {
+    const scanner_result_t& r = results[i];
+    json << (i ? "," : "") << "{\"code\":\"";
+    for (std::string::const_iterator it = r.code.begin(); it != r.code.end(); ++it) {
+      if (*it == '"' || *it == '\\')
+	json << '\\';
+      json << *it;
+    }
+    json << "\",\"type\":\"" << r.type << "\",\"x\":" << r.x << ",\"y\":" << r.y
+	 << ",\"direction\":" << (int)r.direction << "}";
+  }
+  json << "]";
+  return strdup (json.str().c_str());
+}
+
+extern "C" {
+
+// a buffer for a width x height RGBA frame, decodeBarcodesRGBA takes it
+EMSCRIPTEN_KEEPALIVE
+uint8_t* barcodeFrame (int width, int height)
+{
+  return (uint8_t*) BufferPool::Allocate ((size_t)width * height * 4);
+}
+
+EMSCRIPTEN_KEEPALIVE
+char* decodeBarcodesRGBA (uint8_t* frame, int width, int height,
+			  int codes, int max_codes, int threads)
+{
+  Image image;
+  image.spp = 4;
+  image.bps = 8;
+  image.w = width;
+  image.h = height;
+  image.setRawDataWithoutDelete (frame);
+
+  colorspace_rgb8_to_gray8 (image, 4);
+  return decode (image, codes, max_codes, threads);
+}
+
+EMSCRIPTEN_KEEPALIVE
+char* decodeBarcodes (const char* data, int size,
+		      int codes, int max_codes, int threads)
+{
+  Image image;
+  Utility::memistream stream (data, size);
+  if (!ImageCodec::Read (&stream, image, "", "gray8"))
+    return 0;
+  return decode (image, codes, max_codes, threads);
+}
+
+}